@@ -7,23 +7,208 @@
 #include <stdexcept>
 #include <memory>
 #include <iostream>
+#include <cstdlib>
 #include <numeric>
-#include <random>
+#include <atomic>
+#include <limits>
+#include <mutex>
+
+#include "mc/Random.h"
+#include "mc/DigitalSequence.h"
+#include "mc/Statistics.h"
+#include "mc/ThreadPool.h"
+#include <string>
 
 using namespace adept;
 
+// A new active number with the given value, recorded as one statement from its local gradient:
+// gradient[i] is its derivative with respect to *inputs[i]. Used where the derivatives are known
+// analytically, in place of the statements that evaluating the expression would record.
+template <int N>
+adouble localStatement(double value, const adouble* const (&inputs)[N], const double (&gradient)[N]) {
+    adouble y;
+    y.set_value(value);
+    adept::uIndex indices[N];
+    for (int i = 0; i < N; ++i) indices[i] = inputs[i]->gradient_index();
+    active_stack()->push_statement(y.gradient_index(), indices, gradient, N);
+    return y;
+}
+
+// Position of the last lookup in a curve, owned by the caller. Queries with nondecreasing x then find
+// their interval in O(1) instead of by binary search.
+struct CurveCursor {
+    size_t index;
+    CurveCursor() : index(0) {}
+};
+
 class Curve1D {
 public:
     virtual ~Curve1D() {}  // Virtual destructor to ensure proper cleanup of derived classes
 
     // Virtual method that must be implemented by derived classes
     virtual adouble operator()(adouble x) const = 0;  
+
+    // Virtual method evaluating with a lookup cursor; curves that cannot use it ignore it
+    virtual adouble operator()(adouble x, CurveCursor& cursor) const {
+        return (*this)(x);
+    }
+
+    // Virtual methods returning the integral of the curve, and of its square, over [x0, x1]. The defaults
+    // use composite Simpson's rule on subintervals of at most 1/1024, as in base-code, and record every
+    // evaluation; curves with closed forms override them.
+    virtual adouble integral(const adouble& x0, const adouble& x1) const {
+        return simpson(x0, x1, false);
+    }
+
+    virtual adouble integralOfSquare(const adouble& x0, const adouble& x1) const {
+        return simpson(x0, x1, true);
+    }
+
+private:
+    adouble simpson(const adouble& x0, const adouble& x1, bool square) const {
+        const int panels = std::max(1, static_cast<int>(std::ceil(std::fabs(x1.value() - x0.value()) * 512.0)));
+        adouble h = (x1 - x0) / (2 * panels);
+        CurveCursor cursor;
+        adouble sum = 0.0;
+        for (int j = 0; j <= 2 * panels; ++j) {
+            adouble f = (*this)(j == 2 * panels ? x1 : adouble(x0 + j * h), cursor);
+            const double weight = (j == 0 || j == 2 * panels) ? 1.0 : (j % 2 == 1 ? 4.0 : 2.0);
+            sum += weight * (square ? adouble(f * f) : f);
+        }
+        return sum * h / 3.0;
+    }
 };
 
 class LinearInterpolation : public Curve1D {
 private:
     std::vector<adouble> x_vals;
     std::vector<adouble> y_vals;
+    std::vector<double> x_grid;  // Values of x_vals, searched without touching the tape
+    bool uniform;  // Whether x_vals is equally spaced, so that the interval of x can be computed directly
+    double inv_spacing;
+    mutable std::vector<double> d_knot_x, d_knot_y;  // Scratch derivatives of an integral with respect to the knots
+    mutable std::vector<adept::uIndex> statement_indices;  // Scratch statement of an integral
+    mutable std::vector<double> statement_gradient;
+
+    // Index idx with x_vals[idx] < x <= x_vals[idx + 1], i.e. the one std::lower_bound gives, for
+    // x_vals.front() < x <= x_vals.back(). Walks a few intervals from the guess, then falls back to a
+    // binary search, so the guess only affects the speed and never the result.
+    size_t locate(double x, size_t guess) const {
+        const size_t last = x_grid.size() - 2;
+        if (guess > last) guess = last;
+        for (int steps = 0; steps < 4; ++steps) {
+            if (!(x_grid[guess] < x)) --guess;
+            else if (x_grid[guess + 1] < x) ++guess;
+            else return guess;
+        }
+        return std::distance(x_grid.begin(), std::lower_bound(x_grid.begin(), x_grid.end(), x)) - 1;
+    }
+
+    size_t uniformGuess(double x) const {
+        return static_cast<size_t>((x - x_grid.front()) * inv_spacing);
+    }
+
+    void checkRange(double x) const {
+        if (x_vals.empty()) {
+            throw std::runtime_error("Interpolation vectors are empty.");
+        }
+        if (x < x_grid.front() || x > x_grid.back()) {
+            throw std::out_of_range("X value out of interpolation range.");
+        }
+    }
+
+    // Linear interpolation between knots idx and idx + 1, recorded as one statement
+    adouble interpolate(const adouble& x, size_t idx) const {
+        const adouble &x0 = x_vals[idx], &x1 = x_vals[idx + 1];
+        const adouble &y0 = y_vals[idx], &y1 = y_vals[idx + 1];
+        const double inv_width = 1.0 / (x1.value() - x0.value());
+        const double t = (x.value() - x0.value()) * inv_width;
+        const double slope = (y1.value() - y0.value()) * inv_width;
+
+        const adouble* const inputs[] = {&x, &x0, &x1, &y0, &y1};
+        const double gradient[] = {slope, slope * (t - 1.0), -slope * t, 1.0 - t, t};
+        return localStatement(y0.value() + t * (y1.value() - y0.value()), inputs, gradient);
+    }
+
+    // Value between knots idx and idx + 1, without recording
+    double value(double x, size_t idx) const {
+        const double t = (x - x_grid[idx]) / (x_grid[idx + 1] - x_grid[idx]);
+        return y_vals[idx].value() + t * (y_vals[idx + 1].value() - y_vals[idx].value());
+    }
+
+    // Exact integral over [x0, x1] of the curve or of its square, summed over the linear pieces as in
+    // base-code, and recorded as one statement. A piece from (u, f_u) to (v, f_v) contributes
+    // (v - u)(f_u + f_v)/2, or (v - u)(f_u^2 + f_u f_v + f_v^2)/3. Its derivative with respect to a knot
+    // value y_k is the integral of g'(f) times the weight of y_k in f, which is linear over the piece;
+    // moving the knot x_k instead changes f by -slope times that weight, and the ends contribute +-g(f).
+    adouble integrate(const adouble& x0, const adouble& x1, bool square) const {
+        checkRange(x0.value());
+        checkRange(x1.value());
+        const bool reversed = x1.value() < x0.value();
+        const double sign = reversed ? -1.0 : 1.0;
+        const adouble& lower = reversed ? x1 : x0;
+        const adouble& upper = reversed ? x0 : x1;
+        const double a = lower.value(), b = upper.value();
+
+        const size_t first = a == x_grid.front() ? 0 : locate(a, uniform ? uniformGuess(a) : 0);
+        size_t idx = first;
+        const double fa = a == x_grid.front() ? y_vals.front().value() : value(a, idx);
+        double u = a, fu = fa, fb;
+        double sum = 0.0;
+        d_knot_x.assign(2, 0.0);
+        d_knot_y.assign(2, 0.0);
+        for (;;) {
+            const bool last = b <= x_grid[idx + 1];
+            const double v = last ? b : x_grid[idx + 1];
+            const double fv = last ? value(b, idx) : y_vals[idx + 1].value();
+            if (v > u) {
+                // Weights of y_idx at u and v; y_(idx + 1) has one minus these
+                const double width = x_grid[idx + 1] - x_grid[idx];
+                const double wu = (x_grid[idx + 1] - u) / width, wv = (x_grid[idx + 1] - v) / width;
+                double left, right;
+                if (square) {
+                    sum += (v - u) * (fu * fu + fu * fv + fv * fv) / 3.0;
+                    left = (v - u) * (2.0 * fu * wu + fu * wv + fv * wu + 2.0 * fv * wv) / 3.0;
+                    right = (v - u) * (fu + fv) - left;
+                }
+                else {
+                    sum += (v - u) * (fu + fv) * 0.5;
+                    left = (v - u) * (wu + wv) * 0.5;
+                    right = (v - u) - left;
+                }
+                const double slope = (y_vals[idx + 1].value() - y_vals[idx].value()) / width;
+                d_knot_y[idx - first] += left;
+                d_knot_y[idx + 1 - first] += right;
+                d_knot_x[idx - first] -= slope * left;
+                d_knot_x[idx + 1 - first] -= slope * right;
+            }
+            if (last) {
+                fb = fv;
+                break;
+            }
+            u = v;
+            fu = fv;
+            ++idx;
+            d_knot_x.push_back(0.0);
+            d_knot_y.push_back(0.0);
+        }
+
+        statement_indices.assign(1, lower.gradient_index());
+        statement_gradient.assign(1, -sign * (square ? fa * fa : fa));
+        statement_indices.push_back(upper.gradient_index());
+        statement_gradient.push_back(sign * (square ? fb * fb : fb));
+        for (size_t k = 0; k < d_knot_y.size(); ++k) {
+            statement_indices.push_back(x_vals[first + k].gradient_index());
+            statement_gradient.push_back(sign * d_knot_x[k]);
+            statement_indices.push_back(y_vals[first + k].gradient_index());
+            statement_gradient.push_back(sign * d_knot_y[k]);
+        }
+        adouble y;  // The only object returned, so that it is constructed in place rather than copied
+        y.set_value(sign * sum);
+        active_stack()->push_statement(y.gradient_index(), statement_indices.data(), statement_gradient.data(),
+                                       statement_indices.size());
+        return y;
+    }
 
 public:
     LinearInterpolation(const std::vector<adouble>& x, const std::vector<adouble>& y) {
@@ -32,28 +217,44 @@ public:
         }
         x_vals = x;
         y_vals = y;
+        for (auto& xi : x_vals) x_grid.push_back(xi.value());
+
+        // Detect an equally spaced grid, such as the weekly time points
+        uniform = x_grid.size() > 2 && x_grid.back() > x_grid.front();
+        if (uniform) {
+            const double spacing = (x_grid.back() - x_grid.front()) / (x_grid.size() - 1);
+            inv_spacing = 1.0 / spacing;
+            for (size_t i = 0; i < x_grid.size() && uniform; ++i) {
+                uniform = std::fabs(x_grid[i] - (x_grid.front() + i * spacing)) <= 1e-9 * spacing;
+            }
+        }
     }
 
     virtual adouble operator()(adouble x) const {
-        if (x_vals.empty()) {
-            throw std::runtime_error("Interpolation vectors are empty.");
-        }
-        if (x < x_vals.front() || x > x_vals.back()) {
-            throw std::out_of_range("X value out of interpolation range.");
-        }
+        const double xv = x.value();
+        checkRange(xv);
+        if (xv == x_grid.front()) return y_vals.front();
+        if (uniform) return interpolate(x, locate(xv, uniformGuess(xv)));
 
         // Lower bound finds the first element which does not compare less than x
-        auto low = std::lower_bound(x_vals.begin(), x_vals.end(), x);
-        if (low != x_vals.begin()) {
-            // Find indices of the two points forming the interpolation interval
-            size_t idx = std::distance(x_vals.begin(), low) - 1;
-            size_t idx_next = idx + 1;
+        auto low = std::lower_bound(x_grid.begin(), x_grid.end(), xv);
+        return interpolate(x, std::distance(x_grid.begin(), low) - 1);
+    }
 
-            // Linear interpolation formula
-            adouble t = (x - x_vals[idx]) / (x_vals[idx_next] - x_vals[idx]);
-            return y_vals[idx] + t * (y_vals[idx_next] - y_vals[idx]);
-        }
-        return y_vals.front();
+    virtual adouble operator()(adouble x, CurveCursor& cursor) const {
+        const double xv = x.value();
+        checkRange(xv);
+        if (xv == x_grid.front()) return y_vals.front();
+        cursor.index = locate(xv, uniform ? uniformGuess(xv) : cursor.index);
+        return interpolate(x, cursor.index);
+    }
+
+    virtual adouble integral(const adouble& x0, const adouble& x1) const {
+        return integrate(x0, x1, false);
+    }
+
+    virtual adouble integralOfSquare(const adouble& x0, const adouble& x1) const {
+        return integrate(x0, x1, true);
     }
 };
 
@@ -72,20 +273,124 @@ public:
     virtual int dims() const = 0; // Pure virtual method to get the dimension of the model
 
     virtual void reset() {} // Virtual method to reset the model to its initial state
+
+    // The active variables carried from one evolve() to the next. Checkpointed adjoints save their
+    // values and later restore them to re-record the steps that follow.
+    virtual std::vector<adouble*> stepState() = 0;
+
+    // Passive state carried from one evolve() to the next, as for Trade::passiveState
+    virtual std::vector<int*> passiveState() {
+        return std::vector<int*>();
+    }
+
+    // Virtual method announcing the step sizes of the simulation up front, so that the model can record
+    // per-step quantities once, before the paths; steps taken afterwards may still deviate from this grid
+    virtual void setTimeGrid(const std::vector<double>& step_sizes) {}
 };
 
 class LogNormalProcess : public Model {
+public:
+    // How the coefficients of a step are obtained from the curves, as in base-code
+    enum class StepScheme {
+        Exact,    // Drift int r - 0.5 int vol^2 and variance int vol^2 over the step: exact for steps of any length
+        EndPoint  // r and vol sampled at the end of the step and held constant over it
+    };
+
 private:
+    StepScheme scheme;
     std::vector<std::shared_ptr<Curve1D>> r_curves;  // Vector of shared pointers for interest rate curves
     std::vector<std::shared_ptr<Curve1D>> vol_curves;  // Vector of shared pointers for volatility curves
     std::vector<adouble> state;  // Current state of the model, one for each dimension
     const std::vector<adouble> initial_values;  // Initial values for each dimension
     adouble current_time;  // Current time of the process
+    std::vector<CurveCursor> r_cursors, vol_cursors;  // Lookup positions in the curves, rewound on reset
+
+    // Integrals of r and of vol^2 over every step of the time grid, with the dimension varying fastest,
+    // recorded by setTimeGrid. Paths recorded on top of them, such as those rewound to a mark taken after
+    // setTimeGrid, then reference them instead of recording the integrals again.
+    std::vector<double> grid_step_sizes, grid_start_times;
+    std::vector<adouble> grid_rate_integrals, grid_variances;
+    int step_index;  // Number of steps taken since the last reset
+
+    // Records the state update of dimension i from the integrals over the step:
+    // S_t_plus_dt = S_t * exp(int r - 0.5 int vol^2 + sqrt(int vol^2) * z), as one statement that updates
+    // the state in place
+    void exactStep(size_t i, const adouble& rate_integral, const adouble& variance, const adouble& z) {
+        const double S = state[i].value(), R = rate_integral.value(), V = variance.value();
+        const double sqrt_V = std::sqrt(V);
+        const double S_t_plus_dt = S * std::exp(R - 0.5 * V + sqrt_V * z.value());
+        const adouble* const inputs[] = {&state[i], &rate_integral, &variance, &z};
+        const double gradient[] = {
+            S_t_plus_dt / S,
+            S_t_plus_dt,
+            S_t_plus_dt * (0.5 * z.value() / sqrt_V - 0.5),
+            S_t_plus_dt * sqrt_V
+        };
+        state[i].set_value(S_t_plus_dt);
+        adept::uIndex indices[4];
+        for (int j = 0; j < 4; ++j) indices[j] = inputs[j]->gradient_index();
+        active_stack()->push_statement(state[i].gradient_index(), indices, gradient, 4);
+    }
+
+    // Advances the state and the time by dt under the current scheme
+    void advance(const adouble& dt, const std::vector<adouble>& normals) {
+        if (scheme == StepScheme::Exact) advanceExact(dt, normals);
+        else advanceEndPoint(dt, normals);
+        ++step_index;
+    }
+
+    // The integrals come from the grid if the step is the next one on it, starting where that grid step
+    // starts, as in base-code's step table, and are otherwise recorded from the curves
+    void advanceExact(const adouble& dt, const std::vector<adouble>& normals) {
+        const size_t n = state.size();
+        if (step_index < static_cast<int>(grid_step_sizes.size()) && dt.value() == grid_step_sizes[step_index] &&
+            current_time.value() == grid_start_times[step_index]) {
+            for (size_t i = 0; i < n; ++i) {
+                exactStep(i, grid_rate_integrals[step_index * n + i], grid_variances[step_index * n + i], normals[i]);
+            }
+        }
+        else {
+            adouble end_time = current_time + dt;
+            for (size_t i = 0; i < n; ++i) {
+                exactStep(i, r_curves[i]->integral(current_time, end_time), vol_curves[i]->integralOfSquare(current_time, end_time),
+                          normals[i]);
+            }
+        }
+        current_time += dt;
+    }
+
+    void advanceEndPoint(const adouble& dt, const std::vector<adouble>& normals) {
+        current_time += dt;
+
+        const double h = dt.value(), sqrt_h = std::sqrt(h);
+        for (size_t i = 0; i < state.size(); ++i) {
+            adouble r_t = (*r_curves[i])(current_time, r_cursors[i]);  // Interest rate for the current dimension
+            adouble vol_t = (*vol_curves[i])(current_time, vol_cursors[i]);  // Volatility for the current dimension
+
+            // S_t_plus_dt = S_t * exp((r - vol^2 / 2) * dt + vol * sqrt(dt) * z), recorded as one
+            // statement that updates the state in place
+            const double S = state[i].value(), r = r_t.value(), vol = vol_t.value(), z = normals[i].value();
+            const double S_t_plus_dt = S * std::exp((r - 0.5 * vol * vol) * h + vol * sqrt_h * z);
+            const adouble* const inputs[] = {&state[i], &r_t, &vol_t, &dt, &normals[i]};
+            const double gradient[] = {
+                S_t_plus_dt / S,
+                S_t_plus_dt * h,
+                S_t_plus_dt * (sqrt_h * z - vol * h),
+                S_t_plus_dt * (r - 0.5 * vol * vol + 0.5 * vol * z / sqrt_h),
+                S_t_plus_dt * vol * sqrt_h
+            };
+            state[i].set_value(S_t_plus_dt);  // Update state for this dimension
+            adept::uIndex indices[5];
+            for (int j = 0; j < 5; ++j) indices[j] = inputs[j]->gradient_index();
+            active_stack()->push_statement(state[i].gradient_index(), indices, gradient, 5);
+        }
+    }
 
 public:
     // Constructor takes vectors of curves and initial values for multi-dimensional support
     LogNormalProcess(const std::vector<std::shared_ptr<Curve1D>>& r, const std::vector<std::shared_ptr<Curve1D>>& vol, const std::vector<adouble>& _initial_values)
-        : r_curves(r), vol_curves(vol), initial_values(_initial_values), state(_initial_values), current_time(0.0) {
+        : scheme(StepScheme::Exact), r_curves(r), vol_curves(vol), initial_values(_initial_values), state(_initial_values), current_time(0.0),
+          r_cursors(r.size()), vol_cursors(vol.size()), step_index(0) {
         if (r_curves.size() != vol_curves.size() || r_curves.size() != initial_values.size()) {
             throw std::invalid_argument("All vectors must have the same size.");
         }
@@ -104,6 +409,35 @@ public:
     void reset() override {
         state = initial_values;  // Reset state to initial values
         current_time = 0.0;  // Reset time
+        step_index = 0;
+        r_cursors.assign(r_cursors.size(), CurveCursor());
+        vol_cursors.assign(vol_cursors.size(), CurveCursor());
+    }
+
+    // Records the integrals of the curves over every step of the grid, accumulating the time exactly
+    // as evolve() does so that the steps of the grid find their row
+    void setTimeGrid(const std::vector<double>& step_sizes) override {
+        const size_t n = state.size();
+        grid_step_sizes = step_sizes;
+        grid_start_times.clear();
+        grid_rate_integrals.clear();
+        grid_variances.clear();
+        grid_rate_integrals.reserve(step_sizes.size() * n);
+        grid_variances.reserve(step_sizes.size() * n);
+        double t = 0.0;
+        for (double dt : step_sizes) {
+            grid_start_times.push_back(t);
+            const adouble t0 = t, t1 = t + dt;
+            for (size_t i = 0; i < n; ++i) {
+                grid_rate_integrals.push_back(r_curves[i]->integral(t0, t1));
+                grid_variances.push_back(vol_curves[i]->integralOfSquare(t0, t1));
+            }
+            t += dt;
+        }
+    }
+
+    void setStepScheme(StepScheme _scheme) {
+        scheme = _scheme;
     }
 
     void evolve(adouble dt, const std::vector<adouble>& normals) override {
@@ -111,23 +445,24 @@ public:
             throw std::invalid_argument("Normal vector size must match the number of dimensions.");
         }
 
-        current_time += dt;
-
-        for (size_t i = 0; i < state.size(); ++i) {
-            adouble r_t = (*r_curves[i])(current_time);  // Interest rate for the current dimension
-            adouble vol_t = (*vol_curves[i])(current_time);  // Volatility for the current dimension
-
-            adouble drift = (r_t - 0.5 * vol_t * vol_t) * dt;
-            adouble diffusion = vol_t * sqrt(dt) * normals[i];
-            adouble S_t_plus_dt = state[i] * exp(drift + diffusion);
-
-            state[i] = S_t_plus_dt;  // Update state for this dimension
-        }
+        advance(dt, normals);
     }
 
     const std::vector<adouble>& getState() const override {
         return state;
     }
+
+    // The cursors are only lookup hints, so they need not be restored
+    std::vector<adouble*> stepState() override {
+        std::vector<adouble*> variables;
+        for (auto& s : state) variables.push_back(&s);
+        variables.push_back(&current_time);
+        return variables;
+    }
+
+    std::vector<int*> passiveState() override {
+        return {&step_index};
+    }
 };
 
 // write trade base class with evolve(t, state) and payoff() methods, write implementation of this base class AsianOption with start time and end time
@@ -144,6 +479,22 @@ public:
     virtual adouble payoff() const = 0;
 
     virtual void reset() {}  // Virtual method to reset the trade to its initial state
+
+    // The active variables carried from one evolve() to the next, as for Model::stepState
+    virtual std::vector<adouble*> stepState() = 0;
+
+    // Passive state carried from one evolve() to the next, such as counters
+    virtual std::vector<int*> passiveState() {
+        return std::vector<int*>();
+    }
+
+    // Virtual method returning the sorted dates at which the trade needs the model state, given the
+    // monitoring grid of the simulation, as in base-code. The simulation only stops on the union of the
+    // dates of all trades, so trades must ignore dates they did not ask for. By default the trade
+    // observes every grid date.
+    virtual std::vector<double> observationDates(const std::vector<double>& grid) {
+        return grid;
+    }
 };
 
 class AsianOption : public Trade {
@@ -151,24 +502,60 @@ private:
     const int asset_id;                    // ID of the underlying asset
     const adouble strike;                   // Strike price of the option
     const adouble start_time, end_time;     // Start and end times for averaging
+    std::shared_ptr<const std::vector<double>> fixings;  // Averaging dates, if known; shared by copies
+    int next_fixing;                 // Index of the next fixing to record
     adouble sum_prices;               // Sum of prices for averaging
     int count;                       // Count of prices added
 
 public:
+    // Averages over every monitoring date in [start, end]
     AsianOption(int asset_id, adouble strike, adouble start, adouble end)
         : asset_id(asset_id), strike(strike), start_time(start), end_time(end)
     {
         reset();
     }
 
+    // Averages over the given fixing dates, e.g. monthly
+    AsianOption(int asset_id, adouble strike, const std::vector<double>& fixing_dates)
+        : asset_id(asset_id), strike(strike),
+          start_time(fixing_dates.empty() ? 0.0 : *std::min_element(fixing_dates.begin(), fixing_dates.end())),
+          end_time(fixing_dates.empty() ? 0.0 : *std::max_element(fixing_dates.begin(), fixing_dates.end()))
+    {
+        std::vector<double> dates(fixing_dates);
+        std::sort(dates.begin(), dates.end());
+        dates.erase(std::unique(dates.begin(), dates.end()), dates.end());
+        fixings = std::make_shared<const std::vector<double>>(dates);
+        reset();
+    }
+
     void reset() override {
+        next_fixing = 0;
         sum_prices = 0.0;
         count = 0;
     }
 
-    // Record the price only if it's within the averaging period
+    // A window option fixes on the grid dates inside its averaging period
+    std::vector<double> observationDates(const std::vector<double>& grid) override {
+        if (!fixings || fixings->empty()) {
+            std::vector<double> dates;
+            for (double t : grid) {
+                if (t >= start_time.value() && t <= end_time.value()) dates.push_back(t);
+            }
+            fixings = std::make_shared<const std::vector<double>>(dates);
+        }
+        return *fixings;
+    }
+
+    // Record the price only on a fixing date, or, if the dates were never resolved, within the averaging period
     void evolve(adouble t, const std::vector<adouble>& state) override {
-        if (t >= start_time && t <= end_time) {
+        if (fixings) {
+            if (next_fixing < static_cast<int>(fixings->size()) && t.value() == (*fixings)[next_fixing]) {
+                sum_prices += state[asset_id];
+                count++;
+                next_fixing++;
+            }
+        }
+        else if (t >= start_time && t <= end_time) {
             adouble price = state[asset_id];
             sum_prices += price;
             count++;
@@ -178,54 +565,65 @@ public:
     // Calculate the payoff based on the average price
     adouble payoff() const override {
         if (count == 0) return 0;  // Avoid division by zero
-        adouble average_price = sum_prices / count;
-        return max(average_price - strike, 0.0);  // Payoff for a call option
+
+        // max(sum_prices / count - strike, 0) for a call option, recorded as one statement
+        const double intrinsic = sum_prices.value() / count - strike.value();
+        const bool in_the_money = intrinsic > 0.0;
+        const adouble* const inputs[] = {&sum_prices, &strike};
+        const double gradient[] = {in_the_money ? 1.0 / count : 0.0, in_the_money ? -1.0 : 0.0};
+        return localStatement(in_the_money ? intrinsic : 0.0, inputs, gradient);
     }
-};
 
-double price(
-    const std::vector<double>& initial_values,
-    const std::vector<double>& time_points,
-    const std::vector<double>& rates1,
-    const std::vector<double>& rates2,
-    const std::vector<double>& vols1,
-    const std::vector<double>& vols2,
-    std::vector<double>& d_initial_values,
-    std::vector<double>& d_rates1,
-    std::vector<double>& d_rates2,
-    std::vector<double>& d_vols1,
-    std::vector<double>& d_vols2
-) {
+    std::vector<adouble*> stepState() override {
+        return {&sum_prices};
+    }
 
-    // Define constants for the simulation
-    const int num_paths = 10000;
-    const int num_days = 252;  // Assume 252 trading days in a year
-    const double dt = 1.0 / num_days;  // Time step for each day
-    // Random number generator setup
-    std::mt19937 rng(17);
-    std::normal_distribution<double> dist(0.0, 1.0);
-
-    // Initialize path-wise derivatives to zero
-    d_initial_values.resize(initial_values.size()); std::fill(d_initial_values.begin(), d_initial_values.end(), 0.0);
-    d_rates1.resize(rates1.size()); std::fill(d_rates1.begin(), d_rates1.end(), 0.0);
-    d_rates2.resize(rates2.size()); std::fill(d_rates2.begin(), d_rates2.end(), 0.0);
-    d_vols1.resize(vols1.size()); std::fill(d_vols1.begin(), d_vols1.end(), 0.0);
-    d_vols2.resize(vols2.size()); std::fill(d_vols2.begin(), d_vols2.end(), 0.0);
-
-    // Running the Monte Carlo simulation
-    double total_payoff = 0.0;
-
-    for (int i = 0; i < num_paths; ++i) {
-        adept::Stack stack;
-        stack.new_recording(); // Start recording
-
-        std::vector<adouble> a_initial_values(initial_values.begin(), initial_values.end());
-        std::vector<adouble> a_time_points(time_points.begin(), time_points.end());
-        std::vector<adouble> a_rates1(rates1.begin(), rates1.end());
-        std::vector<adouble> a_rates2(rates2.begin(), rates2.end());
-        std::vector<adouble> a_vols1(vols1.begin(), vols1.end());
-        std::vector<adouble> a_vols2(vols2.begin(), vols2.end());
+    std::vector<int*> passiveState() override {
+        return {&next_fixing, &count};
+    }
+};
 
+// One worker's share of the pricing. It owns a Stack, its own copies of the inputs registered on it,
+// and the curves, model and trades built from them. All of these are recorded once and marked, so
+// every path is recorded on top of the setup and then rewound. Adept's active stack is thread-local,
+// so a simulation must be created, used and destroyed on the same thread.
+//
+// The paths follow base-code's MonteCarloEngine: the monitoring grid is t_k = k / num_days for
+// k = 1..num_days, the model jumps straight from one of the trades' observation dates to the next with
+// the exact step scheme, and the normals are indexed by event number, so with the same normals both
+// price the same discretisation.
+class AdjointSimulation {
+public:
+    static const int num_days = 252;  // Monitoring grid of 252 trading days in a year
+    static const int num_trades = 2;
+
+    AdjointSimulation(
+        const std::vector<double>& initial_values,
+        const std::vector<double>& time_points,
+        const std::vector<double>& rates1,
+        const std::vector<double>& rates2,
+        const std::vector<double>& vols1,
+        const std::vector<double>& vols2,
+        bool use_quasi,
+        size_t memory_budget = 0,  // Bytes for the tape of a path and its checkpoints; 0 records each path whole
+        bool optimize_tape = false  // Shrink the tape of each whole path with Stack::optimize before its reverse pass
+    )
+        : a_initial_values(initial_values.begin(), initial_values.end()),
+          a_time_points(time_points.begin(), time_points.end()),
+          a_rates1(rates1.begin(), rates1.end()),
+          a_rates2(rates2.begin(), rates2.end()),
+          a_vols1(vols1.begin(), vols1.end()),
+          a_vols2(vols2.begin(), vols2.end()),
+          use_quasi(use_quasi),
+          optimize_tape(optimize_tape),
+          dims(static_cast<int>(initial_values.size())),
+          rng(17),
+          z(dims), normals(dims),
+          sample((1 + num_trades) * (1 + numInputs()))
+    {
+        // The inputs above are registered before the recording starts: a statement initializing an
+        // input would zero its adjoint during the reverse pass
+        stack.new_recording();
 
         // Create curves using shared pointers
         std::shared_ptr<Curve1D> r_curve1 = std::make_shared<LinearInterpolation>(a_time_points, a_rates1);
@@ -236,58 +634,395 @@ double price(
         // Create the LogNormalProcess model for two assets
         std::vector<std::shared_ptr<Curve1D>> r_curves = {r_curve1, r_curve2};
         std::vector<std::shared_ptr<Curve1D>> vol_curves = {vol_curve1, vol_curve2};
-        LogNormalProcess model(r_curves, vol_curves, a_initial_values);
+        model.reset(new LogNormalProcess(r_curves, vol_curves, a_initial_values));
 
         // Define two Asian options
-        AsianOption option1(0, 100.0, 0.0, 1.0);  // Asian option on the first asset
-        AsianOption option2(1, 100.0, 0.25, 0.75);  // Asian option on the second asset
+        option1.reset(new AsianOption(0, 100.0, 0.0, 1.0));  // Asian option on the first asset
+        option2.reset(new AsianOption(1, 100.0, 0.25, 0.75));  // Asian option on the second asset
+
+        step_state = model->stepState();
+        passive_state = model->passiveState();
+        for (Trade* option : {option1.get(), option2.get()}) {
+            for (adouble* a : option->stepState()) step_state.push_back(a);
+            for (int* n : option->passiveState()) passive_state.push_back(n);
+        }
 
-        if (i != 0) {
-            model.reset();  // Reset the model to initial values
-            option1.reset();
-            option2.reset();
+        // Union of the observation dates, and the steps between them
+        std::vector<double> grid(num_days);
+        for (int k = 0; k < num_days; ++k) grid[k] = (k + 1) * (1.0 / num_days);
+        for (Trade* option : {option1.get(), option2.get()}) {
+            std::vector<double> dates = option->observationDates(grid);
+            schedule.insert(schedule.end(), dates.begin(), dates.end());
+        }
+        std::sort(schedule.begin(), schedule.end());
+        schedule.erase(std::unique(schedule.begin(), schedule.end()), schedule.end());
+        if (schedule.empty() || schedule.front() <= 0.0) {
+            throw std::invalid_argument("Observation dates must be positive, and there must be at least one.");
+        }
+        num_events = static_cast<int>(schedule.size());
+        for (int j = 0; j < num_events; ++j) step_sizes.push_back(schedule[j] - (j == 0 ? 0.0 : schedule[j - 1]));
+        model->setTimeGrid(step_sizes);  // Part of the setup, so the step integrals are recorded once
+        block_steps = num_events;
+        if (use_quasi) {
+            sequence.reset(new DigitalSequence(dims * num_events, true, 17));
+            bridge.reset(new BrownianBridge(step_sizes));
+            path_normals.resize(dims * num_events);
+            bridge_normals.resize(dims * num_events);
         }
 
-        for (int day = 0; day < num_days; ++day) {
-            adouble current_time = day * dt;
-            std::vector<adouble> normals = {dist(rng), dist(rng)};
-            model.evolve(dt, normals);
-            const std::vector<adouble>& state = model.getState();
+        setup = stack.mark();
 
-            option1.evolve(current_time, state);
-            option2.evolve(current_time, state);
+        if (memory_budget > 0) {
+            // Measure the tape of one step inside both averaging windows, then drop it
+            resetPath();
+            const size_t before = stack.memory();
+            step(0, num_events / 2);
+            const size_t tape_per_step = stack.memory() - before;
+            stack.rewind_to(setup);
+
+            const size_t per_checkpoint = step_state.size() * sizeof(double) + passive_state.size() * sizeof(int);
+            block_steps = stepsPerBlock(memory_budget, tape_per_step, per_checkpoint, num_events);
         }
-        adouble total_payoff_path = option1.payoff() + option2.payoff();
+        const int num_blocks = (num_events + block_steps - 1) / block_steps;
+        checkpoints.resize(num_blocks * step_state.size());
+        passive_checkpoints.resize(num_blocks * passive_state.size());
+        state_adjoints.resize(num_trades * step_state.size());
+    }
+
+    // Number of inputs the gradients are taken with respect to
+    size_t numInputs() const {
+        return a_initial_values.size() + a_rates1.size() + a_rates2.size() + a_vols1.size() + a_vols2.size();
+    }
 
-        total_payoff += total_payoff_path.value();
-        total_payoff_path.set_gradient(1.0);  // Set the payoff as the objective function
-        stack.compute_adjoint();  // Run the adjoint algorithm
+    // Simulates paths [first_path, first_path + n_paths), adding to the statistics one sample per
+    // path: the total payoff, then its gradient with respect to the initial values, rates1, rates2,
+    // vols1 and vols2, then the payoff and gradient of each trade in the same layout. The draws
+    // depend only on the path index, so any split of the paths into calls gives the same samples.
+    void run(int first_path, int n_paths, RunningStatistics& statistics) {
+        // Quasi-random setup: coordinate k * dims + i of point i of the sequence feeds bridge normal k of asset i
+        if (use_quasi) sequence->skipTo(first_path);
 
-        // Accumulate the derivatives
-        for (size_t j = 0; j < initial_values.size(); ++j) {
-            d_initial_values[j] += a_initial_values[j].get_gradient();
+        const size_t n = 1 + numInputs();
+        for (int i = first_path; i < first_path + n_paths; ++i) {
+            if (use_quasi) {
+                sequence->next(bridge_normals.data());
+                NormalGenerator::toNormals(bridge_normals.data(), dims * num_events);
+                for (int j = 0; j < dims; ++j) {
+                    bridge->transform(bridge_normals.data() + j, dims, path_normals.data() + j, dims, 1);
+                }
+            }
+
+            std::fill(sample.begin(), sample.end(), 0.0);
+            if (block_steps < num_events) runCheckpointed(i);
+            else runWhole(i);
+
+            // Accumulate the totals of the payoffs and derivatives of each trade
+            double* total = sample.data();
+            for (int t = 0; t < num_trades; ++t) {
+                const double* x = total + (1 + t) * n;
+                for (size_t j = 0; j < n; ++j) total[j] += x[j];
+            }
+            statistics.add(sample.data());
         }
-        for (size_t j = 0; j < rates1.size(); ++j) {
-            d_rates1[j] += a_rates1[j].get_gradient();
+    }
+
+    // Counters of the tape of this simulation: sizes of the last path's recording, and reallocations and
+    // recording and reverse-pass times since construction
+    adept::StackStatistics stackStatistics() const {
+        return stack.statistics();
+    }
+
+private:
+    // Largest number of steps per block for which the tape of one block plus one checkpoint per
+    // block fits in the budget, or if none does, the number needing the least memory
+    static int stepsPerBlock(size_t budget, size_t tape_per_step, size_t per_checkpoint, int steps) {
+        int best = 1;
+        size_t best_memory = std::numeric_limits<size_t>::max();
+        for (int b = steps; b >= 1; --b) {
+            const size_t memory = b * tape_per_step + ((steps + b - 1) / b) * per_checkpoint;
+            if (memory <= budget) return b;
+            if (memory < best_memory) {
+                best = b;
+                best_memory = memory;
+            }
         }
-        for (size_t j = 0; j < rates2.size(); ++j) {
-            d_rates2[j] += a_rates2[j].get_gradient();
+        return best;
+    }
+
+    // Drops the recording of the previous path and resets the model and options
+    void resetPath() {
+        stack.rewind_to(setup);
+        model->reset();
+        option1->reset();
+        option2->reset();
+    }
+
+    // Records one event of a path: the model step to the event date and the options' observations
+    void step(int path, int event) {
+        if (use_quasi) {
+            std::copy(&path_normals[event * dims], &path_normals[(event + 1) * dims], z.begin());
+        }
+        else {
+            rng.fill(path, event, dims, z.data());
+        }
+        for (size_t j = 0; j < z.size(); ++j) normals[j] = z[j];
+        model->evolve(step_sizes[event], normals);
+        const std::vector<adouble>& state = model->getState();
+
+        option1->evolve(schedule[event], state);
+        option2->evolve(schedule[event], state);
+    }
+
+    // Records the whole path and takes the adjoint of every trade in one reverse pass
+    void runWhole(int path) {
+        resetPath();
+        for (int event = 0; event < num_events; ++event) step(path, event);
+        adouble payoffs[num_trades] = {option1->payoff(), option2->payoff()};
+
+        if (optimize_tape) {
+            // Only the payoffs are seeded, so whatever they do not depend on can go
+            adept::uIndex outputs[num_trades];
+            for (int t = 0; t < num_trades; ++t) outputs[t] = payoffs[t].gradient_index();
+            stack.optimize(setup, outputs, num_trades);
+        }
+
+        // One adjoint lane per trade: a single reverse pass gives every trade's gradient
+        for (int t = 0; t < num_trades; ++t) payoffs[t].set_gradient_lane(t, 1.0);
+        stack.compute_adjoint_vector(num_trades);
+
+        double payoff_values[num_trades];
+        for (int t = 0; t < num_trades; ++t) payoff_values[t] = payoffs[t].value();
+        addTrades(payoff_values);
+    }
+
+    // Records the path a block of steps at a time, keeping only the state at the start of each
+    // block, then re-records the blocks from the last to the first and runs the reverse pass of
+    // each, carrying the adjoints of the state from the end of a block to the one before and those
+    // of the setup's variables to the end, where the setup is swept once. Takes a second forward
+    // pass in exchange for a tape of one block.
+    void runCheckpointed(int path) {
+        const int num_blocks = static_cast<int>(checkpoints.size() / step_state.size());
+        const size_t n_state = step_state.size();
+        const size_t n_passive = passive_state.size();
+
+        resetPath();
+        for (int b = 0; b < num_blocks; ++b) {
+            if (b > 0) {
+                for (size_t k = 0; k < n_state; ++k) checkpoints[b * n_state + k] = step_state[k]->value();
+                for (size_t k = 0; k < n_passive; ++k) passive_checkpoints[b * n_passive + k] = *passive_state[k];
+                stack.rewind_to(setup);  // The values carry on, only the tape is dropped
+            }
+            for (int event = b * block_steps; event < std::min((b + 1) * block_steps, num_events); ++event) step(path, event);
         }
-        for (size_t j = 0; j < vols1.size(); ++j) {
-            d_vols1[j] += a_vols1[j].get_gradient();
+
+        double payoff_values[num_trades];
+        for (int b = num_blocks - 1; b >= 0; --b) {
+            // The adjoints the later blocks left in the setup are kept, so that the setup is swept
+            // once, after the first block
+            if (b == num_blocks - 1) stack.rewind_to(setup);
+            else stack.rewind_keeping_adjoint_lanes(setup);
+            if (b == 0) {
+                model->reset();
+                option1->reset();
+                option2->reset();
+            }
+            else {
+                // Setting the values records nothing, so the state variables are inputs of this block
+                for (size_t k = 0; k < n_state; ++k) step_state[k]->set_value(checkpoints[b * n_state + k]);
+                for (size_t k = 0; k < n_passive; ++k) *passive_state[k] = passive_checkpoints[b * n_passive + k];
+            }
+            for (int event = b * block_steps; event < std::min((b + 1) * block_steps, num_events); ++event) step(path, event);
+
+            // The reverse pass runs over the block only. The state variables were defined in the
+            // setup too, so their adjoints are taken out afterwards: they belong to the start of the
+            // block and seed the end of the block before.
+            if (b == num_blocks - 1) {
+                adouble payoffs[num_trades] = {option1->payoff(), option2->payoff()};
+                for (int t = 0; t < num_trades; ++t) {
+                    payoffs[t].set_gradient_lane(t, 1.0);
+                    payoff_values[t] = payoffs[t].value();
+                }
+            }
+            else {
+                // Each state variable keeps its gradient index from block to block
+                for (int t = 0; t < num_trades; ++t) {
+                    for (size_t k = 0; k < n_state; ++k) {
+                        step_state[k]->set_gradient_lane(t, state_adjoints[t * n_state + k]);
+                    }
+                }
+            }
+            stack.compute_adjoint_vector(num_trades, setup, stack.mark());
+            for (int t = 0; t < num_trades; ++t) {
+                for (size_t k = 0; k < n_state; ++k) {
+                    state_adjoints[t * n_state + k] = step_state[k]->get_gradient_lane(t);
+                    step_state[k]->set_gradient_lane(t, 0.0);
+                }
+            }
         }
-        for (size_t j = 0; j < vols2.size(); ++j) {
-            d_vols2[j] += a_vols2[j].get_gradient();
+        stack.compute_adjoint_vector(num_trades, adept::StackMark(), setup);
+        addTrades(payoff_values);
+    }
+
+    // Adds the gradients of each trade's adjoint lane to the sample, and sets the payoffs if given
+    void addTrades(const double* payoffs) {
+        const size_t n = 1 + numInputs();
+        for (int t = 0; t < num_trades; ++t) {
+            double* x = sample.data() + (1 + t) * n;
+            if (payoffs) x[0] = payoffs[t];
+            addGradients(t, x + 1);
         }
     }
 
-    // Calculate the average payoff for each option
-    double price = total_payoff / num_paths;
+    // Adds the gradients of one adjoint lane with respect to the inputs, in input order
+    void addGradients(int lane, double* x) const {
+        for (const adouble& a : a_initial_values) *x++ += a.get_gradient_lane(lane);
+        for (const adouble& a : a_rates1) *x++ += a.get_gradient_lane(lane);
+        for (const adouble& a : a_rates2) *x++ += a.get_gradient_lane(lane);
+        for (const adouble& a : a_vols1) *x++ += a.get_gradient_lane(lane);
+        for (const adouble& a : a_vols2) *x++ += a.get_gradient_lane(lane);
+    }
+
+    // Declared first so that it is created before, and destroyed after, every adouble below
+    adept::Stack stack;
+
+    std::vector<adouble> a_initial_values, a_time_points, a_rates1, a_rates2, a_vols1, a_vols2;
+    std::unique_ptr<LogNormalProcess> model;
+    std::unique_ptr<AsianOption> option1, option2;
+    adept::StackMark setup;  // End of the recording of the setup
+
+    const bool use_quasi;  // Scrambled quasi-random points with a Brownian bridge instead of pseudo-random normals
+    const bool optimize_tape;  // Shrink the tape of each whole path before its reverse pass
+    const int dims;
+    std::vector<double> schedule, step_sizes;  // Event dates and the steps that reach them
+    int num_events;
+    int block_steps;  // Steps per block of a checkpointed path, or num_events
+    std::vector<adouble*> step_state;  // Active state carried between steps by the model and options
+    std::vector<int*> passive_state;  // Passive state carried between steps by the options
+    std::vector<double> checkpoints;  // Values of step_state at the start of each block
+    std::vector<int> passive_checkpoints;  // Values of passive_state at the start of each block
+    std::vector<double> state_adjoints;  // Adjoints of step_state at the end of the current block, one row per trade
+    NormalGenerator rng;
+    std::unique_ptr<DigitalSequence> sequence;  // Only with use_quasi
+    std::unique_ptr<BrownianBridge> bridge;
+    std::vector<double> path_normals, bridge_normals;  // Normals of one quasi-random path, after and before the bridge
+    std::vector<double> z;  // Normals of one step
+    std::vector<adouble> normals;
+    std::vector<double> sample;
+};
+
+// Prices the options and their gradients on num_threads threads (0 means one per core). The paths
+// are simulated in fixed batches handed out to the threads as they become free, each thread with
+// its own AdjointSimulation. Every batch accumulates its own statistics, and these are merged in
+// batch order at the end, so the results are the same for any number of threads.
+double price_parallel(
+    const std::vector<double>& initial_values,
+    const std::vector<double>& time_points,
+    const std::vector<double>& rates1,
+    const std::vector<double>& rates2,
+    const std::vector<double>& vols1,
+    const std::vector<double>& vols2,
+    std::vector<double>& d_initial_values,
+    std::vector<double>& d_rates1,
+    std::vector<double>& d_rates2,
+    std::vector<double>& d_vols1,
+    std::vector<double>& d_vols2,
+    int num_threads,
+    bool use_quasi = false,  // Scrambled quasi-random points with a Brownian bridge instead of pseudo-random normals
+    RunningStatistics* path_statistics = nullptr,  // If given, receives the statistics of the path samples (see AdjointSimulation::run)
+    size_t memory_budget = 0,  // If nonzero, bytes of tape and checkpoints per thread for a checkpointed adjoint
+    bool optimize_tape = false,  // Shrink the tape of each whole path with Stack::optimize
+    std::vector<adept::StackStatistics>* stack_statistics = nullptr  // If given, receives the tape statistics of each thread
+) {
+    // Define constants for the simulation
+    const int num_paths = 10000;
+    const int batch_size = 250;
+    const int num_batches = (num_paths + batch_size - 1) / batch_size;
+#ifdef ADEPT_STACK_THREAD_UNSAFE
+    num_threads = 1;  // The active stack is a single global shared by all threads
+#endif
+
+    const size_t num_inputs = initial_values.size() + rates1.size() + rates2.size() + vols1.size() + vols2.size();
+    const size_t num_samples = (1 + AdjointSimulation::num_trades) * (1 + num_inputs);
+    std::vector<RunningStatistics> batch_statistics(num_batches, RunningStatistics(num_samples));
+
+    // One task per thread: each records the setup once, then takes batches until none are left
+    ThreadPool pool(num_threads);
+    std::atomic<int> next_batch(0);
+    std::mutex stack_statistics_mutex;
+    if (stack_statistics) stack_statistics->clear();
+    pool.parallelFor(pool.size(), [&](int, int) {
+        if (next_batch.load() >= num_batches) return;
+        AdjointSimulation simulation(initial_values, time_points, rates1, rates2, vols1, vols2, use_quasi,
+                                     memory_budget, optimize_tape);
+        for (int batch = next_batch++; batch < num_batches; batch = next_batch++) {
+            const int first_path = batch * batch_size;
+            simulation.run(first_path, std::min(batch_size, num_paths - first_path), batch_statistics[batch]);
+        }
+        if (stack_statistics) {
+            std::lock_guard<std::mutex> lock(stack_statistics_mutex);
+            stack_statistics->push_back(simulation.stackStatistics());
+        }
+    });
+
+    RunningStatistics statistics(num_samples);
+    for (const RunningStatistics& s : batch_statistics) statistics.merge(s);
+
+    // The price and its derivatives are the path averages
+    size_t k = 0;
+    double price = statistics.mean(k++);
+    d_initial_values.resize(initial_values.size());
+    for (auto& d : d_initial_values) d = statistics.mean(k++);
+    d_rates1.resize(rates1.size());
+    for (auto& d : d_rates1) d = statistics.mean(k++);
+    d_rates2.resize(rates2.size());
+    for (auto& d : d_rates2) d = statistics.mean(k++);
+    d_vols1.resize(vols1.size());
+    for (auto& d : d_vols1) d = statistics.mean(k++);
+    d_vols2.resize(vols2.size());
+    for (auto& d : d_vols2) d = statistics.mean(k++);
+    if (path_statistics) *path_statistics = statistics;
 
     return price;
 }
 
-int main() {
+// Single-threaded pricing, identical in results to price_parallel
+double price(
+    const std::vector<double>& initial_values,
+    const std::vector<double>& time_points,
+    const std::vector<double>& rates1,
+    const std::vector<double>& rates2,
+    const std::vector<double>& vols1,
+    const std::vector<double>& vols2,
+    std::vector<double>& d_initial_values,
+    std::vector<double>& d_rates1,
+    std::vector<double>& d_rates2,
+    std::vector<double>& d_vols1,
+    std::vector<double>& d_vols2,
+    bool use_quasi = false,  // Scrambled quasi-random points with a Brownian bridge instead of pseudo-random normals
+    RunningStatistics* path_statistics = nullptr  // If given, receives the statistics of the path payoffs and gradients
+) {
+    return price_parallel(initial_values, time_points, rates1, rates2, vols1, vols2,
+                          d_initial_values, d_rates1, d_rates2, d_vols1, d_vols2,
+                          1, use_quasi, path_statistics);
+}
+
+int main(int argc, char* argv[]) {
+    // Usage: adept-code [num_threads] [quasi] [checkpoint[=KB]] [optimize] [stats] [spill=DIR]
+    int num_threads = 0;  // Default to one thread per core
+    bool use_quasi = false;
+    size_t memory_budget = 0;
+    bool optimize_tape = false;
+    bool print_stack_statistics = false;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "quasi") use_quasi = true;
+        else if (arg == "checkpoint") memory_budget = 1;  // Less than any block: the least memory
+        else if (arg.compare(0, 11, "checkpoint=") == 0) memory_budget = std::atol(arg.c_str() + 11) * 1024;
+        else if (arg == "optimize") optimize_tape = true;
+        else if (arg == "stats") print_stack_statistics = true;
+        else if (arg.compare(0, 6, "spill=") == 0) adept::set_stack_spill_directory(arg.substr(6));
+        else num_threads = std::atoi(arg.c_str());
+    }
 
     std::vector<double> initial_values = {100.0, 100.0};  // Starting prices for each asset
 
@@ -313,27 +1048,55 @@ int main() {
     }
 
     // Calculate the price of two Asian options using the Monte Carlo simulation
-    double option_price = price(
+    RunningStatistics statistics;
+    std::vector<adept::StackStatistics> stack_statistics;
+    double option_price = price_parallel(
         initial_values, time_points, rates1, rates2, vols1, vols2
         , d_initial_values, d_rates1, d_rates2, d_vols1, d_vols2
+        , num_threads, use_quasi, &statistics, memory_budget, optimize_tape
+        , print_stack_statistics ? &stack_statistics : nullptr
     );
 
-    std::cout << "Asian option price: " << option_price << std::endl;
+    // Standard errors assume independent paths, so they do not measure the error with quasi-random points.
+    // Each line reports the next statistic, k; its value and error are read before anything is streamed.
+    size_t k = 0;
+    auto report = [&](const std::string& label, double value) {
+        const double error = statistics.standardError(k++);
+        std::cout << label << value << " (standard error " << error << ")" << std::endl;
+    };
+    report("Asian option price: ", option_price);
 
     for (size_t i = 0; i < initial_values.size(); ++i) {
-        std::cout << "Gradient of price with respect to S" << i << ": " << d_initial_values[i] << std::endl;
+        report("Gradient of price with respect to S" + std::to_string(i) + ": ", d_initial_values[i]);
     }
     for (size_t i = 0; i < rates1.size(); ++i) {
-        std::cout << "Gradient of price with respect to r1[" << i << "]: " << d_rates1[i] << std::endl;
+        report("Gradient of price with respect to r1[" + std::to_string(i) + "]: ", d_rates1[i]);
     }
     for (size_t i = 0; i < rates2.size(); ++i) {
-        std::cout << "Gradient of price with respect to r2[" << i << "]: " << d_rates2[i] << std::endl;
+        report("Gradient of price with respect to r2[" + std::to_string(i) + "]: ", d_rates2[i]);
     }
     for (size_t i = 0; i < vols1.size(); ++i) {
-        std::cout << "Gradient of price with respect to vol1[" << i << "]: " << d_vols1[i] << std::endl;
+        report("Gradient of price with respect to vol1[" + std::to_string(i) + "]: ", d_vols1[i]);
     }
     for (size_t i = 0; i < vols2.size(); ++i) {
-        std::cout << "Gradient of price with respect to vol2[" << i << "]: " << d_vols2[i] << std::endl;
+        report("Gradient of price with respect to vol2[" + std::to_string(i) + "]: ", d_vols2[i]);
+    }
+
+    // Each trade's price and spot gradients, from its own adjoint lane
+    for (int t = 0; t < AdjointSimulation::num_trades; ++t) {
+        const double price = statistics.mean(k);
+        report("Price of Asian option " + std::to_string(t + 1) + ": ", price);
+        for (size_t i = 0; i < initial_values.size(); ++i) {
+            const double gradient = statistics.mean(k);
+            report("  Gradient with respect to S" + std::to_string(i) + ": ", gradient);
+        }
+        k += rates1.size() + rates2.size() + vols1.size() + vols2.size();
+    }
+
+    // The tape counters of each thread, one "name value" line per counter
+    for (size_t i = 0; i < stack_statistics.size(); ++i) {
+        std::cout << "Stack statistics of thread " << i << ":\n";
+        stack_statistics[i].print(std::cout);
     }
 
 
@@ -0,0 +1,158 @@
+#include "adept_source.h"
+#include "adept.h"
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstdlib>
+
+// Microbenchmark of the allocation of gradient indices by adept::Stack under orders of registration
+// and unregistration that defeat last-in-first-out reuse, as happens when active objects are held by
+// shared pointers or in containers. Each scenario registers and unregisters indices directly through
+// the Stack, and reports the time per operation, the number of gradients the recording would need
+// (max_gradients) and the gaps left in the index space.
+
+// A block of n consecutive gradient indices starting at index
+struct Registration {
+    adept::uIndex index;
+    adept::uIndex n;
+};
+
+class Scenario {
+public:
+    Scenario(const std::string& name, int num_live) : name(name), num_live(num_live), operations(0) {}
+    virtual ~Scenario() {}
+
+    // Runs the scenario on a fresh Stack and prints one line of results
+    void run() {
+        adept::Stack stack;
+        live.clear();
+        live.reserve(num_live);
+        rng.seed(17);
+        operations = 0;
+        const auto start = std::chrono::steady_clock::now();
+        execute(stack);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const adept::StackStatistics s = stack.statistics();
+        std::cout << std::left << std::setw(10) << name << std::right
+                  << std::setw(12) << operations
+                  << std::setw(14) << std::fixed << std::setprecision(1) << 1.0e9 * seconds / operations
+                  << std::setw(14) << s.peak_max_gradients
+                  << std::setw(10) << s.n_gaps << std::endl;
+        // Leave the stack empty, in any order
+        for (const Registration& r : live) release(stack, r);
+    }
+
+    static void printHeader() {
+        std::cout << std::left << std::setw(10) << "scenario" << std::right
+                  << std::setw(12) << "operations" << std::setw(14) << "ns/operation"
+                  << std::setw(14) << "max_gradients" << std::setw(10) << "gaps" << std::endl;
+    }
+
+protected:
+    virtual void execute(adept::Stack& stack) = 0;
+
+    Registration acquire(adept::Stack& stack, adept::uIndex n) {
+        ++operations;
+        Registration r;
+        r.index = n == 1 ? stack.register_gradient() : stack.register_gradients(n);
+        r.n = n;
+        return r;
+    }
+
+    void release(adept::Stack& stack, const Registration& r) {
+        ++operations;
+        if (r.n == 1) stack.unregister_gradient(r.index);
+        else stack.unregister_gradients(r.index, r.n);
+    }
+
+    // Removes and returns a uniformly chosen live registration
+    Registration takeRandom() {
+        std::uniform_int_distribution<size_t> pick(0, live.size() - 1);
+        const size_t i = pick(rng);
+        const Registration r = live[i];
+        live[i] = live.back();
+        live.pop_back();
+        return r;
+    }
+
+    const std::string name;
+    const int num_live;
+    long operations;
+    std::vector<Registration> live;
+    std::mt19937 rng;
+};
+
+// Indices released in the order they were registered
+class FifoScenario : public Scenario {
+public:
+    explicit FifoScenario(int num_live) : Scenario("fifo", num_live) {}
+    void execute(adept::Stack& stack) override {
+        for (int round = 0; round < 10; ++round) {
+            for (int i = 0; i < num_live; ++i) live.push_back(acquire(stack, 1));
+            for (const Registration& r : live) release(stack, r);
+            live.clear();
+        }
+    }
+};
+
+// Twice the live indices registered and a random half released, then churn: release a random one and
+// register a new one
+class RandomScenario : public Scenario {
+public:
+    explicit RandomScenario(int num_live) : Scenario("random", num_live) {}
+    void execute(adept::Stack& stack) override {
+        for (int i = 0; i < 2 * num_live; ++i) live.push_back(acquire(stack, 1));
+        for (int i = 0; i < num_live; ++i) release(stack, takeRandom());
+        for (int i = 0; i < 10 * num_live; ++i) {
+            release(stack, takeRandom());
+            live.push_back(acquire(stack, 1));
+        }
+    }
+};
+
+// Every other index released, leaving single-index gaps, then pairs registered: no gap fits
+class StridedScenario : public Scenario {
+public:
+    explicit StridedScenario(int num_live) : Scenario("strided", num_live) {}
+    void execute(adept::Stack& stack) override {
+        std::vector<Registration> all;
+        for (int i = 0; i < num_live; ++i) all.push_back(acquire(stack, 1));
+        for (int i = 0; i < num_live; ++i) {
+            if (i % 2 == 0) release(stack, all[i]);
+            else live.push_back(all[i]);
+        }
+        for (int i = 0; i < num_live / 2; ++i) live.push_back(acquire(stack, 2));
+    }
+};
+
+// Arrays of random length up to 64 registered and released in random order
+class ArrayScenario : public Scenario {
+public:
+    explicit ArrayScenario(int num_live) : Scenario("arrays", num_live) {}
+    void execute(adept::Stack& stack) override {
+        std::uniform_int_distribution<int> length(1, 64);
+        for (int i = 0; i < num_live / 32; ++i) live.push_back(acquire(stack, length(rng)));
+        for (int i = 0; i < 10 * num_live; ++i) {
+            release(stack, takeRandom());
+            live.push_back(acquire(stack, length(rng)));
+        }
+    }
+};
+
+int main(int argc, char* argv[]) {
+    // Usage: adept-gap-benchmark [num_live]
+    const int num_live = argc > 1 ? std::atoi(argv[1]) : 20000;
+
+    FifoScenario fifo(num_live);
+    RandomScenario random(num_live);
+    StridedScenario strided(num_live);
+    ArrayScenario arrays(num_live);
+
+    Scenario::printHeader();
+    for (Scenario* s : std::vector<Scenario*>{&fifo, &random, &strided, &arrays}) s->run();
+    return 0;
+}
@@ -0,0 +1,168 @@
+// Record each statement's second derivatives as well, which Stack::hessian() needs
+#define ADEPT_SECOND_ORDER 1
+#include "adept_source.h"
+#include "adept.h"
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+
+using adept::adouble;
+
+// Benchmark of adept::Stack's second-order adjoints on a basket call priced by matching the first two
+// moments of the basket to a lognormal (Levy's approximation), a smooth function of the spots and
+// volatilities of its assets. For each basket size it times one adjoint (recording and reverse pass)
+// and compares two ways of getting the gammas, cross-gammas and vannas: bumping each spot up and down
+// around an adjoint run (2N+1 runs for N assets), and Stack::hessian() on one recording with second
+// derivatives, whose single forward-over-reverse sweep gives the whole Hessian in the spots and
+// volatilities. The largest difference between the two is relative to the largest element.
+
+class Basket {
+public:
+    explicit Basket(int num_assets) : num_assets(num_assets), weight(1.0 / num_assets), strike(0.0) {
+        for (int i = 0; i < num_assets; ++i) {
+            spots.push_back(90.0 + 20.0 * i / std::max(num_assets - 1, 1));
+            vols.push_back(0.15 + 0.1 * std::sin(0.7 * i) * std::sin(0.7 * i));
+            strike += weight * spots.back();
+        }
+    }
+
+    // Records the price from the spots and volatilities, which are the independents, in that order
+    adouble record(adept::Stack& stack, std::vector<adouble>& inputs, const std::vector<double>& spot_values) const {
+        inputs.assign(spot_values.begin(), spot_values.end());
+        inputs.insert(inputs.end(), vols.begin(), vols.end());
+        stack.new_recording();
+        adouble price = callPrice(inputs);
+        stack.independent(inputs.data(), inputs.size());
+        stack.dependent(price);
+        return price;
+    }
+
+    // The gradient of the price from one adjoint run
+    void gradient(adept::Stack& stack, const std::vector<double>& spot_values, std::vector<double>& grad) const {
+        std::vector<adouble> inputs;
+        adouble price = record(stack, inputs, spot_values);
+        price.set_gradient(1.0);
+        stack.compute_adjoint();
+        grad.resize(inputs.size());
+        for (size_t j = 0; j < inputs.size(); ++j) grad[j] = inputs[j].get_gradient();
+    }
+
+    const int num_assets;
+    std::vector<double> spots, vols;
+
+private:
+    static adouble normalCdf(const adouble& x) { return 0.5 * erfc(-x * M_SQRT1_2); }
+
+    double correlation(int i, int j) const { return i == j ? 1.0 : 0.3 + 0.4 * std::exp(-std::abs(i - j) / 5.0); }
+
+    adouble callPrice(const std::vector<adouble>& inputs) const {
+        const double expiry = 1.0, rate = 0.02;
+        const adouble* spot = inputs.data();
+        const adouble* vol = inputs.data() + num_assets;
+        // The weighted forwards and the first two moments of the basket
+        std::vector<adouble> forwards(num_assets);
+        adouble m1 = 0.0;
+        for (int i = 0; i < num_assets; ++i) {
+            forwards[i] = weight * std::exp(rate * expiry) * spot[i];
+            m1 += forwards[i];
+        }
+        adouble m2 = 0.0;
+        for (int i = 0; i < num_assets; ++i) {
+            for (int j = 0; j < num_assets; ++j) {
+                m2 += forwards[i] * forwards[j] * exp(correlation(i, j) * vol[i] * vol[j] * expiry);
+            }
+        }
+        adouble total_vol = sqrt(log(m2 / (m1 * m1)));
+        adouble d1 = log(m1 / strike) / total_vol + 0.5 * total_vol;
+        return std::exp(-rate * expiry) * (m1 * normalCdf(d1) - strike * normalCdf(d1 - total_vol));
+    }
+
+    const double weight;
+    double strike;
+};
+
+static double seconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void run(int num_assets, int repeats) {
+    const Basket basket(num_assets);
+    const int n = 2 * num_assets;
+    adept::Stack stack;
+    std::vector<double> grad;
+
+    // One adjoint run, recording first derivatives only
+    stack.record_second_derivatives(false);
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeats; ++r) basket.gradient(stack, basket.spots, grad);
+    const double adjoint_seconds = seconds(start) / repeats;
+
+    // Gammas, cross-gammas and vannas by central differences of the adjoint gradient in each spot;
+    // column j of "bumped" is the derivative of the gradient with respect to spot j
+    std::vector<double> bumped(n * num_assets);
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeats; ++r) {
+        basket.gradient(stack, basket.spots, grad);
+        for (int j = 0; j < num_assets; ++j) {
+            const double h = 1.0e-4 * basket.spots[j];
+            std::vector<double> spots = basket.spots, up, down;
+            spots[j] += h;
+            basket.gradient(stack, spots, up);
+            spots[j] -= 2.0 * h;
+            basket.gradient(stack, spots, down);
+            for (int i = 0; i < n; ++i) bumped[j * n + i] = (up[i] - down[i]) / (2.0 * h);
+        }
+    }
+    const double bump_seconds = seconds(start) / repeats;
+
+    // The whole Hessian in the spots and volatilities from one recording with second derivatives
+    stack.record_second_derivatives(true);
+    std::vector<double> hessian(n * n), v(n, 1.0), hv(n);
+    std::vector<adouble> inputs;
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeats; ++r) {
+        adouble price = basket.record(stack, inputs, basket.spots);
+        stack.hessian(hessian.data());
+    }
+    const double hessian_seconds = seconds(start) / repeats;
+
+    // One Hessian-vector product on the same recording
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeats; ++r) stack.hessian_vector_product(v.data(), hv.data());
+    const double hvp_seconds = seconds(start) / repeats;
+
+    double max_element = 0.0, max_difference = 0.0;
+    for (int j = 0; j < num_assets; ++j) {
+        for (int i = 0; i < n; ++i) {
+            max_element = std::max(max_element, std::fabs(hessian[j * n + i]));
+            max_difference = std::max(max_difference, std::fabs(hessian[j * n + i] - bumped[j * n + i]));
+        }
+    }
+
+    std::cout << std::setw(7) << num_assets << std::setw(8) << n
+              << std::setw(12) << std::fixed << std::setprecision(3) << 1.0e3 * adjoint_seconds
+              << std::setw(12) << 1.0e3 * bump_seconds
+              << std::setw(12) << 1.0e3 * hessian_seconds
+              << std::setw(12) << 1.0e3 * hvp_seconds
+              << std::setw(10) << std::setprecision(1) << bump_seconds / adjoint_seconds
+              << std::setw(10) << hessian_seconds / adjoint_seconds
+              << std::setw(12) << std::scientific << std::setprecision(1) << max_difference / max_element
+              << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    // Usage: adept-hessian-benchmark [repeats]
+    const int repeats = argc > 1 ? std::atoi(argv[1]) : 100;
+
+    std::cout << std::setw(7) << "assets" << std::setw(8) << "inputs"
+              << std::setw(12) << "adjoint ms" << std::setw(12) << "bump ms"
+              << std::setw(12) << "hessian ms" << std::setw(12) << "hvp ms"
+              << std::setw(10) << "bump/adj" << std::setw(10) << "hess/adj"
+              << std::setw(12) << "rel diff" << std::endl;
+    for (int num_assets : {2, 5, 10, 20, 50}) run(num_assets, repeats);
+    return 0;
+}
@@ -0,0 +1,196 @@
+#include "adept_source.h"
+#include "adept.h"
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstdlib>
+
+using adept::adouble;
+
+// Benchmark of adept::Stack::jacobian in dense and sparse form on Jacobians in which each output
+// depends on a few inputs. Each scenario records its outputs from its inputs once, then computes
+// the dense Jacobian and the sparse one (sparsity pattern, colouring and compressed passes) and
+// reports their times, the number of colours against the number of columns the dense form needs,
+// and the largest difference between the two.
+
+class Scenario {
+public:
+    Scenario(const std::string& name, int num_inputs) : name(name), num_inputs(num_inputs) {}
+    virtual ~Scenario() {}
+
+    // Records the scenario on a fresh Stack and prints one line of results
+    void run(int repeats) {
+        adept::Stack stack;
+        std::vector<adouble> x(num_inputs);
+        for (int j = 0; j < num_inputs; ++j) x[j] = inputValue(j);
+        stack.new_recording();
+        std::vector<adouble> y;
+        record(x, y);
+        stack.independent(x.data(), x.size());
+        stack.dependent(y.data(), y.size());
+        const size_t m = y.size(), n = x.size();
+
+        std::vector<double> dense(m * n);
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; ++r) stack.jacobian(dense.data());
+        const double dense_seconds = seconds(start) / repeats;
+
+        adept::SparseJacobian sparse;
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; ++r) stack.jacobian(sparse);
+        const double sparse_seconds = seconds(start) / repeats;
+
+        // Every element outside the pattern must be zero in the dense Jacobian, whose element
+        // (i, j) is at j * m + i
+        std::vector<double> unpacked(m * n, 0.0);
+        for (size_t i = 0; i < m; ++i) {
+            for (adept::uIndex k = sparse.row_start[i]; k < sparse.row_start[i + 1]; ++k) {
+                unpacked[sparse.column[k] * m + i] = sparse.value[k];
+            }
+        }
+        double max_difference = 0.0;
+        for (size_t k = 0; k < m * n; ++k) max_difference = std::max(max_difference, std::fabs(unpacked[k] - dense[k]));
+
+        std::cout << std::left << std::setw(10) << name << std::right
+                  << std::setw(7) << m << std::setw(7) << n
+                  << std::setw(9) << sparse.n_nonzeros()
+                  << std::setw(8) << std::min(m, n)
+                  << std::setw(9) << sparse.n_colours << (sparse.is_forward ? " fwd" : " rev")
+                  << std::setw(12) << std::fixed << std::setprecision(3) << 1.0e3 * dense_seconds
+                  << std::setw(12) << 1.0e3 * sparse_seconds
+                  << std::setw(12) << std::scientific << std::setprecision(1) << max_difference
+                  << std::endl;
+    }
+
+    static void printHeader() {
+        std::cout << std::left << std::setw(10) << "scenario" << std::right
+                  << std::setw(7) << "rows" << std::setw(7) << "cols" << std::setw(9) << "nonzero"
+                  << std::setw(8) << "dense" << std::setw(13) << "colours"
+                  << std::setw(12) << "dense ms" << std::setw(12) << "sparse ms"
+                  << std::setw(12) << "max diff" << std::endl;
+    }
+
+protected:
+    virtual double inputValue(int j) const = 0;
+    virtual void record(const std::vector<adouble>& x, std::vector<adouble>& y) const = 0;
+
+    static double seconds(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    const std::string name;
+    const int num_inputs;
+};
+
+// Zero-coupon bonds and par swaps priced off a curve of zero rates at evenly spaced nodes with
+// linear interpolation: each price depends on the nodes either side of its payment dates
+class BucketScenario : public Scenario {
+public:
+    explicit BucketScenario(int num_nodes) : Scenario("buckets", num_nodes) {}
+
+    double inputValue(int j) const override { return 0.02 + 0.01 * std::sin(0.1 * j); }
+
+    void record(const std::vector<adouble>& rates, std::vector<adouble>& prices) const override {
+        const double max_time = 30.0;
+        const double spacing = max_time / (num_inputs - 1);
+        auto discount = [&](double t) -> adouble {
+            const int i = std::min(static_cast<int>(t / spacing), num_inputs - 2);
+            const double w = (t - i * spacing) / spacing;
+            adouble rate = (1.0 - w) * rates[i] + w * rates[i + 1];
+            return exp(-rate * t);
+        };
+        for (int b = 1; b < num_inputs; ++b) {
+            const double maturity = b * spacing;
+            prices.push_back(discount(maturity));
+            // A swap over the last year to the maturity with quarterly fixed payments
+            adouble annuity = 0.0;
+            for (int q = 0; q < 4; ++q) {
+                const double t = std::max(maturity - 0.25 * q, 0.25);
+                annuity += 0.25 * discount(t);
+            }
+            prices.push_back((discount(std::max(maturity - 1.0, 0.0)) - discount(maturity)) / annuity);
+        }
+    }
+};
+
+// Calibration residuals of a local volatility surface on a grid of strike and expiry knots: each
+// model price depends on the knot's volatility and those of its neighbours
+class LocalVolScenario : public Scenario {
+public:
+    explicit LocalVolScenario(int grid) : Scenario("localvol", grid * grid), grid(grid) {}
+
+    double inputValue(int j) const override { return 0.2 + 0.05 * std::cos(0.3 * (j % grid)) + 0.01 * (j / grid); }
+
+    void record(const std::vector<adouble>& vols, std::vector<adouble>& residuals) const override {
+        for (int e = 0; e < grid; ++e) {
+            for (int k = 0; k < grid; ++k) {
+                adouble variance = 0.0;
+                double weight_sum = 0.0;
+                for (int de = -1; de <= 1; ++de) {
+                    for (int dk = -1; dk <= 1; ++dk) {
+                        const int ee = e + de, kk = k + dk;
+                        if (ee < 0 || ee >= grid || kk < 0 || kk >= grid) continue;
+                        const double weight = (de == 0 && dk == 0) ? 4.0 : 1.0;
+                        variance += weight * vols[ee * grid + kk] * vols[ee * grid + kk];
+                        weight_sum += weight;
+                    }
+                }
+                const double expiry = 0.1 * (e + 1);
+                adouble model_price = 0.4 * sqrt(variance / weight_sum * expiry);
+                residuals.push_back(model_price - 0.4 * 0.2 * std::sqrt(expiry));
+            }
+        }
+    }
+
+private:
+    const int grid;
+};
+
+// Outputs that each depend on their own input and on one shared input, such as prices that all
+// depend on a common spot: one dense column, the rest diagonal
+class ArrowScenario : public Scenario {
+public:
+    explicit ArrowScenario(int num_inputs) : Scenario("arrow", num_inputs) {}
+
+    double inputValue(int j) const override { return 1.0 + 0.01 * j; }
+
+    void record(const std::vector<adouble>& x, std::vector<adouble>& y) const override {
+        for (int j = 1; j < num_inputs; ++j) y.push_back(x[0] * sin(x[j]));
+    }
+};
+
+// The value of each position of a book and the book's total: every column meets the total's row,
+// so the rows are compressed and the Jacobian found from reverse passes
+class BookScenario : public Scenario {
+public:
+    explicit BookScenario(int num_positions) : Scenario("book", num_positions) {}
+
+    double inputValue(int j) const override { return 100.0 + j; }
+
+    void record(const std::vector<adouble>& spots, std::vector<adouble>& values) const override {
+        adouble total = 0.0;
+        for (int j = 0; j < num_inputs; ++j) {
+            values.push_back(spots[j] * log(spots[j]));
+            total += values.back();
+        }
+        values.push_back(total);
+    }
+};
+
+int main(int argc, char* argv[]) {
+    // Usage: adept-jacobian-benchmark [repeats]
+    const int repeats = argc > 1 ? std::atoi(argv[1]) : 20;
+
+    BucketScenario buckets(121);
+    LocalVolScenario localvol(30);
+    ArrowScenario arrow(400);
+    BookScenario book(400);
+
+    Scenario::printHeader();
+    for (Scenario* s : std::vector<Scenario*>{&buckets, &localvol, &arrow, &book}) s->run(repeats);
+    return 0;
+}
@@ -15,6 +15,7 @@
 #include <adept/UnaryOperation.h>
 #include <adept/BinaryOperation.h>
 #include <adept/Active.h>
+#include <adept/Preaccumulate.h>
 #include <adept/scalar_shortcuts.h>
 
 #endif
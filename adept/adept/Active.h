@@ -105,6 +105,12 @@ namespace adept {
       if (ADEPT_ACTIVE_STACK->is_recording()) {
 #endif
 	ADEPT_ACTIVE_STACK->push_rhs(1.0,gradient_index);
+#ifdef ADEPT_SECOND_ORDER
+	// A copy has no second derivatives
+	if (ADEPT_ACTIVE_STACK->is_recording_second_derivatives()) {
+	  ADEPT_ACTIVE_STACK->push_second_order_statement();
+	}
+#endif
 	ADEPT_ACTIVE_STACK->push_lhs(gradient_index_);
 #ifdef ADEPT_RECORDING_PAUSABLE
       }
@@ -364,6 +370,15 @@ namespace adept {
 					gradient_index_+1, &gradient);
       return gradient;
     }
+
+    // Set and get one lane of the gradient for the vector adjoint,
+    // Stack::compute_adjoint_vector()
+    void set_gradient_lane(uIndex lane, const Type& gradient) const {
+      ADEPT_ACTIVE_STACK->set_gradient_lane(gradient_index_, lane, gradient);
+    }
+    Type get_gradient_lane(uIndex lane) const {
+      return ADEPT_ACTIVE_STACK->get_gradient_lane(gradient_index_, lane);
+    }
  
 
     // For modular codes, some modules may have an existing
@@ -500,6 +515,10 @@ namespace adept {
 		     const ScratchVector<NScratch>& scratch) const
     { return val_; }
 
+    template <class Seed>
+    typename Seed::type dual_value_(const Seed& seed) const
+    { return seed.leaf(gradient_index_, val_); }
+
     template <int MyArrayNum, int MyScratchNum, int NArrays, int NScratch>
     void calc_gradient_(Stack& stack, 
 			const ExpressionSize<NArrays>& loc,
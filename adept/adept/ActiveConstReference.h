@@ -274,6 +274,10 @@ namespace adept {
 		     const ScratchVector<NScratch>& scratch) const
     { return val_; }
 
+    template <class Seed>
+    typename Seed::type dual_value_(const Seed& seed) const
+    { return seed.leaf(gradient_index_, val_); }
+
     template <int MyArrayNum, int MyScratchNum, int NArrays, int NScratch>
     void calc_gradient_(Stack& stack, 
 			const ExpressionSize<NArrays>& loc,
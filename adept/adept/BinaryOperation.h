@@ -199,6 +199,11 @@ namespace adept {
 	return my_value_stored_<store_result,MyArrayNum,MyScratchNum>(loc, scratch);
       }
 
+      template <class Seed>
+      typename Seed::type dual_value_(const Seed& seed) const {
+	return operation(left.dual_value_(seed), right.dual_value_(seed));
+      }
+
     protected:
       template <int StoreResult, int MyArrayNum, int MyScratchNum, 
 		int NArrays, int NScratch>
@@ -483,6 +488,12 @@ namespace adept {
 	return my_value_stored_<store_result,MyArrayNum,MyScratchNum>(loc, scratch);
       }
 
+      template <class Seed>
+      typename Seed::type dual_value_(const Seed& seed) const {
+	return operation(typename Seed::type(left.value()),
+			 right.dual_value_(seed));
+      }
+
     protected:
       template <int StoreResult, int MyArrayNum, int MyScratchNum, 
 		int NArrays, int NScratch>
@@ -676,16 +687,34 @@ namespace adept {
 	return my_value_stored_<store_result,MyArrayNum,MyScratchNum>(loc, scratch);
       }
 
+      template <class Seed>
+      typename Seed::type dual_value_(const Seed& seed) const {
+	return operation(left.dual_value_(seed),
+			 typename Seed::type(right.value()));
+      }
+
     protected:
       template <int StoreResult, int MyArrayNum, int MyScratchNum, 
 		int NArrays, int NScratch>
-      typename enable_if<(StoreResult > 0), Type>::type
+      typename enable_if<StoreResult==1, Type>::type
       my_value_at_location_store_(const ExpressionSize<NArrays>& loc,
 				       ScratchVector<NScratch>& scratch) const {
 	return scratch[MyScratchNum] = operation(
 	 left.template value_at_location_store_<MyArrayNum, MyScratchNum+n_local_scratch>(loc, scratch), right.value());
       }
 
+      // Divide also needs "1/right" in the second scratch slot,
+      // since its calc_left reads it from there
+      template <int StoreResult, int MyArrayNum, int MyScratchNum, 
+		int NArrays, int NScratch>
+      typename enable_if<StoreResult==2, Type>::type
+      my_value_at_location_store_(const ExpressionSize<NArrays>& loc,
+				       ScratchVector<NScratch>& scratch) const {
+	return scratch[MyScratchNum] = Op::operation_store(
+	 left.template value_at_location_store_<MyArrayNum, MyScratchNum+n_local_scratch>(loc, scratch), right.value(),
+	 scratch[MyScratchNum+1]);
+      }
+
       template <int StoreResult, int MyArrayNum, int MyScratchNum, int NArrays, int NScratch>
       typename enable_if<(StoreResult > 0), Type>::type
       my_value_stored_(const ExpressionSize<NArrays>& loc,
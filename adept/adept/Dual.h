@@ -0,0 +1,248 @@
+/* Dual.h -- Dual numbers for the local second derivatives of a statement
+
+    Author: Robin Hogan <r.j.hogan@ecmwf.int>
+
+    This file is part of the Adept library.
+
+   When ADEPT_SECOND_ORDER is defined, each scalar statement records
+   the second derivatives of its right-hand side with respect to its
+   active arguments, for Stack::hessian_vector_product(). They are
+   found by evaluating the expression again in the nested dual number
+   type Dual<Dual<Real> >, seeded with one tangent in each of its two
+   levels: the innermost tangent of the result is then the second
+   derivative with respect to the two seeded arguments. The functions
+   below cover the operations of UnaryOperation.h and
+   BinaryOperation.h.
+
+*/
+
+#ifndef AdeptDual_H
+#define AdeptDual_H 1
+
+#include <cmath>
+#include <vector>
+
+#include <adept/base.h>
+
+namespace adept {
+  namespace internal {
+
+    // A value and its tangent (derivative in one direction); T is
+    // Real or itself a Dual
+    template <typename T>
+    struct Dual {
+      Dual(Real v = 0.0) : value(v), tangent(0.0) {}
+      Dual(const T& v, const T& t) : value(v), tangent(t) {}
+      T value;
+      T tangent;
+    };
+
+    // Arithmetic
+    template <typename T>
+    inline Dual<T> operator+(const Dual<T>& x) { return x; }
+    template <typename T>
+    inline Dual<T> operator-(const Dual<T>& x) {
+      return Dual<T>(-x.value, -x.tangent);
+    }
+    template <typename T>
+    inline Dual<T> operator+(const Dual<T>& x, const Dual<T>& y) {
+      return Dual<T>(x.value + y.value, x.tangent + y.tangent);
+    }
+    template <typename T>
+    inline Dual<T> operator+(const Dual<T>& x, Real y) {
+      return Dual<T>(x.value + y, x.tangent);
+    }
+    template <typename T>
+    inline Dual<T> operator+(Real x, const Dual<T>& y) {
+      return Dual<T>(x + y.value, y.tangent);
+    }
+    template <typename T>
+    inline Dual<T> operator-(const Dual<T>& x, const Dual<T>& y) {
+      return Dual<T>(x.value - y.value, x.tangent - y.tangent);
+    }
+    template <typename T>
+    inline Dual<T> operator-(const Dual<T>& x, Real y) {
+      return Dual<T>(x.value - y, x.tangent);
+    }
+    template <typename T>
+    inline Dual<T> operator-(Real x, const Dual<T>& y) {
+      return Dual<T>(x - y.value, -y.tangent);
+    }
+    template <typename T>
+    inline Dual<T> operator*(const Dual<T>& x, const Dual<T>& y) {
+      return Dual<T>(x.value * y.value,
+		     x.tangent * y.value + x.value * y.tangent);
+    }
+    template <typename T>
+    inline Dual<T> operator*(const Dual<T>& x, Real y) {
+      return Dual<T>(x.value * y, x.tangent * y);
+    }
+    template <typename T>
+    inline Dual<T> operator*(Real x, const Dual<T>& y) {
+      return Dual<T>(x * y.value, x * y.tangent);
+    }
+    template <typename T>
+    inline Dual<T> operator/(const Dual<T>& x, const Dual<T>& y) {
+      T result = x.value / y.value;
+      return Dual<T>(result, (x.tangent - result * y.tangent) / y.value);
+    }
+    template <typename T>
+    inline Dual<T> operator/(const Dual<T>& x, Real y) {
+      return Dual<T>(x.value / y, x.tangent / y);
+    }
+    template <typename T>
+    inline Dual<T> operator/(Real x, const Dual<T>& y) {
+      T result = x / y.value;
+      return Dual<T>(result, -result * y.tangent / y.value);
+    }
+
+    // Comparisons, as used by max and min and by the derivative of
+    // abs, look only at the values
+#define ADEPT_DEF_DUAL_COMPARISON(OP)					\
+    template <typename T>						\
+    inline bool operator OP(const Dual<T>& x, const Dual<T>& y) {	\
+      return x.value OP y.value;					\
+    }									\
+    template <typename T>						\
+    inline bool operator OP(const Dual<T>& x, Real y) {		\
+      return x.value OP y;						\
+    }									\
+    template <typename T>						\
+    inline bool operator OP(Real x, const Dual<T>& y) {		\
+      return x OP y.value;						\
+    }
+    ADEPT_DEF_DUAL_COMPARISON(<)
+    ADEPT_DEF_DUAL_COMPARISON(>)
+    ADEPT_DEF_DUAL_COMPARISON(<=)
+    ADEPT_DEF_DUAL_COMPARISON(>=)
+#undef ADEPT_DEF_DUAL_COMPARISON
+
+    // Functions of one argument, with the derivatives of the
+    // corresponding unary operations in terms of the argument "val"
+    // and the result "result"
+#define ADEPT_DEF_DUAL_FUNC(FUNC, RAWFUNC, DERIVATIVE)			\
+    template <typename T>						\
+    inline Dual<T> FUNC(const Dual<T>& x) {				\
+      using RAWFUNC;							\
+      using std::sin;							\
+      using std::cos;							\
+      using std::sqrt;							\
+      using std::cosh;							\
+      using std::sinh;							\
+      using std::exp;							\
+      const T& val = x.value;						\
+      T result = FUNC(val);						\
+      return Dual<T>(result, (DERIVATIVE) * x.tangent);			\
+    }
+    ADEPT_DEF_DUAL_FUNC(log,   std::log,   1.0/val)
+    ADEPT_DEF_DUAL_FUNC(log10, std::log10, 0.43429448190325182765/val)
+    ADEPT_DEF_DUAL_FUNC(sin,   std::sin,   cos(val))
+    ADEPT_DEF_DUAL_FUNC(cos,   std::cos,   -sin(val))
+    ADEPT_DEF_DUAL_FUNC(tan,   std::tan,   1.0/(cos(val)*cos(val)))
+    ADEPT_DEF_DUAL_FUNC(asin,  std::asin,  1.0/sqrt(1.0-val*val))
+    ADEPT_DEF_DUAL_FUNC(acos,  std::acos,  -1.0/sqrt(1.0-val*val))
+    ADEPT_DEF_DUAL_FUNC(atan,  std::atan,  1.0/(1.0+val*val))
+    ADEPT_DEF_DUAL_FUNC(sinh,  std::sinh,  cosh(val))
+    ADEPT_DEF_DUAL_FUNC(cosh,  std::cosh,  sinh(val))
+    ADEPT_DEF_DUAL_FUNC(abs,   std::abs,   Real((val>0.0)-(val<0.0)))
+    ADEPT_DEF_DUAL_FUNC(fabs,  std::fabs,  Real((val>0.0)-(val<0.0)))
+    ADEPT_DEF_DUAL_FUNC(exp,   std::exp,   result)
+    ADEPT_DEF_DUAL_FUNC(sqrt,  std::sqrt,  0.5/result)
+    ADEPT_DEF_DUAL_FUNC(tanh,  std::tanh,  1.0 - result*result)
+    ADEPT_DEF_DUAL_FUNC(ceil,  std::ceil,  0.0)
+    ADEPT_DEF_DUAL_FUNC(floor, std::floor, 0.0)
+    // In the std namespace in C++11 but only in the global
+    // namespace before that
+#ifdef ADEPT_CXX11_FEATURES
+    ADEPT_DEF_DUAL_FUNC(log2,  std::log2,  1.44269504088896340737/val)
+    ADEPT_DEF_DUAL_FUNC(expm1, std::expm1, exp(val))
+    ADEPT_DEF_DUAL_FUNC(exp2,  std::exp2,  0.6931471805599453094172321214581766*result)
+    ADEPT_DEF_DUAL_FUNC(log1p, std::log1p, 1.0/(1.0+val))
+    ADEPT_DEF_DUAL_FUNC(asinh, std::asinh, 1.0/sqrt(val*val+1.0))
+    ADEPT_DEF_DUAL_FUNC(acosh, std::acosh, 1.0/sqrt(val*val-1.0))
+    ADEPT_DEF_DUAL_FUNC(atanh, std::atanh, 1.0/(1.0-val*val))
+    ADEPT_DEF_DUAL_FUNC(erf,   std::erf,   1.12837916709551*exp(-val*val))
+    ADEPT_DEF_DUAL_FUNC(erfc,  std::erfc,  -1.12837916709551*exp(-val*val))
+    ADEPT_DEF_DUAL_FUNC(cbrt,  std::cbrt,  (1.0/3.0)/(result*result))
+    ADEPT_DEF_DUAL_FUNC(round, std::round, 0.0)
+    ADEPT_DEF_DUAL_FUNC(trunc, std::trunc, 0.0)
+    ADEPT_DEF_DUAL_FUNC(rint,  std::rint,  0.0)
+    ADEPT_DEF_DUAL_FUNC(nearbyint, std::nearbyint, 0.0)
+#else
+    ADEPT_DEF_DUAL_FUNC(log2,  ::log2,  1.44269504088896340737/val)
+    ADEPT_DEF_DUAL_FUNC(expm1, ::expm1, exp(val))
+    ADEPT_DEF_DUAL_FUNC(exp2,  ::exp2,  0.6931471805599453094172321214581766*result)
+    ADEPT_DEF_DUAL_FUNC(log1p, ::log1p, 1.0/(1.0+val))
+    ADEPT_DEF_DUAL_FUNC(asinh, ::asinh, 1.0/sqrt(val*val+1.0))
+    ADEPT_DEF_DUAL_FUNC(acosh, ::acosh, 1.0/sqrt(val*val-1.0))
+    ADEPT_DEF_DUAL_FUNC(atanh, ::atanh, 1.0/(1.0-val*val))
+    ADEPT_DEF_DUAL_FUNC(erf,   ::erf,   1.12837916709551*exp(-val*val))
+    ADEPT_DEF_DUAL_FUNC(erfc,  ::erfc,  -1.12837916709551*exp(-val*val))
+    ADEPT_DEF_DUAL_FUNC(cbrt,  ::cbrt,  (1.0/3.0)/(result*result))
+    ADEPT_DEF_DUAL_FUNC(round, ::round, 0.0)
+    ADEPT_DEF_DUAL_FUNC(trunc, ::trunc, 0.0)
+    ADEPT_DEF_DUAL_FUNC(rint,  ::rint,  0.0)
+    ADEPT_DEF_DUAL_FUNC(nearbyint, ::nearbyint, 0.0)
+#endif
+#undef ADEPT_DEF_DUAL_FUNC
+
+    // Functions of two arguments. The derivative of pow with respect
+    // to its exponent is only taken for a positive base, so that
+    // pow(x,2.0) with x <= 0 does not give 0*log(x).
+    template <typename T>
+    inline Dual<T> pow(const Dual<T>& x, const Dual<T>& y) {
+      using std::pow;
+      using std::log;
+      T result = pow(x.value, y.value);
+      T tangent = y.value * pow(x.value, y.value - 1.0) * x.tangent;
+      if (x.value > 0.0) {
+	tangent = tangent + result * log(x.value) * y.tangent;
+      }
+      return Dual<T>(result, tangent);
+    }
+    template <typename T>
+    inline Dual<T> atan2(const Dual<T>& y, const Dual<T>& x) {
+      using std::atan2;
+      return Dual<T>(atan2(y.value, x.value),
+		     (x.value * y.tangent - y.value * x.tangent)
+		     / (x.value * x.value + y.value * y.value));
+    }
+
+    // Seeds for Expression::dual_value_(), which pass each active
+    // leaf's gradient index and value to leaf() and evaluate the
+    // expression in the type "type". The first lists the distinct
+    // gradient indices of the leaves in order of appearance.
+    class DualLeafList {
+    public:
+      typedef Real type;
+      DualLeafList(std::vector<uIndex>& list) : list_(&list) {}
+      Real leaf(uIndex gradient_index, Real value) const {
+	for (std::size_t i = 0; i < list_->size(); i++) {
+	  if ((*list_)[i] == gradient_index) {
+	    return value;
+	  }
+	}
+	list_->push_back(gradient_index);
+	return value;
+      }
+    private:
+      std::vector<uIndex>* list_;
+    };
+
+    // The second gives the result's innermost tangent as the second
+    // derivative with respect to the leaves with gradient indices i
+    // and j
+    struct DualHessianSeed {
+      typedef Dual<Dual<Real> > type;
+      DualHessianSeed(uIndex i_, uIndex j_) : i(i_), j(j_) {}
+      type leaf(uIndex gradient_index, Real value) const {
+	return type(Dual<Real>(value, gradient_index == i ? 1.0 : 0.0),
+		    Dual<Real>(gradient_index == j ? 1.0 : 0.0, 0.0));
+      }
+      uIndex i, j;
+    };
+
+  } // End namespace internal
+} // End namespace adept
+
+#endif
@@ -157,6 +157,11 @@ namespace adept {
       ExpressionSize<0> dummy_index;
       Type val = cast().template value_at_location_store_<0,0>(dummy_index, scratch);
       cast().template calc_gradient_<0,0>(*ADEPT_ACTIVE_STACK, dummy_index, scratch);
+#ifdef ADEPT_SECOND_ORDER
+      if (stack.is_recording_second_derivatives()) {
+	stack.push_second_derivatives(cast());
+      }
+#endif
       return val;
     }
  
@@ -301,6 +306,10 @@ namespace adept {
 			 const ScratchVector<NScratch>& scratch) const
       { return val_; }
 
+      template <class Seed>
+      typename Seed::type dual_value_(const Seed& seed) const
+      { return typename Seed::type(val_); }
+
       template <bool IsAligned,	int MyArrayNum, typename PacketType,
 	int NArrays>
       PacketType values_at_location_(const ExpressionSize<NArrays>& loc) const {
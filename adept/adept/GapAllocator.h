@@ -0,0 +1,117 @@
+/* GapAllocator.h -- Free gradient indices below the top of a Stack
+
+    Author: Robin Hogan <r.j.hogan@ecmwf.int>
+
+    This file is part of the Adept library.
+
+   When active objects are destroyed out of last-in-first-out order,
+   their gradient indices leave gaps below the top of the Stack's
+   index space, to be reused by later registrations. The gaps are
+   held here as maximal ranges of free indices. Each gap is described
+   by tags at its first and last index, in an array indexed by
+   gradient index, so there is no heap node per gap and a freed range
+   is merged with the gaps either side of it in constant time. Gaps
+   are also threaded onto one free list per size class (gaps of
+   length 2^c to 2^(c+1)-1 are in class c), with a bit mask of the
+   non-empty classes, so a gap long enough for a registration is
+   found in constant time.
+
+*/
+
+#ifndef AdeptGapAllocator_H
+#define AdeptGapAllocator_H 1
+
+#include <vector>
+
+#include <adept/base.h>
+
+namespace adept {
+
+  // Structure for describing a gap in the current list of gradients
+  struct Gap {
+    Gap(uIndex value) : start(value), end(value) {}
+    Gap(uIndex start_, uIndex end_) : start(start_), end(end_) {}
+    uIndex start;
+    uIndex end;
+  };
+
+  namespace internal {
+
+    class GapAllocator {
+    public:
+      // Returned when there is no suitable gap
+      static const uIndex NONE = static_cast<uIndex>(-1);
+
+      GapAllocator() : n_gaps_(0), nonempty_classes_(0) {
+	for (int c = 0; c < n_size_classes; c++) {
+	  head_[c] = NONE;
+	}
+      }
+
+      bool empty() const { return n_gaps_ == 0; }
+      uIndex n_gaps() const { return n_gaps_; }
+
+      // Take n consecutive free indices from the start of a gap and
+      // return the first, or NONE if no gap fits. Any gap of a size
+      // class wholly at least n long is used; otherwise only the few
+      // most recently freed gaps of n's own class are tried, so a
+      // long run of gaps slightly shorter than n is never searched.
+      uIndex take(uIndex n);
+
+      // Free the indices [start, start+n), merging them with the
+      // gaps either side
+      void add(uIndex start, uIndex n);
+
+      // If a gap ends at index "end", remove it and return its start,
+      // otherwise return NONE
+      uIndex remove_ending_at(uIndex end) {
+	if (!is_boundary(end)) {
+	  return NONE;
+	}
+	uIndex start = tag_[end].other_end;
+	remove(start, end);
+	return start;
+      }
+
+      // The gaps in order of index
+      std::vector<Gap> gaps() const;
+
+    private:
+      static const int n_size_classes = sizeof(uIndex)*8;
+      // Gaps of a request's own size class examined by take()
+      static const int max_probes = 8;
+
+      // Tag of the first or last index of a gap; "next" and "prev"
+      // link the gaps of a size class and are only kept at the first
+      // index. Indices that are not at either end of a gap have
+      // other_end == NONE.
+      struct Tag {
+	uIndex other_end;
+	uIndex next;
+	uIndex prev;
+      };
+
+      bool is_boundary(uIndex i) const {
+	// A negative int index converts to a huge size_t
+	return static_cast<std::size_t>(i) < tag_.size()
+	  && tag_[i].other_end != NONE;
+      }
+
+      static int size_class(uIndex length);
+
+      // Record the gap [start, end] and link it into its size class
+      void insert(uIndex start, uIndex end);
+      // Unlink the gap [start, end] and clear its tags
+      void remove(uIndex start, uIndex end);
+
+      std::vector<Tag> tag_;
+      uIndex head_[n_size_classes]; // First gap of each size class
+      uIndex n_gaps_;
+      unsigned long long nonempty_classes_; // Bit c set if class c
+					    // has gaps
+    };
+
+  } // End namespace internal
+} // End namespace adept
+
+#endif
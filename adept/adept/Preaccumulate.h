@@ -0,0 +1,94 @@
+/* Preaccumulate.h -- Collapse part of a recording into its local Jacobian
+
+    This file is part of the Adept library.
+
+   A Preaccumulate object marks the recording when it is created, and
+   when it is destroyed (or end() is called) replaces everything
+   recorded since then by one statement per output, holding the
+   derivatives of the output with respect to the active values the
+   region read from outside itself:
+
+     {
+       adept::Preaccumulate scope({&state[0], &state[1]});
+       ... statements updating state[0] and state[1] ...
+     }
+
+   The inputs are found from the recording, so only the outputs need
+   be given, and any value read from outside is accounted for. This
+   pays when a region records many intermediate statements but has few
+   inputs and outputs, such as one time step of a model: the tape and
+   every later reverse pass shrink, at the cost of the Jacobian of the
+   region at recording time. See Stack::preaccumulate() for the
+   details.
+
+*/
+
+#ifndef AdeptPreaccumulate_H
+#define AdeptPreaccumulate_H 1
+
+#include <exception>
+#include <vector>
+
+#include <adept/Active.h>
+
+namespace adept {
+
+  class Preaccumulate {
+  public:
+    // Start a region whose outputs are the given active numbers,
+    // which must exist for as long as the Preaccumulate object does
+    explicit Preaccumulate(const std::vector<const Active<Real>*>& outputs)
+      : stack_(ADEPT_ACTIVE_STACK), mark_(stack_->mark()), open_(true),
+	n_uncaught_(n_uncaught_exceptions()) {
+      output_index_.reserve(outputs.size());
+      for (std::size_t i = 0; i < outputs.size(); i++) {
+	output_index_.push_back(outputs[i]->gradient_index());
+      }
+    }
+
+    // Collapse the region unless it is being left by an exception,
+    // in which case it is left as recorded. Nothing is thrown from
+    // here: if the collapse fails the region is left as far as it
+    // got, so call end() to see the error.
+    ~Preaccumulate() {
+      if (open_ && n_uncaught_exceptions() <= n_uncaught_) {
+	try {
+	  end();
+	}
+	catch (...) { }
+      }
+    }
+
+    // Replace the region by its local Jacobian now; returns false if
+    // the region had to be kept as recorded
+    bool end() {
+      open_ = false;
+      return stack_->preaccumulate(mark_, output_index_.empty() ? 0 : &output_index_[0],
+				   output_index_.size());
+    }
+
+  private:
+    // The number of exceptions in flight, so that the destructor can
+    // tell whether it is run by stack unwinding
+    static int n_uncaught_exceptions() {
+#if __cplusplus >= 201703L
+      return std::uncaught_exceptions();
+#else
+      return std::uncaught_exception() ? 1 : 0;
+#endif
+    }
+
+    // Not copyable
+    Preaccumulate(const Preaccumulate&);
+    Preaccumulate& operator=(const Preaccumulate&);
+
+    Stack* stack_;
+    StackMark mark_;
+    std::vector<uIndex> output_index_;
+    bool open_;
+    int n_uncaught_;
+  };
+
+} // End namespace adept
+
+#endif
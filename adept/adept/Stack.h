@@ -29,6 +29,7 @@
 #include <list>
 #include <cstddef>
 #include <limits>
+#include <algorithm>
 
 #ifdef ADEPT_STACK_STORAGE_STL
 #include <valarray>
@@ -36,8 +37,13 @@
 
 #include <adept/base.h>
 #include <adept/exception.h>
+#include <adept/GapAllocator.h>
+#include <adept/Dual.h>
 #include <adept/StackStorageOrig.h>
 #include <adept/StackStorageOrigStl.h>
+#ifdef ADEPT_STACK_STORAGE_BLOCKS
+#include <adept/StackStorage.h>
+#endif
 #include <adept/traits.h>
 
 namespace adept {
@@ -75,12 +81,129 @@ namespace adept {
     Type data[Size] ADEPT_SSE2_ALIGNED;
   };
 
-  // Structure for describing a gap in the current list of gradients
-  struct Gap {
-    Gap(uIndex value) : start(value), end(value) {}
-    Gap(uIndex start_, uIndex end_) : start(start_), end(end_) {}
-    uIndex start;
-    uIndex end;
+  namespace internal {
+    // Seconds from an arbitrary origin on a monotonic clock, for
+    // timing recordings and reverse passes
+    double wall_clock_seconds();
+  }
+
+
+  // Position in a recording, returned by Stack::mark() and passed to
+  // Stack::rewind_to()
+  struct StackMark {
+    uIndex n_statements;
+    uIndex n_operations;
+    uIndex max_gradient;
+    uIndex n_independents;
+    uIndex n_dependents;
+    uIndex n_external_adjoints;
+  };
+
+  // Reverse pass of an opaque kernel, for
+  // Stack::push_external_adjoint(). "adjoint" holds n_lanes lanes of
+  // adjoints per gradient index: lane k of gradient i is
+  // adjoint[i*n_lanes+k]. Lanes beyond those in use are zero.
+  typedef void (*ExternalAdjoint)(void* data, Real* adjoint,
+				  uIndex n_lanes);
+
+  // Counters describing the recording and use of a Stack, returned
+  // by Stack::statistics(). The sizes refer to the current
+  // recording; the peaks, reallocations and times accumulate since
+  // the Stack was constructed or Stack::reset_statistics() was last
+  // called.
+  struct StackStatistics {
+    // Bin 0 of operations_histogram counts the statements with no
+    // operations, bin b > 0 those with 2^(b-1) to 2^b - 1, and the
+    // last bin all longer ones
+    static const int n_histogram_bins = 8;
+
+    // Current recording, excluding the null statement at the start
+    uIndex n_statements;
+    uIndex n_operations;
+    uIndex operations_histogram[n_histogram_bins];
+    uIndex max_operations_per_statement;
+    uIndex n_external_adjoints;
+    // Second derivatives recorded for hessian_vector_product(),
+    // counting each off-diagonal pair twice
+    uIndex n_second_derivatives;
+    // Gradients: registered now, needed by the current recording,
+    // the largest number needed by any recording, and the gaps in
+    // the list of registered indices
+    uIndex n_gradients_registered;
+    uIndex max_gradients;
+    uIndex peak_max_gradients;
+    uIndex n_gaps;
+    // Longest recording this Stack has held
+    uIndex peak_statements;
+    uIndex peak_operations;
+    // Reallocations of the statement and operation stacks, and the
+    // bytes allocated by them
+    uIndex n_statement_stack_grows;
+    uIndex n_operation_stack_grows;
+    std::size_t statement_stack_grow_bytes;
+    std::size_t operation_stack_grow_bytes;
+    // Bytes used by the recording and gradients (as Stack::memory()),
+    // and bytes allocated for them, including unused capacity and the
+    // lanes and workspace of compute_adjoint_vector() and
+    // hessian_vector_product()
+    std::size_t memory_used;
+    std::size_t memory_allocated;
+    // Wall-clock seconds spent recording, counted from
+    // new_recording() or rewind_to() to the next optimize() or
+    // reverse pass, and
+    // in reverse passes (compute_adjoint(), compute_adjoint_vector()
+    // and the second-order functions), with the number of reverse
+    // passes
+    uIndex n_reverse_passes;
+    double recording_seconds;
+    double reverse_seconds;
+    // Calls of Stack::optimize() that changed the recording, the
+    // statements and operations they removed in total, and the
+    // wall-clock seconds spent in all calls
+    uIndex n_optimizations;
+    uIndex optimize_statements_removed;
+    uIndex optimize_operations_removed;
+    double optimize_seconds;
+
+    // Write one "name value" line per counter, for parsing by other
+    // tools
+    void print(std::ostream& os = std::cout) const;
+  };
+
+  // What Stack::optimize() did to a recording: the statements and
+  // operations before and after, the copy statements removed after
+  // their readers were pointed at the original, the operations
+  // dropped because their multiplier was zero, and the statements
+  // dropped because no output depends on them
+  struct StackOptimization {
+    uIndex n_statements_before;
+    uIndex n_statements;
+    uIndex n_operations_before;
+    uIndex n_operations;
+    uIndex n_copies_forwarded;
+    uIndex n_zero_operations;
+    uIndex n_unreachable_statements;
+  };
+
+  // A Jacobian matrix in compressed sparse row form, computed by
+  // Stack::jacobian(SparseJacobian&). Row i holds the derivatives of
+  // dependent i: value[row_start[i]] to value[row_start[i+1]-1], with
+  // respect to the independents numbered in the same elements of
+  // "column", in increasing order. The structure holds every element
+  // that the recording can make nonzero, so some values may be zero.
+  // The Jacobian was found from n_colours forward passes, each giving
+  // a group of columns, if is_forward, otherwise from n_colours
+  // reverse passes, each giving a group of rows.
+  struct SparseJacobian {
+    uIndex n_rows;
+    uIndex n_columns;
+    std::vector<uIndex> row_start;
+    std::vector<uIndex> column;
+    std::vector<Real> value;
+    uIndex n_colours;
+    bool is_forward;
+
+    uIndex n_nonzeros() const { return column.size(); }
   };
 
 
@@ -94,6 +217,8 @@ namespace adept {
   class Stack 
 #ifdef ADEPT_STACK_STORAGE_STL
     : public internal::StackStorageOrigStl
+#elif defined(ADEPT_STACK_STORAGE_BLOCKS)
+    : public internal::StackStorage
 #else
     : public internal::StackStorageOrig
 #endif
@@ -102,8 +227,14 @@ namespace adept {
     // -------------------------------------------------------------------
     // Stack: 1. Static Definitions
     // -------------------------------------------------------------------
-    typedef std::list<Gap> GapList;
-    typedef std::list<Gap>::iterator GapListIterator;
+    typedef std::vector<Gap> GapList;
+#ifdef ADEPT_STACK_STORAGE_STL
+    typedef internal::StackStorageOrigStl Storage;
+#elif defined(ADEPT_STACK_STORAGE_BLOCKS)
+    typedef internal::StackStorage Storage;
+#else
+    typedef internal::StackStorageOrig Storage;
+#endif
 
     // -------------------------------------------------------------------
     // Stack: 2. Constructor and destructor
@@ -116,7 +247,8 @@ namespace adept {
 #ifndef ADEPT_STACK_STORAGE_STL
       gradient_(0),
 #endif
-      most_recent_gap_(gap_list_.end()),
+      n_gradient_lanes_(0), gradient_lane_stride_(0),
+      gradient_multipass_(0), n_allocated_multipass_(0),
       i_gradient_(0), n_allocated_gradients_(0), max_gradient_(0),
       n_gradients_registered_(0),
       gradients_initialized_(false), 
@@ -126,6 +258,7 @@ namespace adept {
       is_thread_unsafe_(false),
 #endif
       is_recording_(true),
+      is_recording_second_derivatives_(true),
       // Since the library might be compiled with OpenMP support and
       // subsequent programs without, we need to tell the library via
       // the following variable
@@ -134,9 +267,14 @@ namespace adept {
 #else
       have_openmp_(false),
 #endif
-      openmp_manually_disabled_(false)
+      openmp_manually_disabled_(false),
+      peak_max_gradient_(0), n_reverse_passes_(0),
+      recording_seconds_(0.0), reverse_seconds_(0.0),
+      recording_clock_start_(-1.0),
+      n_optimizations_(0), optimize_statements_removed_(0),
+      optimize_operations_removed_(0), optimize_seconds_(0.0)
     { 
-      initialize(ADEPT_INITIAL_STACK_LENGTH);
+      initialize(); // Defined in the storage class
       new_recording();
       if (activate_immediately) {
 	activate();
@@ -180,8 +318,9 @@ namespace adept {
 #ifdef ADEPT_RECORDING_PAUSABLE
       if (is_recording()) {
 #endif
+	check_gradient_numbering();
 	n_gradients_registered_++;
-	if (gap_list_.empty()) {
+	if (gaps_.empty()) {
 	  // Add to end of gradient vector
 	  i_gradient_++;
 	  if (i_gradient_ > max_gradient_) {
@@ -191,18 +330,7 @@ namespace adept {
 	}
 	else {
 	  // Insert in a gap
-	  Gap& first_gap = gap_list_.front();
-	  return_val = first_gap.start;
-	  first_gap.start++;
-	  if (first_gap.start > first_gap.end) {
-	    // Gap has closed: remove it from the list, after checking
-	    // if it had been stored as the gap that had most recently
-	    // grown
-	    if (most_recent_gap_ == gap_list_.begin()) {
-	      most_recent_gap_ = gap_list_.end();
-	    }
-	    gap_list_.pop_front();
-	  }
+	  return_val = gaps_.take(1);
 	}
 #ifdef ADEPT_RECORDING_PAUSABLE
       }
@@ -219,6 +347,7 @@ namespace adept {
 #ifdef ADEPT_RECORDING_PAUSABLE
       if (is_recording()) {
 #endif
+	check_gradient_numbering();
 	return_val = do_register_gradients(n);
 #ifdef ADEPT_RECORDING_PAUSABLE
       }
@@ -238,26 +367,19 @@ namespace adept {
     // need to keep track of a "gap" appearing in the stack. If the
     // user uses new and delete without any regard for this "last-in
     // first-out" preference then the number of gradients that are
-    // allocated in the reverse pass may be larger than needed.
+    // allocated in the reverse pass may be larger than needed. Gaps
+    // are never left next to the top of the stack.
     void unregister_gradient(const uIndex& gradient_index) {
       n_gradients_registered_--;
       if (gradient_index+1 == i_gradient_) {
         // Gradient to be unregistered is at the top of the stack
         i_gradient_--;
-	if (!gap_list_.empty()) {
-	  Gap& last_gap = gap_list_.back();
-	  if (i_gradient_ == last_gap.end+1) {
-	    // We have unregistered the elements between the "gap" of
-	    // unregistered element and the top of the stack, so can
-	    // set the variables indicating the presence of the gap to
-	    // zero
-	    i_gradient_ = last_gap.start;
-	    GapListIterator it = gap_list_.end();
-	    it--;
-	    if (most_recent_gap_ == it) {
-	      most_recent_gap_ = gap_list_.end();
-	    }
-	    gap_list_.pop_back();
+	if (!gaps_.empty() && i_gradient_ > 0) {
+	  // If a gap now reaches the top of the stack, lower the top
+	  // to its start
+	  uIndex start = gaps_.remove_ending_at(i_gradient_-1);
+	  if (start != internal::GapAllocator::NONE) {
+	    i_gradient_ = start;
 	  }
 	}
       }
@@ -297,7 +419,7 @@ namespace adept {
 	throw gradient_out_of_range();
       }
       for (uIndex i = start, j = 0; i < end_plus_one; i++, j++) {
-	gradient_[i] = gradient[j];
+	gradient_[gradient_position(i)] = gradient[j];
       }
     }
 
@@ -316,7 +438,7 @@ namespace adept {
 	throw gradient_out_of_range();
       }
       for (uIndex i = start, j = 0; i < end_plus_one; i++, j++) {
-	gradient[j] = gradient_[i];
+	gradient[j] = gradient_[gradient_position(i)];
       }
     }
     template <typename MyReal>
@@ -331,7 +453,7 @@ namespace adept {
 	throw gradient_out_of_range();
       }
       for (uIndex i = start, j = 0; i < end_plus_one; i+=src_stride, j+=target_stride) {
-	gradient[j] = gradient_[i];
+	gradient[j] = gradient_[gradient_position(i)];
       }
     }
 
@@ -348,6 +470,55 @@ namespace adept {
     void compute_adjoint();
     void reverse() { return compute_adjoint(); }
 
+    // Vector adjoint: propagate n_lanes sets of adjoints through the
+    // recording together, so that the gradients of several outputs
+    // (e.g. one per trade of a portfolio) cost one reverse pass per
+    // block of lanes rather than one pass per output. The block size
+    // is the packet size, or ADEPT_MULTIPASS_SIZE without
+    // vectorization, as for Jacobians. Seed the lanes with
+    // set_gradient_lane(), call this function and read the results
+    // with get_gradient_lane(); lanes that were not seeded start from
+    // zero. The scalar gradients of compute_adjoint() are untouched.
+    void compute_adjoint_vector(uIndex n_lanes);
+
+    // As above, but only over the statements recorded between marks
+    // "begin" and "end" (mark() for the end of the recording). A
+    // reverse pass can then be run in stages, reading or changing the
+    // lanes at a mark in between: running (m, mark()) then (begin of
+    // recording, m) is the same as the whole pass.
+    void compute_adjoint_vector(uIndex n_lanes, const StackMark& begin,
+				const StackMark& end);
+
+    // Set lane "lane" of the adjoint of the gradient at
+    // gradient_index, ready for compute_adjoint_vector()
+    void set_gradient_lane(uIndex gradient_index, uIndex lane,
+			   Real gradient) {
+      if (lane >= n_gradient_lanes_ || gradient_index >= gradient_lane_stride_) {
+	resize_gradient_lanes(std::max(lane+1, n_gradient_lanes_));
+      }
+      if (gradient_index >= gradient_lane_stride_) {
+	throw gradient_out_of_range();
+      }
+      gradient_lanes_[lane*gradient_lane_stride_
+		      +gradient_position(gradient_index)] = gradient;
+    }
+
+    // Get lane "lane" of the adjoint of the gradient at
+    // gradient_index, after compute_adjoint_vector()
+    Real get_gradient_lane(uIndex gradient_index, uIndex lane) const {
+      if (lane >= n_gradient_lanes_) {
+	throw gradients_not_initialized();
+      }
+      if (gradient_index >= gradient_lane_stride_) {
+	throw gradient_out_of_range();
+      }
+      return gradient_lanes_[lane*gradient_lane_stride_
+			     +gradient_position(gradient_index)];
+    }
+
+    // Number of lanes currently seeded or computed
+    uIndex n_gradient_lanes() const { return n_gradient_lanes_; }
+
     // Return the number of independent and dependent variables that
     // have been identified
     uIndex n_independent() const { return independent_index_.size(); }
@@ -370,6 +541,55 @@ namespace adept {
     void jacobian_forward(Real* jacobian_out);
     void jacobian_reverse(Real* jacobian_out);
 
+    // Compute the Jacobian matrix in sparse form. Its sparsity pattern
+    // is found from the recording, then the independents are split
+    // into groups ("colours") in which no two affect the same
+    // dependent, and the dependents into groups in which no two are
+    // affected by the same independent. Whichever split has fewer
+    // groups is used, with one forward pass per group of
+    // independents or one reverse pass per group of dependents
+    // (passes are run MULTIPASS_SIZE at a time). When each dependent
+    // depends on only a few independents, or the reverse, this needs
+    // far fewer passes than the dense jacobian().
+    void jacobian(SparseJacobian& jacobian_out);
+
+    // Find the sparsity pattern of the Jacobian matrix from the
+    // recording: fills n_rows, n_columns, row_start and column of
+    // "pattern" but not its values. Operations with a zero
+    // multiplier are ignored.
+    void jacobian_sparsity(SparseJacobian& pattern) const;
+
+    // Second-order adjoints, by forward over reverse. If
+    // ADEPT_SECOND_ORDER is defined where the recording is made,
+    // each scalar statement also records the second derivatives of
+    // its right-hand side (see record_second_derivatives()), and
+    // push_statement() accepts them too.
+    // hessian_vector_product() runs a tangent pass from direction v
+    // of the independents, then a reverse pass carrying the adjoint
+    // of each gradient and its tangent, and puts H*v in hv_out, where
+    // H is the Hessian, with respect to the independents, of the sum
+    // of weight[i] times dependent i (all weights one if "weight" is
+    // null). The gradient of that sum is put in gradient_out if not
+    // null. The independents and dependents must have been
+    // identified. Kinks (max, abs, branches) contribute nothing to
+    // H. Throws feature_not_available if the recording holds
+    // external adjoints or a statement with operations that has no
+    // second derivatives: one recorded without ADEPT_SECOND_ORDER,
+    // by an array expression, add_derivative_dependence() or
+    // push_statement() without them. Statements with second
+    // derivatives are left alone by preaccumulate() and optimize().
+    void hessian_vector_product(const Real* v, Real* hv_out,
+				const Real* weight = 0,
+				Real* gradient_out = 0);
+
+    // The block of the same Hessian for the n_selected independents
+    // whose positions in the list of independents are in "selected"
+    // (all independents if null) into hessian_out, which must hold
+    // n_selected*n_selected elements. All the directions are carried
+    // by one tangent pass and one reverse pass.
+    void hessian(Real* hessian_out, const uIndex* selected = 0,
+		 uIndex n_selected = 0, const Real* weight = 0);
+
     // Return maximum number of OpenMP threads to be used in Jacobian
     // calculation
     int max_jacobian_threads() const;
@@ -398,28 +618,36 @@ namespace adept {
     template <class A>
     void independent(const A& x) {
       //      independent_index_.push_back(x.gradient_index());
+      std::size_t n_before = independent_index_.size();
       x.push_gradient_indices(independent_index_);
+      renumber_indices(independent_index_, n_before);
     }
     template <class A>
     void independent(const A* x, uIndex n) {
+      std::size_t n_before = independent_index_.size();
       for (uIndex i = 0; i < n; i++) {
 	//	independent_index_.push_back(x[i].gradient_index());
 	x[i].push_gradient_indices(independent_index_);
       }
+      renumber_indices(independent_index_, n_before);
     }
 
     // Likewise, delcare the dependent variables
     template <class A>
     void dependent(const A& x) {
       //      dependent_index_.push_back(x.gradient_index());
+      std::size_t n_before = dependent_index_.size();
       x.push_gradient_indices(dependent_index_);
+      renumber_indices(dependent_index_, n_before);
     }
     template <class A>
     void dependent(const A* x, uIndex n) {
+      std::size_t n_before = dependent_index_.size();
       for (uIndex i = 0; i < n; i++) {
 	//	dependent_index_.push_back(x[i].gradient_index());
 	x[i].push_gradient_indices(dependent_index_);
       }
+      renumber_indices(dependent_index_, n_before);
     }
 
     // Print various bits of information about the Stack to the
@@ -440,11 +668,23 @@ namespace adept {
     // Print a list of the gaps in the gradient list
     void print_gaps(std::ostream& os = std::cout) const;
 
+    // Return counters describing the current recording and the use
+    // of this Stack so far, for monitoring; the operation histogram
+    // is computed here from the statement stack, so recording pays
+    // only for the reallocation counts and two clock reads per
+    // recording
+    StackStatistics statistics() const;
+
+    // Zero the accumulated counters of statistics(): the peaks,
+    // reallocations and times
+    void reset_statistics();
+
     // Clear the gradient list enabling a new adjoint or
     // tangent-linear computation to be performed with the same
     // recording
     void clear_gradients() {
       gradients_initialized_ = false;
+      n_gradient_lanes_ = 0;
     }
 
     // Clear the list of independent variables, in order that a
@@ -493,7 +733,12 @@ namespace adept {
     // Clear the contents of the various lists ready for a new
     // recording
     void new_recording() {
+      start_recording_clock();
       clear_stack(); // Defined in the storage class
+      renumber_map_.clear();
+      external_adjoints_.clear();
+      second_derivative_.clear();
+      second_order_statement_.clear();
       clear_independents();
       clear_dependents();
       clear_gradients();
@@ -503,12 +748,84 @@ namespace adept {
       // that were used in a recording.  Thus when deleting the
       // recording we need to set max_gradient_ to i_gradient_ or a
       // little more.
+      if (max_gradient_ > peak_max_gradient_) {
+	peak_max_gradient_ = max_gradient_;
+      }
       max_gradient_ = i_gradient_+1;
       // Insert a null statement
       //    std::cerr << "Inserting a null statement; when is this needed?\n";
       push_lhs(-1);
     }
 
+    // Return the current position in the recording. A recording can
+    // be started with the part common to many computations (e.g. the
+    // registration of inputs and the construction of objects from
+    // them), marked, and then extended by one computation at a time,
+    // each followed by its adjoint and a rewind_to() the mark.
+    StackMark mark() const {
+      StackMark m;
+      m.n_statements = n_statements_;
+      m.n_operations = n_operations_;
+      m.max_gradient = max_gradient_;
+      m.n_independents = independent_index_.size();
+      m.n_dependents = dependent_index_.size();
+      m.n_external_adjoints = external_adjoints_.size();
+      return m;
+    }
+
+    // Discard everything recorded since the mark was taken:
+    // statements, operations, independents and dependents. The
+    // gradients are cleared, so the next adjoint starts from zero,
+    // and a renumbering by renumber_gradients() is undone.
+    // Active objects created after the mark should have gone out of
+    // scope (or be reassigned before use), since the statements that
+    // defined them are gone. The mark must have been taken since the
+    // last new_recording().
+    void rewind_to(const StackMark& m) {
+      if (m.n_statements > n_statements_ || m.n_operations > n_operations_) {
+	throw invalid_mark("Stack::rewind_to() called with a mark that is not part of the current recording"
+			   ADEPT_EXCEPTION_LOCATION);
+      }
+      start_recording_clock();
+      if (max_gradient_ > peak_max_gradient_) {
+	peak_max_gradient_ = max_gradient_;
+      }
+      if (!renumber_map_.empty()) {
+	// Recording continues with the original numbering
+	restore_gradient_numbering(m.n_statements, m.n_operations);
+      }
+      truncate_stack(m.n_statements, m.n_operations); // Defined in the storage class
+      independent_index_.resize(std::min<std::size_t>(independent_index_.size(), m.n_independents));
+      dependent_index_.resize(std::min<std::size_t>(dependent_index_.size(), m.n_dependents));
+      external_adjoints_.resize(std::min<std::size_t>(external_adjoints_.size(), m.n_external_adjoints));
+      while (second_derivatives_from(m.n_statements)) {
+	second_order_statement_.pop_back();
+      }
+      second_derivative_.resize(second_order_statement_.empty() ? 0
+				: second_order_statement_.back().end_plus_one);
+      clear_gradients();
+      // The gradient array must still cover the statements before
+      // the mark and every active object alive now
+      max_gradient_ = std::max(m.max_gradient, i_gradient_+1);
+    }
+
+    // As rewind_to(), but the lanes of compute_adjoint_vector() are
+    // kept. After a reverse pass over everything recorded since the
+    // mark, the statements after it have had their adjoints zeroed,
+    // so the lanes hold only the adjoints of variables defined before
+    // it. A recording made next can then be swept in its turn, adding
+    // to them, and the part before the mark swept once at the end, as
+    // when a path is differentiated a block of steps at a time.
+    void rewind_keeping_adjoint_lanes(const StackMark& m) {
+      const uIndex n_lanes = n_gradient_lanes_;
+      rewind_to(m);
+      n_gradient_lanes_ = n_lanes;
+      if (n_lanes > 0 && max_gradient_ < gradient_lane_stride_) {
+	// The lanes cover the gradients of the rewound recording
+	max_gradient_ = gradient_lane_stride_;
+      }
+    }
+
     // Are gradients to be computed?  The default is "true", but if
     // ADEPT_RECORDING_PAUSABLE is defined then this may
     // be false
@@ -543,6 +860,30 @@ namespace adept {
 #endif
     }
 
+    // Are the second derivatives of statements recorded for
+    // hessian_vector_product()? This is only possible, and is then
+    // the default, if ADEPT_SECOND_ORDER has been defined.
+    bool is_recording_second_derivatives() const {
+#ifdef ADEPT_SECOND_ORDER
+      return is_recording_second_derivatives_;
+#else
+      return false;
+#endif
+    }
+
+    // Start or stop recording second derivatives, e.g. to record more
+    // cheaply when only first derivatives are wanted. Returns false
+    // if ADEPT_SECOND_ORDER has not been defined.
+    bool record_second_derivatives(bool on = true) {
+#ifdef ADEPT_SECOND_ORDER
+      is_recording_second_derivatives_ = on;
+      return true;
+#else
+      (void)on;
+      return false;
+#endif
+    }
+
     // For modular codes, some modules may have an existing Jacobian
     // code and possibly be unsuitable for automatic differentiation
     // using Adept (e.g. because they are written in Fortran).  In
@@ -589,6 +930,226 @@ namespace adept {
 #endif
     }
 
+    // Check that the operation stack has space for n more
+    // operations, which is done once before each statement is
+    // recorded, refusing while renumber_gradients() is in effect (see
+    // check_gradient_numbering())
+    void check_space(uIndex n) {
+      check_gradient_numbering();
+      Storage::check_space(n);
+    }
+    template <uIndex n>
+    void check_space_static() {
+      check_gradient_numbering();
+      Storage::template check_space_static<n>();
+    }
+
+    // Record lhs = f(rhs[0], ..., rhs[n-1]) as a single statement
+    // from its local gradient, multiplier[i] = df/drhs[i], computed
+    // by the caller. A function with known derivatives, such as an
+    // interpolation, then costs one statement rather than one per
+    // operation of its evaluation. The LHS may also appear on the
+    // RHS. Set its value with Active::set_value(), which records
+    // nothing.
+    void push_statement(uIndex lhs_index, const uIndex* rhs_index,
+			const Real* multiplier, uIndex n) {
+#ifdef ADEPT_RECORDING_PAUSABLE
+      if (is_recording()) {
+#endif
+	check_gradient_numbering();
+#ifndef ADEPT_MANUAL_MEMORY_ALLOCATION
+	check_space(n);
+#endif
+	for (uIndex i = 0; i < n; i++) {
+	  if (multiplier[i] != 0.0) {
+	    push_rhs(multiplier[i], rhs_index[i]);
+	  }
+	}
+	push_lhs(lhs_index);
+#ifdef ADEPT_RECORDING_PAUSABLE
+      }
+#endif
+    }
+
+    // As above, also supplying the second derivatives of f for
+    // hessian_vector_product(): hessian[i*n+j] = d2f/drhs[i]drhs[j],
+    // a symmetric matrix of which only the upper triangle is read
+    void push_statement(uIndex lhs_index, const uIndex* rhs_index,
+			const Real* multiplier, uIndex n,
+			const Real* hessian) {
+#ifdef ADEPT_RECORDING_PAUSABLE
+      if (is_recording()) {
+#endif
+	for (uIndex i = 0; i < n; i++) {
+	  for (uIndex j = i; j < n; j++) {
+	    if (hessian[i*n+j] != 0.0) {
+	      // An argument listed twice gets both (i,j) and (j,i)
+	      Real value = (i != j && rhs_index[i] == rhs_index[j])
+		? 2.0*hessian[i*n+j] : hessian[i*n+j];
+	      push_second_derivative(rhs_index[i], rhs_index[j], value);
+	    }
+	  }
+	}
+	push_second_order_statement();
+#ifdef ADEPT_RECORDING_PAUSABLE
+      }
+#endif
+      push_statement(lhs_index, rhs_index, multiplier, n);
+    }
+
+    // Record a second derivative of the right-hand side of the next
+    // statement, with respect to the gradients with indices i and j
+    // (both orders if they differ). Once all are pushed, call
+    // push_second_order_statement() and then push the statement.
+    void push_second_derivative(uIndex i, uIndex j, Real value) {
+      SecondDerivative d;
+      d.row = i;
+      d.column = j;
+      d.value = value;
+      second_derivative_.push_back(d);
+      if (i != j) {
+	d.row = j;
+	d.column = i;
+	second_derivative_.push_back(d);
+      }
+    }
+    void push_second_order_statement() {
+      SecondOrderStatement s;
+      s.statement = n_statements_;
+      s.end_plus_one = second_derivative_.size();
+      second_order_statement_.push_back(s);
+    }
+
+    // Record the second derivatives of scalar expression "rhs", which
+    // is about to be pushed as a statement, by evaluating it in
+    // nested dual numbers (see Dual.h) once per pair of its distinct
+    // active arguments. Called from
+    // Expression::scalar_value_and_gradient() if ADEPT_SECOND_ORDER
+    // is defined.
+    template <class E>
+    void push_second_derivatives(const E& rhs) {
+      std::vector<uIndex>& leaf = second_order_leaves_;
+      leaf.clear();
+      rhs.dual_value_(internal::DualLeafList(leaf));
+      for (std::size_t i = 0; i < leaf.size(); i++) {
+	for (std::size_t j = i; j < leaf.size(); j++) {
+	  Real value = rhs.dual_value_(internal::DualHessianSeed(leaf[i], leaf[j]))
+	    .tangent.tangent;
+	  if (value != 0.0) {
+	    push_second_derivative(leaf[i], leaf[j], value);
+	  }
+	}
+      }
+      push_second_order_statement();
+    }
+
+    // Return the number of second derivatives in the recording
+    uIndex n_second_derivatives() const { return second_derivative_.size(); }
+
+    // For a kernel whose Jacobian is not worth forming, supply its
+    // reverse pass instead: compute_adjoint() and
+    // compute_adjoint_vector() call function(data, ...) when they
+    // reach this point of the recording, i.e. after the statements
+    // recorded later. It must add the contributions of the adjoints
+    // of the kernel's outputs to those of its inputs and then zero
+    // the outputs' adjoints, as a statement does. The outputs should
+    // have had their values set with Active::set_value(). Recordings
+    // with external adjoints cannot be run forward, so the tangent
+    // linear and Jacobian functions throw feature_not_available.
+    void push_external_adjoint(ExternalAdjoint function, void* data = 0) {
+#ifdef ADEPT_RECORDING_PAUSABLE
+      if (is_recording()) {
+#endif
+	ExternalAdjointCall call;
+	call.statement = n_statements_;
+	call.function = function;
+	call.data = data;
+	external_adjoints_.push_back(call);
+#ifdef ADEPT_RECORDING_PAUSABLE
+      }
+#endif
+    }
+
+    // Return the number of external adjoints in the recording
+    uIndex n_external_adjoints() const { return external_adjoints_.size(); }
+
+    // Replace the statements recorded since mark m by one statement
+    // per output, holding its derivatives with respect to the values
+    // the region read from outside itself (its inputs, found from the
+    // recording). The local Jacobian is computed in reverse mode if
+    // there are no more outputs than inputs, otherwise in forward
+    // mode. Outputs not assigned in the region are left alone, and
+    // active objects created in the region other than the outputs
+    // must not be used afterwards, as for rewind_to(). An output may
+    // also be an input; the new statements are ordered, or go through
+    // temporaries, so that each reads the values from before the
+    // region. Returns false, leaving the recording as it was, if the
+    // region holds an external adjoint or second derivatives,
+    // recording is paused or the gradients have been renumbered.
+    // Normally used through the Preaccumulate class.
+    bool preaccumulate(const StackMark& m, const uIndex* output_index,
+		       uIndex n_outputs);
+
+    // Shrink the statements recorded since mark m, which must hold
+    // the final statement of every output the adjoints will be seeded
+    // from, before a reverse pass: a statement copying one gradient
+    // index to another with a multiplier of one is removed and its
+    // readers read the original instead, operations with a zero
+    // multiplier are dropped, and statements on which none of the
+    // outputs depends are removed. Afterwards a reverse pass seeded
+    // only from the outputs (in any number of lanes) gives the same
+    // gradients as before, to rounding, and a forward pass the same
+    // gradients of the outputs. Marks inside the region are no longer
+    // valid; rewinding to m or an earlier mark is. Returns false,
+    // leaving the recording as it was, if the region holds an
+    // external adjoint or second derivatives. If report is not null
+    // it is filled in; the
+    // totals are also counted in statistics().
+    bool optimize(const StackMark& m, const uIndex* output_index,
+		  uIndex n_outputs, StackOptimization* report = 0);
+    // Shrink the whole recording in the same way
+    bool optimize(const uIndex* output_index, uIndex n_outputs,
+		  StackOptimization* report = 0) {
+      return optimize(StackMark(), output_index, n_outputs, report);
+    }
+
+    // Renumber the gradients of the finished recording in the order
+    // in which a reverse pass first reaches them, rewriting the
+    // statement and operation stacks, so that the adjoint sweep
+    // works through the gradient array mostly sequentially. Active
+    // objects keep their indices: set_gradient(), get_gradient(),
+    // the lane functions and independent() and dependent() map them
+    // to their new positions. It pays when several reverse passes
+    // (or Jacobians) use a long recording whose indices have been
+    // scattered by reuse of gaps. The gradients are cleared.
+    // Nothing may be recorded, and no active object created, until
+    // new_recording(), rewind_to() or restore_gradient_numbering(),
+    // each of which returns to the original numbering; until then,
+    // recording a statement or registering a gradient throws
+    // adept::gradients_renumbered. Returns false, doing nothing, if
+    // the recording holds external adjoints, whose kernels address
+    // the gradients themselves.
+    bool renumber_gradients();
+
+    // Undo renumber_gradients() so that recording can continue; the
+    // gradients are cleared
+    void restore_gradient_numbering() {
+      if (!renumber_map_.empty()) {
+	restore_gradient_numbering(n_statements_, n_operations_);
+	clear_gradients();
+      }
+    }
+
+    // Return true if renumber_gradients() is in effect
+    bool gradients_renumbered() const { return !renumber_map_.empty(); }
+
+    // Return where in the gradient array the gradient of the active
+    // object with index gradient_index is held
+    uIndex gradient_position(uIndex gradient_index) const {
+      return static_cast<std::size_t>(gradient_index) < renumber_map_.size()
+	? renumber_map_[gradient_index] : gradient_index;
+    }
+
     // To enable the automatic differentiation of matrix
     // multiplication, this function performs a similar role to
     // aReal::add_derivative_dependence.  We add a derivative
@@ -647,7 +1208,9 @@ namespace adept {
     // Return the number of bytes used
     std::size_t memory() const {
       std::size_t mem = n_statements()*sizeof(uIndex)*2
-	+ n_operations()*(sizeof(Real)+sizeof(uIndex));
+	+ n_operations()*(sizeof(Multiplier)+sizeof(uIndex))
+	+ second_derivative_.size()*sizeof(SecondDerivative)
+	+ second_order_statement_.size()*sizeof(SecondOrderStatement);
       if (gradients_are_initialized()) {
 	mem += max_gradients()*sizeof(Real);
       }
@@ -672,7 +1235,8 @@ namespace adept {
 
     bool is_thread_unsafe() const { return is_thread_unsafe_; }
 
-    const GapList& gap_list() const { return gap_list_; }
+    // Return the gaps in the list of gradients, in order
+    GapList gap_list() const { return gaps_.gaps(); }
 
     // Memory to store statements and operations can be preallocated,
     // offering modest performance advantage if you define
@@ -721,6 +1285,85 @@ namespace adept {
     void jacobian_reverse_kernel_packet(Real* __restrict gradient_multipass_b) const;
     void jacobian_reverse_kernel_extra(Real* __restrict gradient_multipass_b, uIndex) const;
 
+    // Reverse pass over one block of Width lanes for
+    // compute_adjoint_vector(), and the gather and scatter around it
+    template <int Width>
+    void adjoint_vector_kernel(Real* __restrict gradient_multipass_b,
+			       uIndex begin, uIndex end) const;
+    template <int Width>
+    void adjoint_vector_block(uIndex first_lane, uIndex block_size,
+			      uIndex begin, uIndex end);
+
+    // Make room for n_lanes lanes of adjoints of every gradient,
+    // zeroing any new ones
+    void resize_gradient_lanes(uIndex n_lanes);
+
+    // Reverse pass of compute_adjoint() over statements [begin, end)
+    void compute_adjoint_statements(uIndex begin, uIndex end);
+
+    // Throw if the recording holds external adjoints, which have no
+    // forward equivalent
+    void check_no_external_adjoints(const char* function) const;
+
+    // Forward-over-reverse pass of hessian_vector_product() and
+    // hessian(): in direction v if not null, otherwise in one
+    // direction per selected independent. Leaves the adjoints in
+    // second_order_adjoint_ and their tangents, direction-fastest,
+    // in second_order_tangent_adjoint_.
+    void second_order_sweep(const Real* v, const uIndex* selected,
+			    uIndex n_directions, const Real* weight);
+
+    // Return true if any statement from "statement" onwards has
+    // second derivatives
+    bool second_derivatives_from(uIndex statement) const {
+      return !second_order_statement_.empty()
+	&& second_order_statement_.back().statement >= statement;
+    }
+
+    // Statements are recorded with the original gradient indices, so
+    // nothing may be recorded or registered while renumber_gradients()
+    // is in effect. The check is made once per statement, in
+    // check_space() and push_statement(), and in register_gradient(s),
+    // before anything is pushed, so the recording is left as it was
+    void check_gradient_numbering() const {
+      if (!renumber_map_.empty()) {
+	throw_gradients_renumbered();
+      }
+    }
+
+    // Out of line, so that the check above stays small enough to inline
+    void throw_gradients_renumbered() const;
+
+    // Map gradient indices appended to a list from position "first"
+    // to their positions after renumber_gradients()
+    void renumber_indices(std::vector<uIndex>& list, std::size_t first) {
+      if (!renumber_map_.empty()) {
+	for (std::size_t i = first; i < list.size(); i++) {
+	  list[i] = gradient_position(list[i]);
+	}
+      }
+    }
+
+    // Return the first n_statements statements and n_operations
+    // operations, and the independent and dependent lists, to the
+    // original numbering, and forget the renumbering
+    void restore_gradient_numbering(uIndex n_statements,
+				    uIndex n_operations);
+
+    // The clock of StackStatistics::recording_seconds, started by
+    // new_recording() and rewind_to() and stopped, adding the time
+    // since it was started, at the start of a reverse pass
+    void start_recording_clock() {
+      recording_clock_start_ = internal::wall_clock_seconds();
+    }
+    void stop_recording_clock() {
+      if (recording_clock_start_ >= 0.0) {
+	recording_seconds_ += internal::wall_clock_seconds()
+	  - recording_clock_start_;
+	recording_clock_start_ = -1.0;
+      }
+    }
+
     // -------------------------------------------------------------------
     // Stack: 5. Data
     // -------------------------------------------------------------------
@@ -737,14 +1380,78 @@ namespace adept {
     // For Jacobians we process multiple rows/columns at once so need
     // what is essentially a 2D array
     //    std::vector<Block<ADEPT_MULTIPASS_SIZE,Real> > gradient_multipass_;
+    // Adjoints of compute_adjoint_vector(), lane-major: lane k of
+    // gradient i is gradient_lanes_[k*gradient_lane_stride_+i]
+    std::vector<Real> gradient_lanes_;
+    uIndex n_gradient_lanes_;
+    uIndex gradient_lane_stride_;
+    // Working space for one block of lanes, kept between calls
+    Real* gradient_multipass_;
+    uIndex n_allocated_multipass_;
+    // Calls of push_external_adjoint(), each with the number of
+    // statements recorded before it
+    struct ExternalAdjointCall {
+      uIndex statement;
+      ExternalAdjoint function;
+      void* data;
+    };
+    std::vector<ExternalAdjointCall> external_adjoints_;
+    // Second derivatives of the right-hand sides of statements, each
+    // with respect to the gradients "row" and "column", and the
+    // statements that have them, each with the end of its entries in
+    // second_derivative_; both in order of recording
+    struct SecondDerivative {
+      uIndex row;
+      uIndex column;
+      Real value;
+    };
+    struct SecondOrderStatement {
+      uIndex statement;
+      uIndex end_plus_one;
+    };
+    std::vector<SecondDerivative> second_derivative_;
+    std::vector<SecondOrderStatement> second_order_statement_;
+    // Scratch space of push_second_derivatives(), and of
+    // second_order_sweep(): the tangents of the gradients and the
+    // terms of the second derivatives, direction-fastest, and the
+    // adjoints and their tangents
+    std::vector<uIndex> second_order_leaves_;
+    std::vector<Real> second_order_tangent_;
+    std::vector<Real> second_order_term_;
+    std::vector<Real> second_order_adjoint_;
+    std::vector<Real> second_order_tangent_adjoint_;
+    // Scratch space of preaccumulate(), kept between calls: flags and
+    // zeroed adjoints or tangents per gradient index, the inputs,
+    // defined indices and outputs of the region, the order in which
+    // to assign the outputs, and the Jacobian
+    std::vector<unsigned char> preaccumulate_flags_;
+    std::vector<Real> preaccumulate_gradient_;
+    std::vector<uIndex> preaccumulate_inputs_;
+    std::vector<uIndex> preaccumulate_defined_;
+    std::vector<uIndex> preaccumulate_outputs_;
+    std::vector<uIndex> preaccumulate_order_;
+    std::vector<Real> preaccumulate_jacobian_;
+    // Scratch space of optimize(), kept between calls: per gradient
+    // index, the statement that last assigned it, the copy statement
+    // (if any) that last assigned it, the index it copies and the
+    // statement that had assigned that index, and whether an output
+    // may depend on it; and flags per statement of the region
+    std::vector<uIndex> optimize_assigned_;
+    std::vector<uIndex> optimize_copy_;
+    std::vector<uIndex> optimize_source_;
+    std::vector<uIndex> optimize_source_assigned_;
+    std::vector<unsigned char> optimize_live_;
+    std::vector<unsigned char> optimize_flags_;
+    // Position of the gradient of each index after
+    // renumber_gradients(), or empty if not renumbered; indices
+    // beyond its end are not moved
+    std::vector<uIndex> renumber_map_;
     // uIndexs of the independent and dependent variables
     std::vector<uIndex> independent_index_;
     std::vector<uIndex> dependent_index_;
     // Keep a record of gaps in the gradient array to ensure that gaps
     // are filled
-    GapList gap_list_;
-    //    Gap* most_recent_gap_;
-    GapListIterator most_recent_gap_;
+    internal::GapAllocator gaps_;
 
     uIndex i_gradient_;             // Current number of gradients
     uIndex n_allocated_gradients_;  // Number of allocated gradients
@@ -754,10 +1461,22 @@ namespace adept {
 				    // initialized?
     bool is_thread_unsafe_;
     bool is_recording_;
+    bool is_recording_second_derivatives_;
     bool have_openmp_;              // true if this header file
 				    // compiled with -fopenmp
     bool openmp_manually_disabled_; // true if user called
 				    // set_max_jacobian_threads(1)
+    // Accumulated counters of statistics()
+    uIndex peak_max_gradient_;      // Largest max_gradient_ of a
+				    // finished recording
+    uIndex n_reverse_passes_;
+    double recording_seconds_;
+    double reverse_seconds_;
+    double recording_clock_start_;  // Negative if stopped
+    uIndex n_optimizations_;
+    uIndex optimize_statements_removed_;
+    uIndex optimize_operations_removed_;
+    double optimize_seconds_;
   }; // End of Stack class
 
 
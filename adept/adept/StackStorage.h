@@ -1,4 +1,4 @@
-/* StackStorage.h -- Storage of statement & operation stacks
+/* StackStorage.h -- Storage of statement & operation stacks in blocks
 
     Copyright (C) 2012-2014 University of Reading
     Copyright (C) 2015 European Centre for Medium-Range Weather Forecasts
@@ -13,14 +13,30 @@
    statements are held in two stacks described by Hogan (2014): the
    "statement stack" and the "operation stack".
 
-   This file provides the stack storage engine: blocks of dynamically
-   allocated arrays.
+   This file provides the block storage engine, selected by defining
+   ADEPT_STACK_STORAGE_BLOCKS. Each of the three arrays reserves
+   address space for the longest possible stack when the Stack is
+   constructed, and memory is committed to it in blocks of
+   ADEPT_STACK_BLOCK_LENGTH elements as the recording grows. The
+   stacks therefore never move: growing them copies nothing and
+   never needs twice the memory of the recording, while the
+   algorithms of the Stack class still see contiguous arrays.
+
+   If a spill directory has been set with set_stack_spill_directory()
+   (see settings.h), the blocks are mapped from an unlinked temporary
+   file in that directory rather than from anonymous memory, so the
+   operating system can write blocks that have not been touched
+   recently to disk and a recording larger than physical memory can
+   still be reversed. This engine needs POSIX mmap().
 
 */
 
 #ifndef AdeptStackStorage_H
 #define AdeptStackStorage_H 1
 
+#include <cstddef>
+#include <string>
+
 #include <adept/base.h>
 #include <adept/exception.h>
 #include <adept/Statement.h>
@@ -28,61 +44,55 @@
 namespace adept {
   namespace internal {
 
-    // Helper classes
-
-
-    struct StatementBlock {
-      StatementBlock(uIndex n_) : n(0), n_allocated(n_) {
-	data = new Statement[n_];
-      }
-      ~StatementBlock() {
-	delete [] data;
-      }
-      // Data
-      Statement* data;
-      uIndex n;
-      const uIndex n_allocated;
-    };
-
-    struct OperationBlock {
-      StatementBlock(uIndex n_) : n(0), n_allocated(n_) {
-	multiplier = new Real[n_];
-	index      = new uIndex[n_];
-      }
-      ~StatementBlock() {
-	delete [] multiplier;
-	delete [] index;
-      }
-      // Data
-      Real* multiplier;
-      uIndex* index;
-      uIndex n;
-      uIndex n_allocated
-    };
-
-    std::vector<StackBlock> stack_block_;
-    struct StackBlock {
-      StatementBlock* statement_list;
-      OperationBlock* operation_list;
-      uIndex statement_start;
-      uIndex statement_end;
+    // An array whose address space is reserved up front and to which
+    // memory is committed in blocks, so that it grows without moving
+    class BlockArray {
+    public:
+      BlockArray() : data_(0), n_reserved_bytes_(0),
+		     n_committed_bytes_(0), file_(-1) { }
+
+      // Unmap the array and close its spill file
+      ~BlockArray();
+
+      // Reserve address space for up to max_bytes, or as much less as
+      // the system allows, backed by a temporary file in
+      // spill_directory unless it is empty. Returns the start of the
+      // array.
+      void* reserve(std::size_t max_bytes,
+		    const std::string& spill_directory);
+
+      // Commit memory up to n_bytes from the start, which must be a
+      // multiple of the page size; throws stack_exhausted if this
+      // exceeds the reservation
+      void commit(std::size_t n_bytes);
+
+      std::size_t n_reserved_bytes() const { return n_reserved_bytes_; }
+      std::size_t n_committed_bytes() const { return n_committed_bytes_; }
+
+    private:
+      // Not copyable
+      BlockArray(const BlockArray&);
+      BlockArray& operator=(const BlockArray&);
+
+      char* data_;
+      std::size_t n_reserved_bytes_;
+      std::size_t n_committed_bytes_;
+      int file_;                    // Spill file descriptor, or -1
     };
 
-    std::vector<StatementBlock> statement_data_;
-    std::vector<OperationBlock> operation_data_;
-
-
-
     class StackStorage {
     public:
       // Constructor
-      StackStorage() : 
+      StackStorage() :
 	statement_(0), multiplier_(0), index_(0),
 	n_statements_(0), n_allocated_statements_(0),
-	n_operations_(0), n_allocated_operations_(0) { }
-      
-      // Destructor
-      ~StackStorage();
+	n_operations_(0), n_allocated_operations_(0),
+	peak_statements_(0), peak_operations_(0),
+	n_statement_stack_grows_(0), n_operation_stack_grows_(0),
+	statement_stack_grow_bytes_(0), operation_stack_grow_bytes_(0) { }
+
+      // Destructor: the BlockArray members release the memory
+      ~StackStorage() { }
 
       // Push an operation (i.e. a multiplier-gradient pair) on to the
       // stack.  We assume here that check_space() as been called before
@@ -97,18 +107,29 @@ namespace adept {
 #endif
 	  multiplier_[n_operations_] = multiplier;
 	  index_[n_operations_++] = gradient_index;
-	
+
 #ifdef ADEPT_TRACK_NON_FINITE_GRADIENTS
 	  if (!std::isfinite(multiplier) || std::isinf(multiplier)) {
 	    throw non_finite_gradient();
 	  }
 #endif
-	
+
 #ifdef ADEPT_REMOVE_NULL_STATEMENTS
 	}
 #endif
       }
 
+      // Push the gradient indices of a vectorized operation on to the
+      // stack.  We assume here that check_space() as been called
+      // before so there is enough space to hold these elements. The
+      // multipliers will be added later.
+      template <Index Num, Index Stride>
+      void push_rhs_indices(const uIndex& gradient_index) {
+	for (Index i = 0; i < Num; ++i) {
+	  index_[n_operations_+i*Stride] = gradient_index+i;
+	}
+	++n_operations_;
+      }
 
       // Push a statement on to the stack: this is done after a
       // sequence of operation pushes; gradient_index is the index of
@@ -129,9 +150,10 @@ namespace adept {
       // stack with no corresponding right-hand-side, appropriate if
       // an array of active variables contiguous in memory (or
       // separated by a fixed stride) has been assigned to inactive
-      // numbers.
-      void push_lhs_range(const uIndex& first, const uIndex& n, 
-			  const uIndex& stride = 1) {
+      // numbers. Note that the second and third arguments must not be
+      // references, since they may be compile-time constants for
+      // FixedArray objects.
+      void push_lhs_range(const uIndex& first, uIndex n, uIndex stride = 1) {
 	uIndex last_plus_1 = first+n*stride;
 #ifndef ADEPT_MANUAL_MEMORY_ALLOCATION
 	if (n_statements_+n > n_allocated_statements_) {
@@ -146,7 +168,7 @@ namespace adept {
 
       // Check whether the operation stack contains enough space for n
       // new operations; if not, grow it
-      void check_space(const uIndex& n) {
+      void check_space(uIndex n) {
 	if (n_allocated_operations_ < n_operations_+n+1) {
 	  grow_operation_stack(n);
 	}
@@ -157,42 +179,69 @@ namespace adept {
       }
 
     protected:
-      // Called by new_recording()
-      void clear_stack() { 
+      // Called by new_recording(). The committed blocks are kept for
+      // the next recording.
+      void clear_stack() {
+	record_peak();
 	// Set the recording indices to zero
 	n_operations_ = 0;
 	n_statements_ = 0;
       }
 
-      // This function is called by the constructor to initialize
-      // memory, which can be grown subsequently
-      void initialize(uIndex n) {
-	multiplier_ = new Real[n];
-	index_ = new uIndex[n];
-	n_allocated_operations_ = n;
-	statement_ = new Statement[n];
-	n_allocated_statements_ = n;
+      // Called by rewind_to(): discard the statements and operations
+      // recorded after the first n_statements and n_operations
+      void truncate_stack(uIndex n_statements, uIndex n_operations) {
+	record_peak();
+	n_operations_ = n_operations;
+	n_statements_ = n_statements;
       }
 
-      // Grow the capacity of the operation or statement stacks to
-      // hold a minimum of "min" elements. If min=0 then the stacks
-      // are doubled in size.
+      // This function is called by the constructor to reserve the
+      // address space of the stacks and commit enough blocks for
+      // initial_stack_length() elements (see settings.h)
+      void initialize();
+
+      // Commit enough further blocks to hold a minimum of "min"
+      // extra elements, or one more block if min=0. The growth
+      // factor of set_stack_growth_factor() is not used.
       void grow_operation_stack(uIndex min = 0);
       void grow_statement_stack(uIndex min = 0);
 
-    protected:
-      // Data are stored as dynamically allocated arrays
+      // Keep track of the longest recording made with these stacks
+      void record_peak() {
+	if (n_statements_ > peak_statements_) {
+	  peak_statements_ = n_statements_;
+	}
+	if (n_operations_ > peak_operations_) {
+	  peak_operations_ = n_operations_;
+	}
+      }
 
+    protected:
       // The "statement stack" is held as a single array
       Statement* __restrict statement_ ;
       // The "operation stack" is held as two arrays
-      Real*      __restrict multiplier_;
+      Multiplier* __restrict multiplier_;
       uIndex*    __restrict index_;
 
       uIndex n_statements_;           // Number of statements
-      uIndex n_allocated_statements_; // Space allocated for statements
+      uIndex n_allocated_statements_; // Space committed for statements
       uIndex n_operations_;           // Number of operations
-      uIndex n_allocated_operations_; // Space allocated for statements
+      uIndex n_allocated_operations_; // Space committed for operations
+      uIndex peak_statements_;        // Longest recording so far...
+      uIndex peak_operations_;        // ...in statements and operations
+      // Number of calls to grow_statement_stack() and
+      // grow_operation_stack(), and the bytes they committed
+      uIndex n_statement_stack_grows_;
+      uIndex n_operation_stack_grows_;
+      std::size_t statement_stack_grow_bytes_;
+      std::size_t operation_stack_grow_bytes_;
+
+    private:
+      // The memory behind statement_, multiplier_ and index_
+      BlockArray statement_block_;
+      BlockArray multiplier_block_;
+      BlockArray index_block_;
     };
 
   } // End namespace internal
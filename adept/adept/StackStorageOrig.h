@@ -35,9 +35,12 @@ namespace adept {
       StackStorageOrig() : 
 	statement_(0), multiplier_(0), index_(0),
 	n_statements_(0), n_allocated_statements_(0),
-	n_operations_(0), n_allocated_operations_(0) { }
+	n_operations_(0), n_allocated_operations_(0),
+	peak_statements_(0), peak_operations_(0),
+	n_statement_stack_grows_(0), n_operation_stack_grows_(0),
+	statement_stack_grow_bytes_(0), operation_stack_grow_bytes_(0) { }
       
-      // Destructor
+      // Destructor: returns the stacks to the tape pool
       ~StackStorageOrig();
 
       // Push an operation (i.e. a multiplier-gradient pair) on to the
@@ -127,42 +130,74 @@ namespace adept {
     protected:
       // Called by new_recording()
       void clear_stack() { 
+	record_peak();
 	// Set the recording indices to zero
 	n_operations_ = 0;
 	n_statements_ = 0;
       }
 
-      // This function is called by the constructor to initialize
-      // memory, which can be grown subsequently
-      void initialize(uIndex n) {
-	multiplier_ = new Real[n];
-	index_ = new uIndex[n];
-	n_allocated_operations_ = n;
-	statement_ = new Statement[n];
-	n_allocated_statements_ = n;
+      // Called by rewind_to(): discard the statements and operations
+      // recorded after the first n_statements and n_operations
+      void truncate_stack(uIndex n_statements, uIndex n_operations) {
+	record_peak();
+	n_operations_ = n_operations;
+	n_statements_ = n_statements;
       }
 
+      // This function is called by the constructor to initialize
+      // memory, which can be grown subsequently. The stacks are
+      // borrowed from the tape pool, which sizes them according to
+      // the policy set by set_initial_stack_length() and
+      // set_stack_auto_size() (see settings.h).
+      void initialize();
+
       // Grow the capacity of the operation or statement stacks to
-      // hold a minimum of "min" elements. If min=0 then the stacks
-      // are doubled in size.
+      // hold a minimum of "min" extra elements. If min=0 then the
+      // stacks are grown by the factor set by
+      // set_stack_growth_factor(), by default 2.
       void grow_operation_stack(uIndex min = 0);
       void grow_statement_stack(uIndex min = 0);
 
+      // Keep track of the longest recording made with these stacks,
+      // which the tape pool uses to size the stacks of the next Stack
+      // when auto-sizing is on
+      void record_peak() {
+	if (n_statements_ > peak_statements_) {
+	  peak_statements_ = n_statements_;
+	}
+	if (n_operations_ > peak_operations_) {
+	  peak_operations_ = n_operations_;
+	}
+      }
+
     protected:
       // Data are stored as dynamically allocated arrays
 
       // The "statement stack" is held as a single array
       Statement* __restrict statement_ ;
       // The "operation stack" is held as two arrays
-      Real*      __restrict multiplier_;
+      Multiplier* __restrict multiplier_;
       uIndex*    __restrict index_;
 
       uIndex n_statements_;           // Number of statements
       uIndex n_allocated_statements_; // Space allocated for statements
       uIndex n_operations_;           // Number of operations
       uIndex n_allocated_operations_; // Space allocated for statements
+      uIndex peak_statements_;        // Longest recording so far...
+      uIndex peak_operations_;        // ...in statements and operations
+      // Number of calls to grow_statement_stack() and
+      // grow_operation_stack(), and the bytes they allocated
+      uIndex n_statement_stack_grows_;
+      uIndex n_operation_stack_grows_;
+      std::size_t statement_stack_grow_bytes_;
+      std::size_t operation_stack_grow_bytes_;
     };
 
+    // Borrow a gradient array of at least n elements from the tape
+    // pool, setting n_allocated to its actual size, and return it
+    Real* acquire_gradients(uIndex n, uIndex& n_allocated);
+    void release_gradients(Real* gradient, uIndex n);
+
   } // End namespace internal
 } // End namespace adept
 
@@ -24,6 +24,7 @@
 #include <adept/base.h>
 #include <adept/exception.h>
 #include <adept/Statement.h>
+#include <adept/settings.h>
 
 namespace adept {
   namespace internal {
@@ -33,7 +34,9 @@ namespace adept {
       // Constructor
       StackStorageOrigStl() :
 	n_statements_(0), n_allocated_statements_(0),
-	n_operations_(0), n_allocated_operations_(0) { }
+	n_operations_(0), n_allocated_operations_(0),
+	n_statement_stack_grows_(0), n_operation_stack_grows_(0),
+	statement_stack_grow_bytes_(0), operation_stack_grow_bytes_(0) { }
       
       // Destructor (does nothing)
       ~StackStorageOrigStl() { };
@@ -107,9 +110,21 @@ namespace adept {
 	n_statements_ = 0;
       }
 
+      // Called by rewind_to(): discard the statements and operations
+      // recorded after the first n_statements and n_operations,
+      // keeping the memory allocated
+      void truncate_stack(uIndex n_statements, uIndex n_operations) {
+	statement_.resize(n_statements);
+	multiplier_.resize(n_operations);
+	index_.resize(n_operations);
+	n_operations_ = n_operations;
+	n_statements_ = n_statements;
+      }
+
       // This function is called by the constructor to initialize
       // memory, which can be grown subsequently
-      void initialize(uIndex n) {
+      void initialize() {
+	uIndex n = initial_stack_length();
 	statement_.reserve(n);
 	multiplier_.reserve(n);
 	index_.reserve(n);
@@ -127,13 +142,19 @@ namespace adept {
       // The "statement stack" is held as a single array
       std::vector<Statement> statement_;
       // The "operation stack" is held as two arrays
-      std::vector<Real> multiplier_;
+      std::vector<Multiplier> multiplier_;
       std::vector<uIndex> index_;
 
       uIndex n_statements_;           // Number of statements
       uIndex n_allocated_statements_; // Space allocated for statements
       uIndex n_operations_;           // Number of operations
       uIndex n_allocated_operations_; // Space allocated for statements
+      // The containers reallocate themselves, so these counters of
+      // Stack::statistics() stay zero
+      uIndex n_statement_stack_grows_;
+      uIndex n_operation_stack_grows_;
+      std::size_t statement_stack_grow_bytes_;
+      std::size_t operation_stack_grow_bytes_;
     };
 
   } // End namespace internal
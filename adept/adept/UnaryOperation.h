@@ -107,6 +107,11 @@ namespace adept {
 	return scratch[MyScratchNum];
       }
 
+      template <class Seed>
+      typename Seed::type dual_value_(const Seed& seed) const {
+	return operation(arg.dual_value_(seed));
+      }
+
       template <bool IsAligned,	int MyArrayNum, typename PacketType,
 	int NArrays>
       PacketType values_at_location_(const ExpressionSize<NArrays>& loc) const {
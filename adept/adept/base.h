@@ -100,7 +100,9 @@
 #define ADEPT_INITIAL_STACK_LENGTH 1048576
 #endif
 
-// The statement and operation stacks
+// The number of elements by which the block storage engine
+// (ADEPT_STACK_STORAGE_BLOCKS) grows the statement and operation
+// stacks
 #ifndef ADEPT_STACK_BLOCK_LENGTH
 #define ADEPT_STACK_BLOCK_LENGTH 1048576
 #endif
@@ -126,6 +128,12 @@
 // used.  Experience says that dynamically allocated arrays are faster.
 //#define ADEPT_STACK_STORAGE_STL 1
 
+// If ADEPT_STACK_STORAGE_BLOCKS is defined instead, the arrays
+// reserve their address space up front and grow in blocks of
+// ADEPT_STACK_BLOCK_LENGTH elements without being copied, optionally
+// backed by a file (see StackStorage.h). This needs POSIX mmap().
+//#define ADEPT_STACK_STORAGE_BLOCKS 1
+
 // The number of rows/columns of a Jacobian that are calculated at
 // once. The optimum value depends on platform, the size of your
 // Jacobian and the number of OpenMP threads available.
@@ -153,6 +161,15 @@
 // code will fail to compile.
 //#define ADEPT_REAL_TYPE_SIZE 8
 
+// The multipliers held on the operation stack (the partial
+// derivatives of each statement) are stored as "Real" by default. The
+// reverse pass streams through them, so storing them in single
+// precision by defining ADEPT_MULTIPLIER_TYPE_SIZE to 4 cuts the
+// operation stack from 12 to 8 bytes per operation (with 4-byte
+// indices). Values and gradients stay in "Real"; each multiplier
+// then carries a relative rounding error of up to 6e-8.
+//#define ADEPT_MULTIPLIER_TYPE_SIZE 4
+
 // Thread-local storage is used for the global Stack pointer to ensure
 // thread safety.  In pre-C++11 compilers, thread-local variables are
 // declared in different ways by different compilers, the most common
@@ -283,6 +300,19 @@ namespace adept {
 #else
 #undef ADEPT_REAL_TYPE_SIZE
 #error If defined, ADEPT_REAL_TYPE_SIZE must be 4 (float), 8 (double) or 16 (long double)
+#endif
+
+  // The type of the multipliers on the operation stack
+#ifndef ADEPT_MULTIPLIER_TYPE_SIZE
+  typedef Real Multiplier;
+#elif ADEPT_MULTIPLIER_TYPE_SIZE == 4
+  typedef float Multiplier;
+#elif ADEPT_MULTIPLIER_TYPE_SIZE == 8
+  typedef double Multiplier;
+#elif ADEPT_MULTIPLIER_TYPE_SIZE == 16
+  typedef long double Multiplier;
+#else
+#error If defined, ADEPT_MULTIPLIER_TYPE_SIZE must be 4 (float), 8 (double) or 16 (long double)
 #endif
 
   // By default sizes of arrays, indices to them, and indices in the
@@ -94,6 +94,34 @@ namespace adept {
     { message_ = message; }
   };
 
+  class invalid_mark : public autodiff_exception {
+  public:
+    invalid_mark(const std::string& message
+	= "Stack mark is not part of the current recording")
+    { message_ = message; }
+  };
+
+  class gradients_renumbered : public autodiff_exception {
+  public:
+    gradients_renumbered(const std::string& message
+	= "Recording while the gradients are renumbered: call restore_gradient_numbering(), rewind_to() or new_recording() first")
+    { message_ = message; }
+  };
+
+  class invalid_stack_setting : public autodiff_exception {
+  public:
+    invalid_stack_setting(const std::string& message
+	= "Invalid stack memory setting")
+    { message_ = message; }
+  };
+
+  class stack_exhausted : public autodiff_exception {
+  public:
+    stack_exhausted(const std::string& message
+	= "Memory for the statement or operation stack could not be obtained")
+    { message_ = message; }
+  };
+
 
   // -------------------------------------------------------------------
   // array_exception and child classes
@@ -12,6 +12,9 @@
 #define AdeptSettings_H 1
 
 #include <string>
+#include <cstddef>
+
+#include <adept/base.h>
 
 namespace adept {
 
@@ -57,6 +60,40 @@ namespace adept {
   // array threads to one.
   int set_max_blas_threads(int n);
 
+
+  // Memory policy for the statement and operation stacks ("tape") of
+  // Stack objects constructed from now on. Tapes are taken from a
+  // process-wide pool to which destroyed Stacks return them, and
+  // are only allocated when the pool is empty. Each setter returns
+  // the previous value.
+
+  // Length of a newly allocated tape (default
+  // ADEPT_INITIAL_STACK_LENGTH)
+  uIndex initial_stack_length();
+  uIndex set_initial_stack_length(uIndex n);
+
+  // Factor by which a full tape is enlarged (default 2)
+  double stack_growth_factor();
+  double set_stack_growth_factor(double factor);
+
+  // If true, size new tapes from the longest recording made on the
+  // last tape returned to the pool, rather than the initial length
+  bool stack_auto_size();
+  bool set_stack_auto_size(bool auto_size);
+
+  // Directory in which the block storage engine
+  // (ADEPT_STACK_STORAGE_BLOCKS, see StackStorage.h) creates an
+  // unlinked temporary file to back the stacks, so that the system
+  // can page recordings larger than physical memory out to disk. An
+  // empty string, the default, keeps the stacks in ordinary memory.
+  // Other storage engines ignore it.
+  std::string stack_spill_directory();
+  std::string set_stack_spill_directory(const std::string& directory);
+
+  // Free the tapes held by the pool, returning the number of bytes
+  // released
+  std::size_t release_stack_pool();
+
 } // End namespace adept
 
 #endif
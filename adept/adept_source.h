@@ -427,6 +427,7 @@ namespace adept {
 
 #include <iostream>
 #include <cstring> // For memcpy
+#include <chrono>
 
 
 #ifdef _OPENMP
@@ -461,10 +462,11 @@ namespace adept {
       _stack_current_thread = 0; 
     }
 #ifndef ADEPT_STACK_STORAGE_STL
-    if (gradient_) {
-      delete[] gradient_;
-    }
+    internal::release_gradients(gradient_, n_allocated_gradients_);
 #endif
+    if (gradient_multipass_) {
+      free_aligned(gradient_multipass_);
+    }
   }
   
   // Make this stack "active" by copying its "this" pointer to a
@@ -555,29 +557,518 @@ namespace adept {
   Stack::compute_adjoint()
   {
     if (gradients_are_initialized()) {
-      // Loop backwards through the derivative statements
-      for (uIndex ist = n_statements_-1; ist > 0; ist--) {
-	const Statement& statement = statement_[ist];
-	// We copy the RHS gradient (LHS in the original derivative
-	// statement but swapped in the adjoint equivalent) to "a" in
-	// case it appears on the LHS in any of the following statements
-	Real a = gradient_[statement.index];
-	gradient_[statement.index] = 0.0;
-	// By only looping if a is non-zero we gain a significant speed-up
-	if (a != 0.0) {
-	  // Loop over operations
-	  for (uIndex i = statement_[ist-1].end_plus_one;
-	       i < statement.end_plus_one; i++) {
-	    gradient_[index_[i]] += multiplier_[i]*a;
-	  }
-	}
+      stop_recording_clock();
+      const double start = wall_clock_seconds();
+      // Run the statements recorded after each external adjoint, then
+      // the external adjoint itself, from the last to the first
+      uIndex end = n_statements_;
+      for (std::size_t i = external_adjoints_.size(); i > 0; i--) {
+	const ExternalAdjointCall& call = external_adjoints_[i-1];
+	compute_adjoint_statements(call.statement, end);
+	(*call.function)(call.data, gradient_, 1);
+	end = call.statement;
       }
+      compute_adjoint_statements(0, end);
+      reverse_seconds_ += wall_clock_seconds() - start;
+      ++n_reverse_passes_;
     }  
     else {
       throw(gradients_not_initialized());
     }  
   }
 
+  // Reverse pass over statements [begin, end)
+  void
+  Stack::compute_adjoint_statements(uIndex begin, uIndex end)
+  {
+    // Statement 0 only marks the start of the operations
+    const uIndex stop = begin > 0 ? begin-1 : 0;
+    // Loop backwards through the derivative statements
+    for (uIndex ist = end-1; ist > stop; ist--) {
+      const Statement& statement = statement_[ist];
+      // We copy the RHS gradient (LHS in the original derivative
+      // statement but swapped in the adjoint equivalent) to "a" in
+      // case it appears on the LHS in any of the following statements
+      Real a = gradient_[statement.index];
+      gradient_[statement.index] = 0.0;
+      // By only looping if a is non-zero we gain a significant speed-up
+      if (a != 0.0) {
+	// Loop over operations
+	for (uIndex i = statement_[ist-1].end_plus_one;
+	     i < statement.end_plus_one; i++) {
+	  gradient_[index_[i]] += multiplier_[i]*a;
+	}
+      }
+    }
+  }
+
+  void
+  Stack::check_no_external_adjoints(const char* function) const
+  {
+    if (!external_adjoints_.empty()) {
+      throw feature_not_available(std::string(function)
+	  + " is not available for a recording with external adjoints");
+    }
+  }
+
+  // Collapse the statements recorded since mark m into their local
+  // Jacobian (see Stack.h)
+  bool
+  Stack::preaccumulate(const StackMark& m, const uIndex* output_index,
+		       uIndex n_outputs)
+  {
+    if (m.n_statements > n_statements_ || m.n_operations > n_operations_) {
+      throw invalid_mark("Stack::preaccumulate() called with a mark that is not part of the current recording"
+			 ADEPT_EXCEPTION_LOCATION);
+    }
+    if (!is_recording()
+	|| external_adjoints_.size() > static_cast<std::size_t>(m.n_external_adjoints)
+	|| !renumber_map_.empty() || second_derivatives_from(m.n_statements)) {
+      return false;
+    }
+    // Statement 0 only marks the start of the operations
+    const uIndex begin = std::max<uIndex>(m.n_statements, 1);
+    const uIndex end = n_statements_;
+    if (begin >= end) {
+      return true;
+    }
+
+    static const unsigned char INPUT = 1, DEFINED = 2, OUTPUT = 4, EMITTED = 8;
+    std::vector<unsigned char>& flags = preaccumulate_flags_;
+    std::vector<Real>& g = preaccumulate_gradient_;
+    std::vector<uIndex>& inputs = preaccumulate_inputs_;
+    std::vector<uIndex>& defined = preaccumulate_defined_;
+    std::vector<uIndex>& outputs = preaccumulate_outputs_;
+    std::vector<uIndex>& order = preaccumulate_order_;
+    std::vector<Real>& jac = preaccumulate_jacobian_;
+    if (flags.size() < static_cast<std::size_t>(max_gradient_)) {
+      flags.resize(max_gradient_, 0);
+      g.resize(max_gradient_, 0.0);
+    }
+    inputs.clear();
+    defined.clear();
+    outputs.clear();
+    order.clear();
+
+    // The inputs are the indices read before being assigned in the
+    // region
+    for (uIndex ist = begin; ist < end; ist++) {
+      for (uIndex iop = statement_[ist-1].end_plus_one;
+	   iop < statement_[ist].end_plus_one; iop++) {
+	uIndex i = index_[iop];
+	if (!(flags[i] & (INPUT | DEFINED))) {
+	  flags[i] |= INPUT;
+	  inputs.push_back(i);
+	}
+      }
+      uIndex lhs = statement_[ist].index;
+      if (!(flags[lhs] & DEFINED)) {
+	flags[lhs] |= DEFINED;
+	defined.push_back(lhs);
+      }
+    }
+    for (uIndex k = 0; k < n_outputs; k++) {
+      uIndex i = output_index[k];
+      if (i < max_gradient_ && (flags[i] & DEFINED) && !(flags[i] & OUTPUT)) {
+	flags[i] |= OUTPUT;
+	outputs.push_back(i);
+      }
+    }
+    const uIndex n_in = inputs.size(), n_out = outputs.size();
+    jac.assign(n_out*n_in, 0.0);
+
+    if (n_out <= n_in) {
+      // Reverse mode: one pass per output gives a row
+      for (uIndex k = 0; k < n_out; k++) {
+	g[outputs[k]] = 1.0;
+	for (uIndex ist = end-1; ist >= begin; ist--) {
+	  const Statement& statement = statement_[ist];
+	  Real a = g[statement.index];
+	  g[statement.index] = 0.0;
+	  if (a != 0.0) {
+	    for (uIndex iop = statement_[ist-1].end_plus_one;
+		 iop < statement.end_plus_one; iop++) {
+	      g[index_[iop]] += multiplier_[iop]*a;
+	    }
+	  }
+	}
+	for (uIndex j = 0; j < n_in; j++) {
+	  jac[k*n_in+j] = g[inputs[j]];
+	  g[inputs[j]] = 0.0;
+	}
+      }
+    }
+    else {
+      // Forward mode: one pass per input gives a column
+      for (uIndex j = 0; j < n_in; j++) {
+	g[inputs[j]] = 1.0;
+	for (uIndex ist = begin; ist < end; ist++) {
+	  const Statement& statement = statement_[ist];
+	  Real a = 0.0;
+	  for (uIndex iop = statement_[ist-1].end_plus_one;
+	       iop < statement.end_plus_one; iop++) {
+	    a += multiplier_[iop]*g[index_[iop]];
+	  }
+	  g[statement.index] = a;
+	}
+	for (uIndex k = 0; k < n_out; k++) {
+	  jac[k*n_in+j] = g[outputs[k]];
+	}
+	g[inputs[j]] = 0.0;
+	for (std::size_t d = 0; d < defined.size(); d++) {
+	  g[defined[d]] = 0.0;
+	}
+      }
+    }
+
+    // Order the outputs so that an output that is also an input is
+    // assigned only after every other output reading it. Outputs
+    // that read each other's values in a cycle are assigned through
+    // temporaries instead.
+    uIndex n_nonzero = 0;
+    while (order.size() < static_cast<std::size_t>(n_out)) {
+      bool progress = false;
+      for (uIndex k = 0; k < n_out; k++) {
+	if (flags[outputs[k]] & EMITTED) {
+	  continue;
+	}
+	bool ready = true;
+	if (flags[outputs[k]] & INPUT) {
+	  uIndex j = std::find(inputs.begin(), inputs.end(), outputs[k])-inputs.begin();
+	  for (uIndex l = 0; l < n_out && ready; l++) {
+	    ready = l == k || (flags[outputs[l]] & EMITTED) || jac[l*n_in+j] == 0.0;
+	  }
+	}
+	if (ready) {
+	  flags[outputs[k]] |= EMITTED;
+	  order.push_back(k);
+	  progress = true;
+	}
+      }
+      if (!progress) {
+	break;
+      }
+    }
+    const uIndex n_ordered = order.size();
+    for (uIndex k = 0; k < n_out; k++) {
+      if (!(flags[outputs[k]] & EMITTED)) {
+	order.push_back(k);
+      }
+    }
+
+    for (uIndex j = 0; j < n_in; j++) {
+      flags[inputs[j]] = 0;
+    }
+    for (std::size_t d = 0; d < defined.size(); d++) {
+      flags[defined[d]] = 0;
+    }
+
+    for (uIndex e = 0; e < n_out*n_in; e++) {
+      n_nonzero += (jac[e] != 0.0);
+    }
+    truncate_stack(begin, m.n_operations); // Defined in the storage class
+#ifndef ADEPT_MANUAL_MEMORY_ALLOCATION
+    check_space(n_nonzero + n_out - n_ordered);
+#endif
+    std::vector<uIndex> temporary(n_out - n_ordered);
+    for (uIndex o = 0; o < n_out; o++) {
+      uIndex k = order[o];
+      for (uIndex j = 0; j < n_in; j++) {
+	if (jac[k*n_in+j] != 0.0) {
+	  push_rhs(jac[k*n_in+j], inputs[j]);
+	}
+      }
+      if (o < n_ordered) {
+	push_lhs(outputs[k]);
+      }
+      else {
+	temporary[o-n_ordered] = register_gradient();
+	push_lhs(temporary[o-n_ordered]);
+      }
+    }
+    for (uIndex o = n_ordered; o < n_out; o++) {
+      push_rhs(1.0, temporary[o-n_ordered]);
+      push_lhs(outputs[order[o]]);
+    }
+    for (uIndex t = temporary.size(); t > 0; t--) {
+      unregister_gradient(temporary[t-1]);
+    }
+    return true;
+  }
+
+
+  // Remove copies, zero operations and statements no output depends
+  // on from the statements recorded since mark m (see Stack.h)
+  bool
+  Stack::optimize(const StackMark& m, const uIndex* output_index,
+		  uIndex n_outputs, StackOptimization* report)
+  {
+    if (m.n_statements > n_statements_ || m.n_operations > n_operations_) {
+      throw invalid_mark("Stack::optimize() called with a mark that is not part of the current recording"
+			 ADEPT_EXCEPTION_LOCATION);
+    }
+    if (external_adjoints_.size() > static_cast<std::size_t>(m.n_external_adjoints)
+	|| second_derivatives_from(m.n_statements)) {
+      return false;
+    }
+    stop_recording_clock();
+    const double start = wall_clock_seconds();
+    const uIndex n_statements_before = n_statements_;
+    const uIndex n_operations_before = n_operations_;
+    uIndex n_copies = 0, n_zeros = 0, n_unreachable = 0;
+    // Statement 0 only marks the start of the operations
+    const uIndex begin = std::max<uIndex>(m.n_statements, 1);
+    const uIndex end = n_statements_;
+
+    if (begin < end) {
+      static const unsigned char COPY = 1, KEEP = 2, LIVE = 4;
+      const uIndex none = GapAllocator::NONE;
+      std::vector<uIndex>& assigned = optimize_assigned_;
+      std::vector<uIndex>& copy = optimize_copy_;
+      std::vector<uIndex>& source = optimize_source_;
+      std::vector<uIndex>& source_assigned = optimize_source_assigned_;
+      std::vector<unsigned char>& live = optimize_live_;
+      std::vector<unsigned char>& flags = optimize_flags_;
+      assigned.assign(max_gradient_, none);
+      copy.assign(max_gradient_, none);
+      source.resize(max_gradient_);
+      source_assigned.resize(max_gradient_);
+      live.assign(max_gradient_, 0);
+      flags.assign(end-begin, 0);
+
+      // Forward pass: drop zero operations and point the readers of a
+      // copy at the index it copies, for as long as neither has been
+      // reassigned. A copy stays if anything reads it otherwise.
+      uIndex op_end = statement_[begin-1].end_plus_one; // Before this pass
+      uIndex iop_new = op_end;
+      for (uIndex ist = begin; ist < end; ist++) {
+	const uIndex first = iop_new;
+	for (uIndex iop = op_end; iop < statement_[ist].end_plus_one; iop++) {
+	  if (multiplier_[iop] == 0.0) {
+	    n_zeros++;
+	    continue;
+	  }
+	  uIndex i = index_[iop];
+	  uIndex c = copy[i];
+	  if (c != none && assigned[i] == c) {
+	    if (assigned[source[i]] == source_assigned[i]) {
+	      i = source[i];
+	    }
+	    else {
+	      flags[c-begin] |= KEEP;
+	    }
+	  }
+	  multiplier_[iop_new] = multiplier_[iop];
+	  index_[iop_new++] = i;
+	}
+	op_end = statement_[ist].end_plus_one;
+	statement_[ist].end_plus_one = iop_new;
+	const uIndex lhs = statement_[ist].index;
+	assigned[lhs] = ist;
+	if (iop_new == first+1 && multiplier_[first] == 1.0) {
+	  // A copy of itself does nothing
+	  flags[ist-begin] |= COPY;
+	  if (index_[first] != lhs) {
+	    copy[lhs] = ist;
+	    source[lhs] = index_[first];
+	    source_assigned[lhs] = assigned[index_[first]];
+	  }
+	}
+      }
+      // The adjoint of an output is seeded where it was last assigned
+      for (uIndex k = 0; k < n_outputs; k++) {
+	uIndex i = gradient_position(output_index[k]);
+	if (i < max_gradient_) {
+	  if (copy[i] != none && assigned[i] == copy[i]) {
+	    flags[copy[i]-begin] |= KEEP;
+	  }
+	  live[i] = 1;
+	}
+      }
+
+      // Reverse pass: keep the statements whose left-hand side may
+      // have a nonzero adjoint when they are reached, given adjoints
+      // seeded only on the outputs
+      for (uIndex ist = end-1; ist >= begin; ist--) {
+	const uIndex lhs = statement_[ist].index;
+	unsigned char& f = flags[ist-begin];
+	if ((f & COPY) && !(f & KEEP)) {
+	  // Its readers now read the original instead, so the adjoint
+	  // of its left-hand side is zero here, unless it copied itself
+	  if (index_[statement_[ist-1].end_plus_one] != lhs) {
+	    live[lhs] = 0;
+	  }
+	  n_copies++;
+	}
+	else if (live[lhs]) {
+	  live[lhs] = 0;
+	  for (uIndex iop = statement_[ist-1].end_plus_one;
+	       iop < statement_[ist].end_plus_one; iop++) {
+	    live[index_[iop]] = 1;
+	  }
+	  f |= LIVE;
+	}
+	else {
+	  n_unreachable++;
+	}
+      }
+
+      // Close up the statements and operations that are kept
+      uIndex ist_new = begin;
+      op_end = statement_[begin-1].end_plus_one;
+      iop_new = op_end;
+      for (uIndex ist = begin; ist < end; ist++) {
+	const Statement statement = statement_[ist];
+	if (flags[ist-begin] & LIVE) {
+	  for (uIndex iop = op_end; iop < statement.end_plus_one; iop++) {
+	    multiplier_[iop_new] = multiplier_[iop];
+	    index_[iop_new++] = index_[iop];
+	  }
+	  statement_[ist_new].index = statement.index;
+	  statement_[ist_new++].end_plus_one = iop_new;
+	}
+	op_end = statement.end_plus_one;
+      }
+      truncate_stack(ist_new, iop_new); // Defined in the storage class
+    }
+
+    optimize_seconds_ += wall_clock_seconds() - start;
+    if (n_statements_ < n_statements_before
+	|| n_operations_ < n_operations_before) {
+      n_optimizations_++;
+      optimize_statements_removed_ += n_statements_before - n_statements_;
+      optimize_operations_removed_ += n_operations_before - n_operations_;
+    }
+    if (report) {
+      report->n_statements_before = n_statements_before;
+      report->n_statements = n_statements_;
+      report->n_operations_before = n_operations_before;
+      report->n_operations = n_operations_;
+      report->n_copies_forwarded = n_copies;
+      report->n_zero_operations = n_zeros;
+      report->n_unreachable_statements = n_unreachable;
+    }
+    return true;
+  }
+
+  // Renumber the gradients in the order in which a reverse pass first
+  // reaches them (see Stack.h)
+  bool
+  Stack::renumber_gradients()
+  {
+    if (!external_adjoints_.empty()) {
+      return false;
+    }
+    const uIndex none = GapAllocator::NONE;
+    // Position of each current position; earlier renumberings are
+    // composed with this one below
+    std::vector<uIndex> new_position(max_gradient_, none);
+    uIndex next = 0;
+    // Statement 0 is the null statement
+    for (uIndex ist = n_statements_-1; ist > 0; ist--) {
+      const Statement& statement = statement_[ist];
+      if (new_position[statement.index] == none) {
+	new_position[statement.index] = next++;
+      }
+      for (uIndex i = statement_[ist-1].end_plus_one;
+	   i < statement.end_plus_one; i++) {
+	if (new_position[index_[i]] == none) {
+	  new_position[index_[i]] = next++;
+	}
+      }
+    }
+    // Gradients not in the recording follow, in their old order
+    for (uIndex i = 0; i < max_gradient_; i++) {
+      if (new_position[i] == none) {
+	new_position[i] = next++;
+      }
+    }
+
+    for (uIndex ist = 1; ist < n_statements_; ist++) {
+      statement_[ist].index = new_position[statement_[ist].index];
+    }
+    for (uIndex i = 0; i < n_operations_; i++) {
+      index_[i] = new_position[index_[i]];
+    }
+    for (std::size_t i = 0; i < independent_index_.size(); i++) {
+      independent_index_[i] = new_position[independent_index_[i]];
+    }
+    for (std::size_t i = 0; i < dependent_index_.size(); i++) {
+      dependent_index_[i] = new_position[dependent_index_[i]];
+    }
+    for (std::size_t i = 0; i < second_derivative_.size(); i++) {
+      second_derivative_[i].row = new_position[second_derivative_[i].row];
+      second_derivative_[i].column = new_position[second_derivative_[i].column];
+    }
+
+    if (renumber_map_.empty()) {
+      renumber_map_.swap(new_position);
+    }
+    else {
+      // Indices beyond the old map were not moved by it
+      uIndex n_old = renumber_map_.size();
+      renumber_map_.resize(max_gradient_);
+      for (uIndex i = 0; i < max_gradient_; i++) {
+	uIndex position = i < n_old ? renumber_map_[i] : i;
+	renumber_map_[i] = new_position[position];
+      }
+    }
+    clear_gradients();
+    return true;
+  }
+
+  // Return the start of the recording, and the independent and
+  // dependent lists, to the original numbering
+  void
+  Stack::restore_gradient_numbering(uIndex n_statements,
+				    uIndex n_operations)
+  {
+    // Indices beyond the map were not moved
+    std::vector<uIndex> old_index(renumber_map_.size());
+    for (std::size_t i = 0; i < renumber_map_.size(); i++) {
+      old_index[renumber_map_[i]] = static_cast<uIndex>(i);
+    }
+    const uIndex n_map = old_index.size();
+    for (uIndex ist = 1; ist < n_statements; ist++) {
+      if (statement_[ist].index < n_map) {
+	statement_[ist].index = old_index[statement_[ist].index];
+      }
+    }
+    for (uIndex i = 0; i < n_operations; i++) {
+      if (index_[i] < n_map) {
+	index_[i] = old_index[index_[i]];
+      }
+    }
+    for (std::size_t i = 0; i < independent_index_.size(); i++) {
+      if (independent_index_[i] < n_map) {
+	independent_index_[i] = old_index[independent_index_[i]];
+      }
+    }
+    for (std::size_t i = 0; i < dependent_index_.size(); i++) {
+      if (dependent_index_[i] < n_map) {
+	dependent_index_[i] = old_index[dependent_index_[i]];
+      }
+    }
+    for (std::size_t i = 0; i < second_derivative_.size(); i++) {
+      SecondDerivative& d = second_derivative_[i];
+      if (d.row < n_map) {
+	d.row = old_index[d.row];
+      }
+      if (d.column < n_map) {
+	d.column = old_index[d.column];
+      }
+    }
+    renumber_map_.clear();
+  }
+
+  // Refuse to record while renumber_gradients() is in effect (see
+  // Stack::check_gradient_numbering())
+  void
+  Stack::throw_gradients_renumbered() const
+  {
+    throw adept::gradients_renumbered("Recording while the gradients are renumbered: call restore_gradient_numbering(), rewind_to() or new_recording() first"
+				      ADEPT_EXCEPTION_LOCATION);
+  }
 
   // Perform tangent linear computation (forward mode). It is assumed
   // that some gradients have been assigned already, otherwise the
@@ -585,6 +1076,7 @@ namespace adept {
   void
   Stack::compute_tangent_linear()
   {
+    check_no_external_adjoints("Stack::compute_tangent_linear()");
     if (gradients_are_initialized()) {
       // Loop forward through the statements
       for (uIndex ist = 1; ist < n_statements_; ist++) {
@@ -604,36 +1096,164 @@ namespace adept {
     }
   }
 
+  // Forward-over-reverse pass for hessian_vector_product() and
+  // hessian() (see Stack.h)
+  void
+  Stack::second_order_sweep(const Real* v, const uIndex* selected,
+			    uIndex n_directions, const Real* weight)
+  {
+    check_no_external_adjoints("Stack::hessian_vector_product()");
+    if (independent_index_.empty() || dependent_index_.empty()) {
+      throw(dependents_or_independents_not_identified());
+    }
+    stop_recording_clock();
+    const double start = wall_clock_seconds();
+    const std::size_t k = n_directions;
+    std::vector<Real>& tangent = second_order_tangent_;
+    std::vector<Real>& term = second_order_term_;
+    std::vector<Real>& adjoint = second_order_adjoint_;
+    std::vector<Real>& tangent_adjoint = second_order_tangent_adjoint_;
+    std::vector<Real> sum(k);
+
+    // Seed the tangents of the independents
+    tangent.assign(max_gradient_*k, 0.0);
+    if (v) {
+      for (std::size_t j = 0; j < independent_index_.size(); j++) {
+	tangent[independent_index_[j]] = v[j];
+      }
+    }
+    else {
+      for (std::size_t l = 0; l < k; l++) {
+	uIndex j = selected ? selected[l] : l;
+	if (static_cast<std::size_t>(j) >= independent_index_.size()) {
+	  throw index_out_of_bounds("Stack::hessian() called with an independent that is out of range"
+				    ADEPT_EXCEPTION_LOCATION);
+	}
+	tangent[independent_index_[j]*k+l] = 1.0;
+      }
+    }
+
+    // Tangent pass. A statement's second derivatives are multiplied
+    // by the tangents of the values it read, before its LHS is
+    // assigned, and kept for the reverse pass.
+    term.resize(second_derivative_.size()*k);
+    std::size_t next = 0; // Next statement with second derivatives
+    uIndex entry = 0;
+    for (uIndex ist = 1; ist < n_statements_; ist++) {
+      const Statement& statement = statement_[ist];
+      const uIndex begin = statement_[ist-1].end_plus_one;
+      if (next < second_order_statement_.size()
+	  && second_order_statement_[next].statement == ist) {
+	for ( ; entry < second_order_statement_[next].end_plus_one; entry++) {
+	  const SecondDerivative& d = second_derivative_[entry];
+	  for (std::size_t l = 0; l < k; l++) {
+	    term[entry*k+l] = d.value*tangent[d.column*k+l];
+	  }
+	}
+	next++;
+      }
+      else if (begin < statement.end_plus_one) {
+	throw feature_not_available("Stack::hessian_vector_product() needs the second derivatives of every statement, which are only recorded with ADEPT_SECOND_ORDER defined, and not for array expressions, add_derivative_dependence() or push_statement() without them");
+      }
+      for (std::size_t l = 0; l < k; l++) {
+	sum[l] = 0.0;
+      }
+      for (uIndex i = begin; i < statement.end_plus_one; i++) {
+	for (std::size_t l = 0; l < k; l++) {
+	  sum[l] += multiplier_[i]*tangent[index_[i]*k+l];
+	}
+      }
+      for (std::size_t l = 0; l < k; l++) {
+	tangent[statement.index*k+l] = sum[l];
+      }
+    }
+
+    // Reverse pass: the adjoint of the LHS of each statement goes to
+    // its RHS through the multipliers, and its tangent through both
+    // the multipliers and the second derivatives
+    adjoint.assign(max_gradient_, 0.0);
+    tangent_adjoint.assign(max_gradient_*k, 0.0);
+    for (std::size_t i = 0; i < dependent_index_.size(); i++) {
+      adjoint[dependent_index_[i]] += weight ? weight[i] : 1.0;
+    }
+    for (uIndex ist = n_statements_-1; ist > 0; ist--) {
+      const Statement& statement = statement_[ist];
+      Real a = adjoint[statement.index];
+      adjoint[statement.index] = 0.0;
+      for (std::size_t l = 0; l < k; l++) {
+	sum[l] = tangent_adjoint[statement.index*k+l];
+	tangent_adjoint[statement.index*k+l] = 0.0;
+      }
+      for (uIndex i = statement_[ist-1].end_plus_one;
+	   i < statement.end_plus_one; i++) {
+	adjoint[index_[i]] += multiplier_[i]*a;
+	for (std::size_t l = 0; l < k; l++) {
+	  tangent_adjoint[index_[i]*k+l] += multiplier_[i]*sum[l];
+	}
+      }
+      if (next > 0 && second_order_statement_[next-1].statement == ist) {
+	next--;
+	const uIndex first = next > 0
+	  ? second_order_statement_[next-1].end_plus_one : 0;
+	if (a != 0.0) {
+	  for (uIndex e = first; e < second_order_statement_[next].end_plus_one; e++) {
+	    const SecondDerivative& d = second_derivative_[e];
+	    for (std::size_t l = 0; l < k; l++) {
+	      tangent_adjoint[d.row*k+l] += a*term[e*k+l];
+	    }
+	  }
+	}
+      }
+    }
+    reverse_seconds_ += wall_clock_seconds() - start;
+    ++n_reverse_passes_;
+  }
+
+  // Hessian of the weighted dependents times v (see Stack.h)
+  void
+  Stack::hessian_vector_product(const Real* v, Real* hv_out,
+				const Real* weight, Real* gradient_out)
+  {
+    second_order_sweep(v, 0, 1, weight);
+    for (std::size_t j = 0; j < independent_index_.size(); j++) {
+      hv_out[j] = second_order_tangent_adjoint_[independent_index_[j]];
+      if (gradient_out) {
+	gradient_out[j] = second_order_adjoint_[independent_index_[j]];
+      }
+    }
+  }
+
+  // Dense Hessian of the weighted dependents with respect to
+  // selected independents (see Stack.h)
+  void
+  Stack::hessian(Real* hessian_out, const uIndex* selected,
+		 uIndex n_selected, const Real* weight)
+  {
+    if (!selected) {
+      n_selected = independent_index_.size();
+    }
+    second_order_sweep(0, selected, n_selected, weight);
+    // Column l is the derivative of the gradient in direction l
+    for (uIndex i = 0; i < n_selected; i++) {
+      std::size_t row = independent_index_[selected ? selected[i] : i];
+      for (uIndex l = 0; l < n_selected; l++) {
+	hessian_out[l*n_selected+i]
+	  = second_order_tangent_adjoint_[row*n_selected+l];
+      }
+    }
+  }
+
 
 
   // Register n gradients
   uIndex
   Stack::do_register_gradients(const uIndex& n) {
     n_gradients_registered_ += n;
-    if (!gap_list_.empty()) {
-      uIndex return_val;
+    if (!gaps_.empty()) {
       // Insert in a gap, if there is one big enough
-      for (GapListIterator it = gap_list_.begin();
-	   it != gap_list_.end(); it++) {
-	uIndex len = it->end + 1 - it->start;
-	if (len > n) {
-	  // Gap a bit larger than needed: reduce its size
-	  return_val = it->start;
-	  it->start += n;
-	  return return_val;
-	}
-	else if (len == n) {
-	  // Gap exactly the size needed: fill it and remove from list
-	  return_val = it->start;
-	  if (most_recent_gap_ == it) {
-	    gap_list_.erase(it);
-	    most_recent_gap_ = gap_list_.end();
-	  }
-	  else {
-	    gap_list_.erase(it);
-	  }
-	  return return_val;
-	}
+      uIndex return_val = gaps_.take(n);
+      if (return_val != GapAllocator::NONE) {
+	return return_val;
       }
     }
     // No suitable gap found; instead add to end of gradient vector
@@ -650,89 +1270,12 @@ namespace adept {
   // then this is easy and is done inline; this is the usual case
   // since C++ trys to deallocate automatic objects in the reverse
   // order to that in which they were allocated.  If it is not at the
-  // top of the stack then a non-inline function is called to ensure
-  // that the gap list is adjusted correctly.
+  // top of the stack then a non-inline function is called to add it
+  // to the gaps.
   void
   Stack::unregister_gradient_not_top(const uIndex& gradient_index)
   {
-    enum {
-      ADDED_AT_BASE,
-      ADDED_AT_TOP,
-      NEW_GAP,
-      NOT_FOUND
-    } status = NOT_FOUND;
-    // First try to find if the unregistered element is at the
-    // start or end of an existing gap
-    if (!gap_list_.empty() && most_recent_gap_ != gap_list_.end()) {
-      // We have a "most recent" gap - check whether the gradient
-      // to be unregistered is here
-      Gap& current_gap = *most_recent_gap_;
-      if (gradient_index == current_gap.start - 1) {
-	current_gap.start--;
-	status = ADDED_AT_BASE;
-      }
-      else if (gradient_index == current_gap.end + 1) {
-	current_gap.end++;
-	status = ADDED_AT_TOP;
-      }
-      // Should we check for erroneous removal from middle of gap?
-    }
-    if (status == NOT_FOUND) {
-      // Search other gaps
-      for (GapListIterator it = gap_list_.begin();
-	   it != gap_list_.end(); it++) {
-	if (gradient_index <= it->end + 1) {
-	  // Gradient to unregister is either within the gap
-	  // referenced by iterator "it", or it is between "it"
-	  // and the previous gap in the list
-	  if (gradient_index == it->start - 1) {
-	    status = ADDED_AT_BASE;
-	    it->start--;
-	    most_recent_gap_ = it;
-	  }
-	  else if (gradient_index == it->end + 1) {
-	    status = ADDED_AT_TOP;
-	    it->end++;
-	    most_recent_gap_ = it;
-	  }
-	  else {
-	    // Insert a new gap of width 1; note that list::insert
-	    // inserts *before* the specified location
-	    most_recent_gap_
-	      = gap_list_.insert(it, Gap(gradient_index));
-	    status = NEW_GAP;
-	  }
-	  break;
-	}
-      }
-      if (status == NOT_FOUND) {
-	gap_list_.push_back(Gap(gradient_index));
-	most_recent_gap_ = gap_list_.end();
-	most_recent_gap_--;
-      }
-    }
-    // Finally check if gaps have merged
-    if (status == ADDED_AT_BASE
-	&& most_recent_gap_ != gap_list_.begin()) {
-      // Check whether the gap has merged with the next one
-      GapListIterator it = most_recent_gap_;
-      it--;
-      if (it->end == most_recent_gap_->start - 1) {
-	// Merge two gaps
-	most_recent_gap_->start = it->start;
-	gap_list_.erase(it);
-      }
-    }
-    else if (status == ADDED_AT_TOP) {
-      GapListIterator it = most_recent_gap_;
-      it++;
-      if (it != gap_list_.end()
-	  && it->start == most_recent_gap_->end + 1) {
-	// Merge two gaps
-	most_recent_gap_->end = it->end;
-	gap_list_.erase(it);
-      }
-    }
+    gaps_.add(gradient_index, 1);
   }	
 
 
@@ -745,125 +1288,334 @@ namespace adept {
     if (gradient_index+n == i_gradient_) {
       // Gradient to be unregistered is at the top of the stack
       i_gradient_ -= n;
-      if (!gap_list_.empty()) {
-	Gap& last_gap = gap_list_.back();
-	if (i_gradient_ == last_gap.end+1) {
-	  // We have unregistered the elements between the "gap" of
-	  // unregistered element and the top of the stack, so can set
-	  // the variables indicating the presence of the gap to zero
-	  i_gradient_ = last_gap.start;
-	  GapListIterator it = gap_list_.end();
-	  it--;
-	  if (most_recent_gap_ == it) {
-	    most_recent_gap_ = gap_list_.end();
-	  }
-	  gap_list_.pop_back();
+      if (!gaps_.empty() && i_gradient_ > 0) {
+	// If a gap now reaches the top of the stack, lower the top to
+	// its start
+	uIndex start = gaps_.remove_ending_at(i_gradient_-1);
+	if (start != GapAllocator::NONE) {
+	  i_gradient_ = start;
 	}
       }
     }
     else { // Gradients to be unregistered not at top of stack.
-      enum {
-	ADDED_AT_BASE,
-	ADDED_AT_TOP,
-	NEW_GAP,
-	NOT_FOUND
-      } status = NOT_FOUND;
-      // First try to find if the unregistered element is at the start
-      // or end of an existing gap
-      if (!gap_list_.empty() && most_recent_gap_ != gap_list_.end()) {
-	// We have a "most recent" gap - check whether the gradient
-	// to be unregistered is here
-	Gap& current_gap = *most_recent_gap_;
-	if (gradient_index == current_gap.start - n) {
-	  current_gap.start -= n;
-	  status = ADDED_AT_BASE;
-	}
-	else if (gradient_index == current_gap.end + 1) {
-	  current_gap.end += n;
-	  status = ADDED_AT_TOP;
-	}
-	/*
-	else if (gradient_index > current_gap.start - n
-		 && gradient_index < current_gap.end + 1) {
-	  std::cout << "** Attempt to find " << gradient_index << " in gaps ";
-	  print_gaps();
-	  std::cout << "\n";
-	  throw invalid_operation("Gap list corruption");
-	}
-	*/
-	// Should we check for erroneous removal from middle of gap?
-      }
-      if (status == NOT_FOUND) {
-	// Search other gaps
-	for (GapListIterator it = gap_list_.begin();
-	     it != gap_list_.end(); it++) {
-	  if (gradient_index <= it->end + 1) {
-	    // Gradient to unregister is either within the gap
-	    // referenced by iterator "it", or it is between "it" and
-	    // the previous gap in the list
-	    if (gradient_index == it->start - n) {
-	      status = ADDED_AT_BASE;
-	      it->start -= n;
-	      most_recent_gap_ = it;
-	    }
-	    else if (gradient_index == it->end + 1) {
-	      status = ADDED_AT_TOP;
-	      it->end += n;
-	      most_recent_gap_ = it;
-	    }
-	    /*
-	    else if (gradient_index > it->start - n) {
-	      std::cout << "*** Attempt to find " << gradient_index << " in gaps ";
-	      print_gaps();
-	      std::cout << "\n";
-	      throw invalid_operation("Gap list corruption");
-	    }
-	    */
-	    else {
-	      // Insert a new gap; note that list::insert inserts
-	      // *before* the specified location
-	      most_recent_gap_
-		= gap_list_.insert(it, Gap(gradient_index,
-					   gradient_index+n-1));
-	      status = NEW_GAP;
-	    }
+      gaps_.add(gradient_index, n);
+    }
+  }
+  
+  
+  // MEMBER FUNCTIONS OF THE GAPALLOCATOR CLASS
+
+  namespace internal {
+
+    const uIndex GapAllocator::NONE;
+
+    // The size class of a gap of the given length: the index of its
+    // highest set bit
+    int
+    GapAllocator::size_class(uIndex length)
+    {
+#ifdef __GNUC__
+      return static_cast<int>(sizeof(unsigned long long)*8) - 1
+	- __builtin_clzll(static_cast<unsigned long long>(length));
+#else
+      int c = 0;
+      while (length >>= 1) {
+	c++;
+      }
+      return c;
+#endif
+    }
+
+    // Index of the lowest set bit of a non-zero mask
+    static inline int
+    lowest_bit(unsigned long long mask)
+    {
+#ifdef __GNUC__
+      return __builtin_ctzll(mask);
+#else
+      int c = 0;
+      while (!(mask & 1ULL)) {
+	mask >>= 1;
+	c++;
+      }
+      return c;
+#endif
+    }
+
+    uIndex
+    GapAllocator::take(uIndex n)
+    {
+      if (n_gaps_ == 0 || n < 1) {
+	return NONE;
+      }
+      int c = size_class(n);
+      // Every gap of class c fits if n is a power of two, and every
+      // gap of a higher class fits regardless; take one from the
+      // lowest such class to keep long gaps for long requests
+      int first_fitting = (n & (n-1)) == 0 ? c : c+1;
+      uIndex start = NONE;
+      if (first_fitting < n_size_classes) {
+	unsigned long long mask = nonempty_classes_
+	  & ~((1ULL << first_fitting) - 1ULL);
+	if (mask) {
+	  start = head_[lowest_bit(mask)];
+	}
+      }
+      if (start == NONE) {
+	// Try the most recently freed gaps of n's own class, which are
+	// often left by objects of the same size, up to a fixed number
+	// so that the cost stays constant
+	uIndex candidate = head_[c];
+	for (int i = 0; i < max_probes && candidate != NONE;
+	     i++, candidate = tag_[candidate].next) {
+	  if (tag_[candidate].other_end - candidate + 1 >= n) {
+	    start = candidate;
 	    break;
 	  }
 	}
-	if (status == NOT_FOUND) {
-	  gap_list_.push_back(Gap(gradient_index,
-				  gradient_index+n-1));
-	  most_recent_gap_ = gap_list_.end();
-	  most_recent_gap_--;
+	if (start == NONE) {
+	  return NONE;
 	}
       }
-      // Finally check if gaps have merged
-      if (status == ADDED_AT_BASE
-	  && most_recent_gap_ != gap_list_.begin()) {
-	// Check whether the gap has merged with the next one
-	GapListIterator it = most_recent_gap_;
-	it--;
-	if (it->end == most_recent_gap_->start - 1) {
-	  // Merge two gaps
-	  most_recent_gap_->start = it->start;
-	  gap_list_.erase(it);
+      uIndex end = tag_[start].other_end;
+      remove(start, end);
+      if (end - start + 1 > n) {
+	insert(start+n, end);
+      }
+      return start;
+    }
+
+    void
+    GapAllocator::add(uIndex start, uIndex n)
+    {
+      uIndex end = start + n - 1;
+      if (static_cast<std::size_t>(end) + 2 > tag_.size()) {
+	// Make room for tags up to end+1, doubling to amortize
+	std::size_t new_size = std::max(static_cast<std::size_t>(end) + 2,
+					2*tag_.size());
+	Tag none = { NONE, NONE, NONE };
+	tag_.resize(new_size, none);
+      }
+      // Merge with a gap ending just below...
+      if (start > 0 && is_boundary(start-1)) {
+	uIndex lower_start = tag_[start-1].other_end;
+	remove(lower_start, start-1);
+	start = lower_start;
+      }
+      // ...and with one starting just above
+      if (is_boundary(end+1)) {
+	uIndex upper_end = tag_[end+1].other_end;
+	remove(end+1, upper_end);
+	end = upper_end;
+      }
+      insert(start, end);
+    }
+
+    void
+    GapAllocator::insert(uIndex start, uIndex end)
+    {
+      int c = size_class(end - start + 1);
+      tag_[start].other_end = end;
+      tag_[end].other_end = start;
+      tag_[start].prev = NONE;
+      tag_[start].next = head_[c];
+      if (head_[c] != NONE) {
+	tag_[head_[c]].prev = start;
+      }
+      head_[c] = start;
+      nonempty_classes_ |= 1ULL << c;
+      n_gaps_++;
+    }
+
+    void
+    GapAllocator::remove(uIndex start, uIndex end)
+    {
+      int c = size_class(end - start + 1);
+      uIndex next = tag_[start].next, prev = tag_[start].prev;
+      if (prev != NONE) {
+	tag_[prev].next = next;
+      }
+      else {
+	head_[c] = next;
+	if (next == NONE) {
+	  nonempty_classes_ &= ~(1ULL << c);
 	}
       }
-      else if (status == ADDED_AT_TOP) {
-	GapListIterator it = most_recent_gap_;
+      if (next != NONE) {
+	tag_[next].prev = prev;
+      }
+      tag_[start].other_end = NONE;
+      tag_[end].other_end = NONE;
+      n_gaps_--;
+    }
 
-	it++;
-	if (it != gap_list_.end()
-	    && it->start == most_recent_gap_->end + 1) {
-	  // Merge two gaps
-	  most_recent_gap_->end = it->end;
-	  gap_list_.erase(it);
+    std::vector<Gap>
+    GapAllocator::gaps() const
+    {
+      std::vector<Gap> list;
+      list.reserve(n_gaps_);
+      for (std::size_t i = 0; i < tag_.size(); i++) {
+	uIndex end = tag_[i].other_end;
+	if (end != NONE && end >= static_cast<uIndex>(i)) {
+	  list.push_back(Gap(static_cast<uIndex>(i), end));
+	  i = static_cast<std::size_t>(end);
 	}
       }
+      return list;
+    }
+
+  } // End namespace internal
+
+
+  // Return counters describing the current recording and the use of
+  // the Stack so far
+  StackStatistics
+  Stack::statistics() const
+  {
+    StackStatistics stats;
+    // Account for the null statement at the start by subtracting one
+    stats.n_statements = n_statements_ > 0 ? n_statements_-1 : 0;
+    stats.n_operations = n_operations_;
+    for (int b = 0; b < StackStatistics::n_histogram_bins; b++) {
+      stats.operations_histogram[b] = 0;
+    }
+    stats.max_operations_per_statement = 0;
+    for (uIndex ist = 1; ist < n_statements_; ist++) {
+      uIndex n_ops = statement_[ist].end_plus_one
+	- statement_[ist-1].end_plus_one;
+      int bin = 0;
+      for (uIndex n = n_ops; n > 0
+	     && bin < StackStatistics::n_histogram_bins-1; n >>= 1) {
+	bin++;
+      }
+      stats.operations_histogram[bin]++;
+      if (n_ops > stats.max_operations_per_statement) {
+	stats.max_operations_per_statement = n_ops;
+      }
+    }
+    stats.n_external_adjoints = external_adjoints_.size();
+    stats.n_second_derivatives = second_derivative_.size();
+
+    stats.n_gradients_registered = n_gradients_registered_;
+    stats.max_gradients = max_gradient_;
+    stats.peak_max_gradients = std::max(peak_max_gradient_, max_gradient_);
+    stats.n_gaps = gaps_.n_gaps();
+#ifdef ADEPT_STACK_STORAGE_STL
+    stats.peak_statements = stats.n_statements;
+    stats.peak_operations = n_operations_;
+#else
+    stats.peak_statements = std::max(peak_statements_, n_statements_);
+    if (stats.peak_statements > 0) {
+      stats.peak_statements--;
     }
+    stats.peak_operations = std::max(peak_operations_, n_operations_);
+#endif
+
+    stats.n_statement_stack_grows = n_statement_stack_grows_;
+    stats.n_operation_stack_grows = n_operation_stack_grows_;
+    stats.statement_stack_grow_bytes = statement_stack_grow_bytes_;
+    stats.operation_stack_grow_bytes = operation_stack_grow_bytes_;
+
+    stats.memory_used = memory();
+    stats.memory_allocated
+      = static_cast<std::size_t>(n_allocated_statements_)*sizeof(Statement)
+      + static_cast<std::size_t>(n_allocated_operations_)
+        *(sizeof(Multiplier)+sizeof(uIndex))
+      + (static_cast<std::size_t>(n_allocated_gradients_)
+	 + gradient_lanes_.capacity() + n_allocated_multipass_)*sizeof(Real)
+      + second_derivative_.capacity()*sizeof(SecondDerivative)
+      + second_order_statement_.capacity()*sizeof(SecondOrderStatement)
+      + (second_order_tangent_.capacity() + second_order_term_.capacity()
+	 + second_order_adjoint_.capacity()
+	 + second_order_tangent_adjoint_.capacity())*sizeof(Real);
+
+    stats.n_reverse_passes = n_reverse_passes_;
+    stats.recording_seconds = recording_seconds_;
+    if (recording_clock_start_ >= 0.0) {
+      // Include the recording in progress
+      stats.recording_seconds += wall_clock_seconds()
+	- recording_clock_start_;
+    }
+    stats.reverse_seconds = reverse_seconds_;
+    stats.n_optimizations = n_optimizations_;
+    stats.optimize_statements_removed = optimize_statements_removed_;
+    stats.optimize_operations_removed = optimize_operations_removed_;
+    stats.optimize_seconds = optimize_seconds_;
+    return stats;
   }
-  
-  
+
+  // Zero the accumulated counters of statistics()
+  void
+  Stack::reset_statistics()
+  {
+    peak_max_gradient_ = 0;
+#ifndef ADEPT_STACK_STORAGE_STL
+    peak_statements_ = 0;
+    peak_operations_ = 0;
+#endif
+    n_statement_stack_grows_ = 0;
+    n_operation_stack_grows_ = 0;
+    statement_stack_grow_bytes_ = 0;
+    operation_stack_grow_bytes_ = 0;
+    n_reverse_passes_ = 0;
+    recording_seconds_ = 0.0;
+    reverse_seconds_ = 0.0;
+    n_optimizations_ = 0;
+    optimize_statements_removed_ = 0;
+    optimize_operations_removed_ = 0;
+    optimize_seconds_ = 0.0;
+    if (recording_clock_start_ >= 0.0) {
+      start_recording_clock();
+    }
+  }
+
+  // Write one "name value" line per counter
+  void
+  StackStatistics::print(std::ostream& os) const
+  {
+    os << "n_statements " << n_statements << "\n"
+       << "n_operations " << n_operations << "\n";
+    for (int b = 0; b < n_histogram_bins; b++) {
+      // Label each bin with the smallest number of operations it
+      // counts
+      os << "statements_with_operations_from_"
+	 << (b == 0 ? 0 : (1u << (b-1))) << " "
+	 << operations_histogram[b] << "\n";
+    }
+    os << "max_operations_per_statement " << max_operations_per_statement << "\n"
+       << "n_external_adjoints " << n_external_adjoints << "\n"
+       << "n_second_derivatives " << n_second_derivatives << "\n"
+       << "n_gradients_registered " << n_gradients_registered << "\n"
+       << "max_gradients " << max_gradients << "\n"
+       << "peak_max_gradients " << peak_max_gradients << "\n"
+       << "n_gaps " << n_gaps << "\n"
+       << "peak_statements " << peak_statements << "\n"
+       << "peak_operations " << peak_operations << "\n"
+       << "n_statement_stack_grows " << n_statement_stack_grows << "\n"
+       << "n_operation_stack_grows " << n_operation_stack_grows << "\n"
+       << "statement_stack_grow_bytes " << statement_stack_grow_bytes << "\n"
+       << "operation_stack_grow_bytes " << operation_stack_grow_bytes << "\n"
+       << "memory_used " << memory_used << "\n"
+       << "memory_allocated " << memory_allocated << "\n"
+       << "n_reverse_passes " << n_reverse_passes << "\n"
+       << "recording_seconds " << recording_seconds << "\n"
+       << "reverse_seconds " << reverse_seconds << "\n"
+       << "n_optimizations " << n_optimizations << "\n"
+       << "optimize_statements_removed " << optimize_statements_removed << "\n"
+       << "optimize_operations_removed " << optimize_operations_removed << "\n"
+       << "optimize_seconds " << optimize_seconds << "\n";
+  }
+
+  namespace internal {
+    // Seconds from an arbitrary origin on a monotonic clock
+    double
+    wall_clock_seconds()
+    {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now()
+					   .time_since_epoch()).count();
+    }
+  }
+
   // Print each derivative statement to the specified stream (standard
   // output if omitted)
   void
@@ -917,9 +1669,9 @@ namespace adept {
   void
   Stack::print_gaps(std::ostream& os) const
   {
-    for (std::list<Gap>::const_iterator it = gap_list_.begin();
-	 it != gap_list_.end(); it++) {
-      os << it->start << "-" << it->end << " ";
+    GapList gaps = gaps_.gaps();
+    for (std::size_t i = 0; i < gaps.size(); i++) {
+      os << gaps[i].start << "-" << gaps[i].end << " ";
     }
   }
 
@@ -932,11 +1684,11 @@ namespace adept {
   {
     if (max_gradient_ > 0) {
       if (n_allocated_gradients_ < max_gradient_) {
-	if (gradient_) {
-	  delete[] gradient_;
-	}
-	gradient_ = new Real[max_gradient_];
-	n_allocated_gradients_ = max_gradient_;
+	// The outgrown array is freed rather than pooled, since no
+	// later request from this Stack could use it
+	delete[] gradient_;
+	gradient_ = internal::acquire_gradients(max_gradient_,
+						n_allocated_gradients_);
       }
       for (uIndex i = 0; i < max_gradient_; i++) {
 	gradient_[i] = 0.0;
@@ -984,11 +1736,11 @@ namespace adept {
     os << "      " << n_gradients_registered() << " gradients currently registered ";
     os << "and a total of " << max_gradients() << " needed (current index "
        << i_gradient() << ")\n";
-    if (gap_list_.empty()) {
+    if (gaps_.empty()) {
       os << "      Gradient list has no gaps\n";
     }
     else {
-      os << "      Gradient list has " << gap_list_.size() << " gaps (";
+      os << "      Gradient list has " << gaps_.n_gaps() << " gaps (";
       print_gaps(os);
       os << ")\n";
     }
@@ -1033,100 +1785,598 @@ namespace adept {
     }
 #endif
   }
-} // End namespace adept
+} // End namespace adept
+
+
+
+// =================================================================
+// Contents of StackStorageOrig.cpp
+// =================================================================
+
+/* StackStorageOrig.cpp -- Original storage of stacks using STL containers
+
+    Copyright (C) 2014-2015 University of Reading
+
+    Author: Robin Hogan <r.j.hogan@ecmwf.int>
+
+    This file is part of the Adept library.
+
+   The Stack class inherits from a class providing the storage (and
+   interface to the storage) for the derivative statements that are
+   accumulated during the execution of an algorithm.  The derivative
+   statements are held in two stacks described by Hogan (2014): the
+   "statement stack" and the "operation stack".
+
+   This file provides one of the original storage engine, which used
+   std::vector to hold the two stacks. Note that these stacks are
+   contiguous in memory, which is not ideal for very large algorithms.
+
+*/
+
+#include <cstring>
+#include <vector>
+#ifdef ADEPT_CXX11_FEATURES
+#include <mutex>
+#endif
+
+#include <adept/StackStorageOrig.h>
+#include <adept/settings.h>
+
+namespace adept {
+  namespace internal {
+
+    // -------------------------------------------------------------------
+    // The tape pool
+    // -------------------------------------------------------------------
+
+    // Stacks return their statement and operation arrays (and their
+    // gradient array) here when they are destroyed, and new Stacks
+    // borrow from here before allocating. A program that creates a
+    // Stack per recording therefore stops allocating, and stops
+    // paging in fresh memory, once the pool holds as many tapes as
+    // there are Stacks alive at any one time.
+    struct PooledTape {
+      Statement* statement;
+      Multiplier* multiplier;
+      uIndex* index;
+      uIndex n_statements;
+      uIndex n_operations;
+    };
+
+    struct PooledGradients {
+      Real* gradient;
+      uIndex n;
+    };
+
+    struct TapePool {
+      TapePool()
+	: initial_length(ADEPT_INITIAL_STACK_LENGTH), growth_factor(2.0),
+	  auto_size(false), last_peak_statements(0), last_peak_operations(0) { }
+
+      // Free every pooled array, returning the number of bytes freed
+      std::size_t release() {
+	std::size_t bytes = 0;
+	for (std::size_t i = 0; i < tapes.size(); ++i) {
+	  bytes += tapes[i].n_statements * sizeof(Statement)
+	    + tapes[i].n_operations * (sizeof(Multiplier) + sizeof(uIndex));
+	  delete[] tapes[i].statement;
+	  delete[] tapes[i].multiplier;
+	  delete[] tapes[i].index;
+	}
+	for (std::size_t i = 0; i < gradients.size(); ++i) {
+	  bytes += gradients[i].n * sizeof(Real);
+	  delete[] gradients[i].gradient;
+	}
+	tapes.clear();
+	gradients.clear();
+	return bytes;
+      }
+
+      std::vector<PooledTape> tapes;
+      std::vector<PooledGradients> gradients;
+      uIndex initial_length;
+      double growth_factor;
+      bool auto_size;
+      // Longest recording of the most recently returned tape
+      uIndex last_peak_statements;
+      uIndex last_peak_operations;
+      // Directory of the spill files of the block storage engine
+      std::string spill_directory;
+#ifdef ADEPT_CXX11_FEATURES
+      std::mutex mutex;
+#endif
+    };
+
+    // The pool is never destroyed, so that Stacks destroyed during static
+    // destruction, after the pool would otherwise have gone, can still
+    // return their tapes to it; the OS reclaims what is left at exit
+    static TapePool& tape_pool() {
+      static TapePool& pool = *new TapePool;
+      return pool;
+    }
+
+#ifdef ADEPT_CXX11_FEATURES
+#define ADEPT_LOCK_TAPE_POOL std::lock_guard<std::mutex> tape_pool_lock(internal::tape_pool().mutex)
+#else
+#define ADEPT_LOCK_TAPE_POOL
+#endif
+
+    // The capacity to give a stack that must hold n_used entries now
+    // and grow by at least min more
+    static uIndex
+    grown_size(uIndex n_allocated, uIndex min) {
+      double factor;
+      {
+	ADEPT_LOCK_TAPE_POOL;
+	factor = tape_pool().growth_factor;
+      }
+      uIndex new_size = static_cast<uIndex>(n_allocated*factor);
+      if (new_size <= n_allocated) {
+	new_size = n_allocated+1;
+      }
+      if (min > 0 && new_size < n_allocated+min) {
+	new_size = n_allocated+min;
+      }
+      return new_size;
+    }
+
+    // Borrow a tape from the pool, or allocate one. Its capacity is
+    // the initial stack length, or with auto-sizing the longest
+    // recording of the last tape returned plus an eighth.
+    void
+    StackStorageOrig::initialize()
+    {
+      PooledTape tape = { 0, 0, 0, 0, 0 };
+      uIndex n_statements, n_operations;
+      bool auto_size;
+      {
+	ADEPT_LOCK_TAPE_POOL;
+	auto_size = tape_pool().auto_size && tape_pool().last_peak_statements > 0;
+	if (auto_size) {
+	  n_statements = tape_pool().last_peak_statements
+	    + tape_pool().last_peak_statements/8 + 1;
+	  n_operations = tape_pool().last_peak_operations
+	    + tape_pool().last_peak_operations/8 + 1;
+	}
+	else {
+	  n_statements = n_operations = tape_pool().initial_length;
+	}
+	if (!tape_pool().tapes.empty()) {
+	  tape = tape_pool().tapes.back();
+	  tape_pool().tapes.pop_back();
+	}
+      }
+      // A pooled tape that is too short is replaced now rather than
+      // grown (and copied) part way through the recording; when
+      // auto-sizing, one more than four times too long is replaced
+      // too, to give back the memory
+      if (tape.n_statements < n_statements
+	  || (auto_size && tape.n_statements/4 > n_statements)) {
+	delete[] tape.statement;
+	tape.statement = new Statement[n_statements];
+	tape.n_statements = n_statements;
+      }
+      if (tape.n_operations < n_operations
+	  || (auto_size && tape.n_operations/4 > n_operations)) {
+	delete[] tape.multiplier;
+	delete[] tape.index;
+	tape.multiplier = new Multiplier[n_operations];
+	tape.index = new uIndex[n_operations];
+	tape.n_operations = n_operations;
+      }
+      statement_ = tape.statement;
+      n_allocated_statements_ = tape.n_statements;
+      multiplier_ = tape.multiplier;
+      index_ = tape.index;
+      n_allocated_operations_ = tape.n_operations;
+    }
+
+    StackStorageOrig::~StackStorageOrig() {
+      if (statement_ && multiplier_ && index_) {
+	record_peak();
+	PooledTape tape = { statement_, multiplier_, index_,
+			    n_allocated_statements_, n_allocated_operations_ };
+	ADEPT_LOCK_TAPE_POOL;
+	tape_pool().tapes.push_back(tape);
+	tape_pool().last_peak_statements = peak_statements_;
+	tape_pool().last_peak_operations = peak_operations_;
+      }
+      else {
+	delete[] statement_;
+	delete[] multiplier_;
+	delete[] index_;
+      }
+    }
+
+
+    // Grow the operation stack by the growth factor, or more if the
+    // requested minimum number of extra entries (min) is greater than
+    // this would allow
+    void
+    StackStorageOrig::grow_operation_stack(uIndex min)
+    {
+      uIndex new_size = grown_size(n_allocated_operations_, min);
+      Multiplier* new_multiplier = new Multiplier[new_size];
+      uIndex* new_index = new uIndex[new_size];
+      
+      std::memcpy(new_multiplier, multiplier_, n_operations_*sizeof(Multiplier));
+      std::memcpy(new_index, index_, n_operations_*sizeof(uIndex));
+      ++n_operation_stack_grows_;
+      operation_stack_grow_bytes_
+	+= new_size*(sizeof(Multiplier)+sizeof(uIndex));
+      
+      delete[] multiplier_;
+      delete[] index_;
+      
+      multiplier_ = new_multiplier;
+      index_ = new_index;
+      
+      n_allocated_operations_ = new_size;
+    }
+    
+    // ... likewise for the statement stack
+    void
+    StackStorageOrig::grow_statement_stack(uIndex min)
+    {
+      uIndex new_size = grown_size(n_allocated_statements_, min);
+      Statement* new_statement = new Statement[new_size];
+      std::memcpy(new_statement, statement_,
+		  n_statements_*sizeof(Statement));
+      ++n_statement_stack_grows_;
+      statement_stack_grow_bytes_ += new_size*sizeof(Statement);
+      delete[] statement_;
+      
+      statement_ = new_statement;
+      
+      n_allocated_statements_ = new_size;
+    }
+
+    // Borrow a gradient array of at least n elements, returning its
+    // actual size in n_allocated. If none is large enough, the pooled
+    // arrays smaller than n are freed: gradient counts that grow from
+    // one Stack to the next would otherwise leave every outgrown
+    // array in the pool.
+    Real*
+    acquire_gradients(uIndex n, uIndex& n_allocated)
+    {
+      {
+	ADEPT_LOCK_TAPE_POOL;
+	std::vector<PooledGradients>& gradients = tape_pool().gradients;
+	for (std::size_t i = gradients.size(); i > 0; --i) {
+	  if (gradients[i-1].n >= n) {
+	    PooledGradients g = gradients[i-1];
+	    gradients.erase(gradients.begin() + (i-1));
+	    n_allocated = g.n;
+	    return g.gradient;
+	  }
+	}
+	for (std::size_t i = 0; i < gradients.size(); ++i) {
+	  delete[] gradients[i].gradient;
+	}
+	gradients.clear();
+      }
+      n_allocated = n;
+      return new Real[n];
+    }
+
+    // Return a gradient array to the pool
+    void
+    release_gradients(Real* gradient, uIndex n)
+    {
+      if (gradient) {
+	PooledGradients g = { gradient, n };
+	ADEPT_LOCK_TAPE_POOL;
+	tape_pool().gradients.push_back(g);
+      }
+    }
+
+  }
+
+  // -------------------------------------------------------------------
+  // Tape memory policy (declared in settings.h)
+  // -------------------------------------------------------------------
+
+  uIndex
+  initial_stack_length()
+  {
+    ADEPT_LOCK_TAPE_POOL;
+    return internal::tape_pool().initial_length;
+  }
+
+  uIndex
+  set_initial_stack_length(uIndex n)
+  {
+    if (n < 1) {
+      throw invalid_stack_setting("Initial stack length must be at least 1"
+				  ADEPT_EXCEPTION_LOCATION);
+    }
+    ADEPT_LOCK_TAPE_POOL;
+    uIndex previous = internal::tape_pool().initial_length;
+    internal::tape_pool().initial_length = n;
+    return previous;
+  }
+
+  double
+  stack_growth_factor()
+  {
+    ADEPT_LOCK_TAPE_POOL;
+    return internal::tape_pool().growth_factor;
+  }
+
+  double
+  set_stack_growth_factor(double factor)
+  {
+    if (!(factor > 1.0)) {
+      throw invalid_stack_setting("Stack growth factor must be greater than 1"
+				  ADEPT_EXCEPTION_LOCATION);
+    }
+    ADEPT_LOCK_TAPE_POOL;
+    double previous = internal::tape_pool().growth_factor;
+    internal::tape_pool().growth_factor = factor;
+    return previous;
+  }
+
+  bool
+  stack_auto_size()
+  {
+    ADEPT_LOCK_TAPE_POOL;
+    return internal::tape_pool().auto_size;
+  }
+
+  bool
+  set_stack_auto_size(bool auto_size)
+  {
+    ADEPT_LOCK_TAPE_POOL;
+    bool previous = internal::tape_pool().auto_size;
+    internal::tape_pool().auto_size = auto_size;
+    return previous;
+  }
+
+  std::string
+  stack_spill_directory()
+  {
+    ADEPT_LOCK_TAPE_POOL;
+    return internal::tape_pool().spill_directory;
+  }
+
+  std::string
+  set_stack_spill_directory(const std::string& directory)
+  {
+    ADEPT_LOCK_TAPE_POOL;
+    std::string previous = internal::tape_pool().spill_directory;
+    internal::tape_pool().spill_directory = directory;
+    return previous;
+  }
+
+  std::size_t
+  release_stack_pool()
+  {
+    ADEPT_LOCK_TAPE_POOL;
+    return internal::tape_pool().release();
+  }
 
+#undef ADEPT_LOCK_TAPE_POOL
+
+}
 
 
 // =================================================================
-// Contents of StackStorageOrig.cpp
+// Contents of StackStorage.cpp
 // =================================================================
 
-/* StackStorageOrig.cpp -- Original storage of stacks using STL containers
-
-    Copyright (C) 2014-2015 University of Reading
+/* StackStorage.cpp -- Block storage of the statement & operation stacks
 
     Author: Robin Hogan <r.j.hogan@ecmwf.int>
 
     This file is part of the Adept library.
 
-   The Stack class inherits from a class providing the storage (and
-   interface to the storage) for the derivative statements that are
-   accumulated during the execution of an algorithm.  The derivative
-   statements are held in two stacks described by Hogan (2014): the
-   "statement stack" and the "operation stack".
-
-   This file provides one of the original storage engine, which used
-   std::vector to hold the two stacks. Note that these stacks are
-   contiguous in memory, which is not ideal for very large algorithms.
+   The block storage engine, selected by defining
+   ADEPT_STACK_STORAGE_BLOCKS: the stacks reserve address space for
+   their longest possible length and have memory committed to it in
+   blocks, anonymous or mapped from a spill file, so they never move.
 
 */
 
-#include <cstring>
+#ifdef ADEPT_STACK_STORAGE_BLOCKS
 
-#include <adept/StackStorageOrig.h>
+#ifdef _WIN32
+#error "ADEPT_STACK_STORAGE_BLOCKS requires POSIX mmap()"
+#endif
+
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <adept/StackStorage.h>
+#include <adept/settings.h>
 
 namespace adept {
   namespace internal {
 
-    StackStorageOrig::~StackStorageOrig() {
-      if (statement_) {
-	delete[] statement_;
+    static std::size_t
+    page_size()
+    {
+      static const std::size_t size
+	= static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+      return size;
+    }
+
+    // Most bytes to reserve for a stack of elements of the given
+    // size: enough for the largest uIndex, but no more than 1 TB so
+    // that the 64-bit address space holds the stacks of many threads
+    static std::size_t
+    max_stack_bytes(std::size_t element_size)
+    {
+      const double terabyte = 1099511627776.0;
+      const std::size_t cap
+	= static_cast<double>(std::numeric_limits<std::size_t>::max()) < terabyte
+	? std::numeric_limits<std::size_t>::max()
+	: static_cast<std::size_t>(terabyte);
+      std::size_t n = static_cast<std::size_t>(std::numeric_limits<uIndex>::max());
+      if (n > cap / element_size) {
+	n = cap / element_size;
       }
-      if (multiplier_) {
-	delete[] multiplier_;
+      return n * element_size;
+    }
+
+    BlockArray::~BlockArray()
+    {
+      if (data_) {
+	munmap(data_, n_reserved_bytes_);
       }
-      if (index_) {
-	delete[] index_;
+      if (file_ >= 0) {
+	close(file_);
       }
     }
 
+    // Reserve the address space, halving the request until the
+    // system grants it
+    void*
+    BlockArray::reserve(std::size_t max_bytes,
+			const std::string& spill_directory)
+    {
+      const std::size_t page = page_size();
+      max_bytes = max_bytes / page * page;
+      void* data = MAP_FAILED;
+      while (max_bytes >= page) {
+	data = mmap(0, max_bytes, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (data != MAP_FAILED) {
+	  break;
+	}
+	max_bytes = max_bytes / 2 / page * page;
+      }
+      if (data == MAP_FAILED) {
+	throw stack_exhausted("Cannot reserve address space for a stack"
+			      ADEPT_EXCEPTION_LOCATION);
+      }
+      data_ = static_cast<char*>(data);
+      n_reserved_bytes_ = max_bytes;
+
+      if (!spill_directory.empty()) {
+	std::string name = spill_directory + "/adept-stack-XXXXXX";
+	std::vector<char> path(name.begin(), name.end());
+	path.push_back('\0');
+	file_ = mkstemp(&path[0]);
+	if (file_ < 0) {
+	  throw stack_exhausted("Cannot create a stack spill file in \""
+				+ spill_directory + "\""
+				ADEPT_EXCEPTION_LOCATION);
+	}
+	// The file is removed when the descriptor is closed
+	unlink(&path[0]);
+      }
+      return data_;
+    }
 
-    // Double the size of the operation stack, or grow it even more if
-    // the requested minimum number of extra entries (min) is greater
-    // than this would allow
+    // Commit the pages from the end of the committed part to n_bytes:
+    // make them accessible, or map them from the spill file after
+    // extending it
     void
-    StackStorageOrig::grow_operation_stack(uIndex min)
+    BlockArray::commit(std::size_t n_bytes)
     {
-      uIndex new_size = 2*n_allocated_operations_;
-      if (min > 0 && new_size < n_allocated_operations_+min) {
-	new_size += min;
+      const std::size_t page = page_size();
+      n_bytes = (n_bytes + page - 1) / page * page;
+      if (n_bytes <= n_committed_bytes_) {
+	return;
       }
-      Real* new_multiplier = new Real[new_size];
-      uIndex* new_index = new uIndex[new_size];
-      
-      std::memcpy(new_multiplier, multiplier_, n_operations_*sizeof(Real));
-      std::memcpy(new_index, index_, n_operations_*sizeof(uIndex));
-      
-      delete[] multiplier_;
-      delete[] index_;
-      
-      multiplier_ = new_multiplier;
-      index_ = new_index;
-      
-      n_allocated_operations_ = new_size;
+      if (n_bytes > n_reserved_bytes_) {
+	throw stack_exhausted("Stack has reached the size of its address space reservation"
+			      ADEPT_EXCEPTION_LOCATION);
+      }
+      char* start = data_ + n_committed_bytes_;
+      std::size_t length = n_bytes - n_committed_bytes_;
+      if (file_ >= 0) {
+	if (ftruncate(file_, static_cast<off_t>(n_bytes)) != 0
+	    || mmap(start, length, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_FIXED, file_,
+		    static_cast<off_t>(n_committed_bytes_)) == MAP_FAILED) {
+	  throw stack_exhausted("Cannot extend the stack spill file"
+				ADEPT_EXCEPTION_LOCATION);
+	}
+      }
+      else if (mprotect(start, length, PROT_READ | PROT_WRITE) != 0) {
+	throw stack_exhausted("Cannot commit memory to a stack"
+			      ADEPT_EXCEPTION_LOCATION);
+      }
+      n_committed_bytes_ = n_bytes;
     }
-    
+
+    // The length, in whole blocks, of a stack that must hold n_used
+    // elements now and at least min more, or one more block than
+    // n_allocated if min is zero
+    static std::size_t
+    block_length(uIndex n_allocated, uIndex n_used, uIndex min)
+    {
+      const std::size_t block = ADEPT_STACK_BLOCK_LENGTH;
+      std::size_t needed = static_cast<std::size_t>(n_used) + min + 1;
+      if (needed <= static_cast<std::size_t>(n_allocated)) {
+	needed = static_cast<std::size_t>(n_allocated) + 1;
+      }
+      return (needed + block - 1) / block * block;
+    }
+
+    // Reserve the three arrays and commit the initial length
+    void
+    StackStorage::initialize()
+    {
+      const std::string spill_directory = stack_spill_directory();
+      statement_ = static_cast<Statement*>
+	(statement_block_.reserve(max_stack_bytes(sizeof(Statement)),
+				  spill_directory));
+      multiplier_ = static_cast<Multiplier*>
+	(multiplier_block_.reserve(max_stack_bytes(sizeof(Multiplier)),
+				   spill_directory));
+      index_ = static_cast<uIndex*>
+	(index_block_.reserve(max_stack_bytes(sizeof(uIndex)),
+			      spill_directory));
+      const uIndex n = initial_stack_length();
+      const std::size_t n_blocks = block_length(0, 0, n-1);
+      statement_block_.commit(n_blocks*sizeof(Statement));
+      multiplier_block_.commit(n_blocks*sizeof(Multiplier));
+      index_block_.commit(n_blocks*sizeof(uIndex));
+      n_allocated_statements_ = static_cast<uIndex>(n_blocks);
+      n_allocated_operations_ = static_cast<uIndex>(n_blocks);
+    }
+
+    // Commit further blocks of the operation stack; nothing is copied
+    void
+    StackStorage::grow_operation_stack(uIndex min)
+    {
+      const std::size_t new_size
+	= block_length(n_allocated_operations_, n_operations_, min);
+      const std::size_t before = multiplier_block_.n_committed_bytes()
+	+ index_block_.n_committed_bytes();
+      multiplier_block_.commit(new_size*sizeof(Multiplier));
+      index_block_.commit(new_size*sizeof(uIndex));
+      ++n_operation_stack_grows_;
+      operation_stack_grow_bytes_ += multiplier_block_.n_committed_bytes()
+	+ index_block_.n_committed_bytes() - before;
+      n_allocated_operations_ = static_cast<uIndex>(new_size);
+    }
+
     // ... likewise for the statement stack
     void
-    StackStorageOrig::grow_statement_stack(uIndex min)
+    StackStorage::grow_statement_stack(uIndex min)
     {
-      uIndex new_size = 2*n_allocated_statements_;
-      if (min > 0 && new_size < n_allocated_statements_+min) {
-	new_size += min;
-      }
-      Statement* new_statement = new Statement[new_size];
-      std::memcpy(new_statement, statement_,
-		  n_statements_*sizeof(Statement));
-      delete[] statement_;
-      
-      statement_ = new_statement;
-      
-      n_allocated_statements_ = new_size;
+      const std::size_t new_size
+	= block_length(n_allocated_statements_, n_statements_, min);
+      const std::size_t before = statement_block_.n_committed_bytes();
+      statement_block_.commit(new_size*sizeof(Statement));
+      ++n_statement_stack_grows_;
+      statement_stack_grow_bytes_
+	+= statement_block_.n_committed_bytes() - before;
+      n_allocated_statements_ = static_cast<uIndex>(new_size);
     }
 
   }
 }
 
+#endif
+
 
 // =================================================================
 // Contents of Storage.cpp
@@ -1868,6 +3118,7 @@ namespace adept {
   void
   Stack::jacobian_forward(Real* jacobian_out)
   {
+    check_no_external_adjoints("Stack::jacobian_forward()");
     if (independent_index_.empty() || dependent_index_.empty()) {
       throw(dependents_or_independents_not_identified());
     }
@@ -2088,6 +3339,7 @@ namespace adept {
   void
   Stack::jacobian_reverse(Real* jacobian_out)
   {
+    check_no_external_adjoints("Stack::jacobian_reverse()");
     if (independent_index_.empty() || dependent_index_.empty()) {
       throw(dependents_or_independents_not_identified());
     }
@@ -2244,6 +3496,207 @@ namespace adept {
     }
   }
 
+  // Reverse pass over statements [begin, end) for one block of Width
+  // lanes of adjoints, held contiguously for each gradient in
+  // gradient_multipass_b. Width is a compile-time constant so that
+  // the loops over lanes are unrolled and vectorized; a block that
+  // is exactly one packet wide uses packet operations directly.
+  template <int Width>
+  void
+  Stack::adjoint_vector_kernel(Real* __restrict gradient_multipass_b,
+			       uIndex begin, uIndex end) const
+  {
+    // Statement 0 only marks the start of the operations
+    const uIndex stop = begin > 0 ? begin-1 : 0;
+#if ADEPT_REAL_PACKET_SIZE > 1
+    if (Width == Packet<Real>::size) {
+      for (uIndex ist = end-1; ist > stop; ist--) {
+	const Statement& statement = statement_[ist];
+	Real* __restrict lhs = gradient_multipass_b+statement.index*Width;
+	bool is_zero = true;
+	for (int i = 0; i < Width; i++) {
+	  is_zero = is_zero && lhs[i] == 0.0;
+	}
+	if (is_zero) {
+	  continue;
+	}
+	Packet<Real> a(lhs);
+	Packet<Real>().put(lhs);
+	for (uIndex iop = statement_[ist-1].end_plus_one;
+	     iop < statement.end_plus_one; iop++) {
+	  Real* __restrict grad = gradient_multipass_b+index_[iop]*Width;
+	  Packet<Real> g(grad);
+	  g += Packet<Real>(multiplier_[iop]) * a;
+	  g.put(grad);
+	}
+      }
+      return;
+    }
+#endif
+    // Loop backward through the derivative statements
+    for (uIndex ist = end-1; ist > stop; ist--) {
+      const Statement& statement = statement_[ist];
+      Real* __restrict lhs = gradient_multipass_b+statement.index*Width;
+      // We copy the LHS to "a" in case it appears on the RHS in any
+      // of the following statements
+      Real a[Width];
+      bool is_zero = true;
+      for (int i = 0; i < Width; i++) {
+	a[i] = lhs[i];
+	lhs[i] = 0.0;
+	is_zero = is_zero && a[i] == 0.0;
+      }
+      // As in compute_adjoint(), skip statements whose adjoint is
+      // zero in every lane
+      if (is_zero) {
+	continue;
+      }
+      // Loop through operations
+      for (uIndex iop = statement_[ist-1].end_plus_one;
+	   iop < statement.end_plus_one; iop++) {
+	Real multiplier = multiplier_[iop];
+	Real* __restrict grad = gradient_multipass_b+index_[iop]*Width;
+	for (int i = 0; i < Width; i++) {
+	  grad[i] += multiplier*a[i];
+	}
+      }
+    } // End of loop over statements
+  }
+
+  // Run the kernel on block_size lanes starting at first_lane,
+  // gathering them from gradient_lanes_ and scattering the results
+  // back
+  template <int Width>
+  void
+  Stack::adjoint_vector_block(uIndex first_lane, uIndex block_size,
+			      uIndex begin, uIndex end)
+  {
+    const uIndex stride = gradient_lane_stride_;
+    const uIndex multipass_size = max_gradient_*Width;
+    Real* __restrict gradient_multipass_b = gradient_multipass_;
+    for (uIndex i = 0; i < multipass_size; i++) {
+      gradient_multipass_b[i] = 0.0;
+    }
+    for (uIndex k = 0; k < block_size; k++) {
+      const Real* lane = &gradient_lanes_[(first_lane+k)*stride];
+      for (uIndex i = 0; i < stride; i++) {
+	gradient_multipass_b[i*Width+k] = lane[i];
+      }
+    }
+    // Split the statements at the external adjoints that fall in the
+    // range, running each after the statements recorded later
+    uIndex last = end;
+    for (std::size_t i = external_adjoints_.size(); i > 0; i--) {
+      const ExternalAdjointCall& call = external_adjoints_[i-1];
+      if (call.statement > last) {
+	continue;
+      }
+      if (call.statement <= begin) {
+	break;
+      }
+      adjoint_vector_kernel<Width>(gradient_multipass_b, call.statement, last);
+      (*call.function)(call.data, gradient_multipass_b, Width);
+      last = call.statement;
+    }
+    adjoint_vector_kernel<Width>(gradient_multipass_b, begin, last);
+    for (uIndex k = 0; k < block_size; k++) {
+      Real* lane = &gradient_lanes_[(first_lane+k)*stride];
+      for (uIndex i = 0; i < stride; i++) {
+	lane[i] = gradient_multipass_b[i*Width+k];
+      }
+    }
+  }
+
+  // Make room for n_lanes lanes of adjoints. The first lane to be
+  // seeded after the gradients are cleared fixes the number of
+  // gradients per lane.
+  void
+  Stack::resize_gradient_lanes(uIndex n_lanes)
+  {
+    if (n_gradient_lanes_ == 0) {
+      gradient_lane_stride_ = max_gradient_;
+    }
+    else if (gradient_lane_stride_ < max_gradient_) {
+      // Gradients registered since the lanes were seeded, e.g. after
+      // rewind_keeping_adjoint_lanes(): move each lane to the longer
+      // stride, zeroing the new entries
+      std::vector<Real> lanes(n_gradient_lanes_*max_gradient_, 0.0);
+      for (uIndex k = 0; k < n_gradient_lanes_; k++) {
+	std::copy(gradient_lanes_.begin() + k*gradient_lane_stride_,
+		  gradient_lanes_.begin() + (k+1)*gradient_lane_stride_,
+		  lanes.begin() + k*max_gradient_);
+      }
+      gradient_lanes_.swap(lanes);
+      gradient_lane_stride_ = max_gradient_;
+    }
+    if (n_lanes > n_gradient_lanes_) {
+      // Lanes beyond the old count may hold values from an earlier
+      // recording, so zero them rather than rely on resize()
+      uIndex old_size = n_gradient_lanes_*gradient_lane_stride_;
+      gradient_lanes_.resize(n_lanes*gradient_lane_stride_);
+      std::fill(gradient_lanes_.begin()+old_size, gradient_lanes_.end(), 0.0);
+      n_gradient_lanes_ = n_lanes;
+    }
+  }
+
+  // Run the vector adjoint algorithm on n_lanes lanes of gradients,
+  // in blocks of MULTIPASS_SIZE lanes. A last block of at most a half
+  // or a quarter of that is run at the narrower width, so that a few
+  // lanes do not pay for a full block.
+  void
+  Stack::compute_adjoint_vector(uIndex n_lanes)
+  {
+    compute_adjoint_vector(n_lanes, StackMark(), mark());
+  }
+
+  void
+  Stack::compute_adjoint_vector(uIndex n_lanes, const StackMark& begin,
+				const StackMark& end)
+  {
+    if (begin.n_statements > end.n_statements
+	|| end.n_statements > n_statements_) {
+      throw invalid_mark("Stack::compute_adjoint_vector() called with marks that do not bound part of the current recording"
+			 ADEPT_EXCEPTION_LOCATION);
+    }
+    stop_recording_clock();
+    resize_gradient_lanes(n_lanes);
+    if (n_lanes == 0 || end.n_statements == 0) {
+      return;
+    }
+    const double start = wall_clock_seconds();
+    uIndex multipass_size = max_gradient_*MULTIPASS_SIZE;
+    if (n_allocated_multipass_ < multipass_size) {
+      if (gradient_multipass_) {
+	free_aligned(gradient_multipass_);
+      }
+      gradient_multipass_ = alloc_aligned<Real>(multipass_size);
+      n_allocated_multipass_ = multipass_size;
+    }
+
+    const uIndex first = begin.n_statements, last = end.n_statements;
+    for (uIndex first_lane = 0; first_lane < n_lanes;
+	 first_lane += MULTIPASS_SIZE) {
+      uIndex block_size = n_lanes-first_lane;
+      if (block_size >= static_cast<uIndex>(MULTIPASS_SIZE)) {
+	adjoint_vector_block<MULTIPASS_SIZE>(first_lane, MULTIPASS_SIZE,
+					     first, last);
+      }
+      else if (block_size <= 2) {
+	adjoint_vector_block<2>(first_lane, block_size, first, last);
+      }
+      else if (block_size <= 4 && MULTIPASS_SIZE > 4) {
+	adjoint_vector_block<(MULTIPASS_SIZE > 4 ? 4 : MULTIPASS_SIZE)>(first_lane, block_size,
+									 first, last);
+      }
+      else {
+	adjoint_vector_block<MULTIPASS_SIZE>(first_lane, block_size,
+					     first, last);
+      }
+    }
+    reverse_seconds_ += wall_clock_seconds() - start;
+    ++n_reverse_passes_;
+  }
+
   // Compute the Jacobian matrix; note that jacobian_out must be
   // allocated to be of size m*n, where m is the number of dependent
   // variables and n is the number of independents. In the resulting
@@ -2264,6 +3717,248 @@ namespace adept {
       jacobian_reverse(jacobian_out);
     }
   }
+
+  namespace internal {
+    // Greedy distance-2 colouring: give each of n_items items a
+    // colour that differs from those of all items sharing a link with
+    // it. The links of item i are item_link[item_start[i]] to
+    // item_link[item_start[i+1]-1], and the items of link l are
+    // link_item[link_start[l]] to link_item[link_start[l+1]-1].
+    // Returns the number of colours used.
+    static uIndex
+    colour_distance_2(uIndex n_items, const std::vector<uIndex>& item_start,
+		      const std::vector<uIndex>& item_link,
+		      const std::vector<uIndex>& link_start,
+		      const std::vector<uIndex>& link_item,
+		      std::vector<uIndex>& colour)
+    {
+      const uIndex none = static_cast<uIndex>(-1);
+      // forbidden[c] == i if colour c is taken by a neighbour of item i
+      std::vector<uIndex> forbidden;
+      colour.assign(n_items, none);
+      uIndex n_colours = 0;
+      for (uIndex i = 0; i < n_items; i++) {
+	for (uIndex k = item_start[i]; k < item_start[i+1]; k++) {
+	  uIndex l = item_link[k];
+	  for (uIndex kk = link_start[l]; kk < link_start[l+1]; kk++) {
+	    uIndex c = colour[link_item[kk]];
+	    if (c != none) {
+	      forbidden[c] = i;
+	    }
+	  }
+	}
+	uIndex c = 0;
+	while (c < n_colours && forbidden[c] == i) {
+	  c++;
+	}
+	if (c == n_colours) {
+	  forbidden.push_back(none);
+	  n_colours++;
+	}
+	colour[i] = c;
+      }
+      return n_colours;
+    }
+  }
+
+  // Find the sparsity pattern of the Jacobian by propagating bit
+  // masks through the recording: forward from blocks of 64
+  // independents if there are no more independents than dependents,
+  // otherwise backward from blocks of 64 dependents
+  void
+  Stack::jacobian_sparsity(SparseJacobian& pattern) const
+  {
+    check_no_external_adjoints("Stack::jacobian_sparsity()");
+    if (independent_index_.empty() || dependent_index_.empty()) {
+      throw(dependents_or_independents_not_identified());
+    }
+    typedef unsigned long long Bits;
+    static const uIndex n_bits = sizeof(Bits)*8;
+    const uIndex m = n_dependent(), n = n_independent();
+    std::vector<Bits> bits(max_gradient_);
+    // The nonzeros in the order found, then sorted by row
+    std::vector<uIndex> entry_row, entry_column;
+
+    if (n <= m) {
+      for (uIndex first = 0; first < n; first += n_bits) {
+	const uIndex n_block = std::min(n_bits, n-first);
+	std::fill(bits.begin(), bits.end(), Bits(0));
+	for (uIndex b = 0; b < n_block; b++) {
+	  bits[independent_index_[first+b]] |= Bits(1) << b;
+	}
+	for (uIndex ist = 1; ist < n_statements_; ist++) {
+	  const Statement& statement = statement_[ist];
+	  Bits a = 0;
+	  for (uIndex iop = statement_[ist-1].end_plus_one;
+	       iop < statement.end_plus_one; iop++) {
+	    if (multiplier_[iop] != 0.0) {
+	      a |= bits[index_[iop]];
+	    }
+	  }
+	  bits[statement.index] = a;
+	}
+	for (uIndex i = 0; i < m; i++) {
+	  Bits w = bits[dependent_index_[i]];
+	  for (uIndex b = 0; w != 0; b++, w >>= 1) {
+	    if (w & 1) {
+	      entry_row.push_back(i);
+	      entry_column.push_back(first+b);
+	    }
+	  }
+	}
+      }
+    }
+    else {
+      for (uIndex first = 0; first < m; first += n_bits) {
+	const uIndex n_block = std::min(n_bits, m-first);
+	std::fill(bits.begin(), bits.end(), Bits(0));
+	for (uIndex b = 0; b < n_block; b++) {
+	  bits[dependent_index_[first+b]] |= Bits(1) << b;
+	}
+	for (uIndex ist = n_statements_-1; ist > 0; ist--) {
+	  const Statement& statement = statement_[ist];
+	  Bits a = bits[statement.index];
+	  bits[statement.index] = 0;
+	  if (a != 0) {
+	    for (uIndex iop = statement_[ist-1].end_plus_one;
+		 iop < statement.end_plus_one; iop++) {
+	      if (multiplier_[iop] != 0.0) {
+		bits[index_[iop]] |= a;
+	      }
+	    }
+	  }
+	}
+	for (uIndex j = 0; j < n; j++) {
+	  Bits w = bits[independent_index_[j]];
+	  for (uIndex b = 0; w != 0; b++, w >>= 1) {
+	    if (w & 1) {
+	      entry_row.push_back(first+b);
+	      entry_column.push_back(j);
+	    }
+	  }
+	}
+      }
+    }
+
+    // Sort by row; within a row the columns were found in increasing
+    // order
+    pattern.n_rows = m;
+    pattern.n_columns = n;
+    pattern.row_start.assign(m+1, 0);
+    for (std::size_t k = 0; k < entry_row.size(); k++) {
+      pattern.row_start[entry_row[k]+1]++;
+    }
+    for (uIndex i = 0; i < m; i++) {
+      pattern.row_start[i+1] += pattern.row_start[i];
+    }
+    std::vector<uIndex> next(pattern.row_start.begin(),
+			     pattern.row_start.end()-1);
+    pattern.column.resize(entry_column.size());
+    for (std::size_t k = 0; k < entry_row.size(); k++) {
+      pattern.column[next[entry_row[k]]++] = entry_column[k];
+    }
+  }
+
+  // Compute the sparse Jacobian from its pattern, colouring its
+  // columns or rows so that each pass gives several of them
+  void
+  Stack::jacobian(SparseJacobian& jacobian_out)
+  {
+    SparseJacobian& jac = jacobian_out;
+    jacobian_sparsity(jac);
+    const uIndex m = jac.n_rows, n = jac.n_columns;
+    const uIndex n_nonzeros = jac.n_nonzeros();
+
+    // The pattern by column
+    std::vector<uIndex> column_start(n+1, 0), column_row(n_nonzeros);
+    for (uIndex k = 0; k < n_nonzeros; k++) {
+      column_start[jac.column[k]+1]++;
+    }
+    for (uIndex j = 0; j < n; j++) {
+      column_start[j+1] += column_start[j];
+    }
+    {
+      std::vector<uIndex> next(column_start.begin(), column_start.end()-1);
+      for (uIndex i = 0; i < m; i++) {
+	for (uIndex k = jac.row_start[i]; k < jac.row_start[i+1]; k++) {
+	  column_row[next[jac.column[k]]++] = i;
+	}
+      }
+    }
+
+    // Columns sharing a row cannot share a colour, nor can rows
+    // sharing a column
+    std::vector<uIndex> column_colour, row_colour;
+    uIndex n_column_colours
+      = colour_distance_2(n, column_start, column_row,
+			  jac.row_start, jac.column, column_colour);
+    uIndex n_row_colours
+      = colour_distance_2(m, jac.row_start, jac.column,
+			  column_start, column_row, row_colour);
+    jac.is_forward = n_column_colours <= n_row_colours;
+    jac.n_colours = jac.is_forward ? n_column_colours : n_row_colours;
+    jac.value.assign(n_nonzeros, 0.0);
+
+    uIndex gradient_multipass_size = max_gradient_*MULTIPASS_SIZE;
+    Real* __restrict gradient_multipass_b 
+      = alloc_aligned<Real>(gradient_multipass_size);
+
+    for (uIndex first = 0; first < jac.n_colours; first += MULTIPASS_SIZE) {
+      const uIndex n_block
+	= std::min(static_cast<uIndex>(MULTIPASS_SIZE), jac.n_colours-first);
+      for (uIndex i = 0; i < gradient_multipass_size; i++) {
+	gradient_multipass_b[i] = 0.0;
+      }
+      if (jac.is_forward) {
+	// One seed vector per colour, with 1.0 for each independent of
+	// that colour
+	for (uIndex j = 0; j < n; j++) {
+	  if (column_colour[j] >= first && column_colour[j] < first+n_block) {
+	    gradient_multipass_b[independent_index_[j]*MULTIPASS_SIZE
+				 +column_colour[j]-first] = 1.0;
+	  }
+	}
+	if (n_block == static_cast<uIndex>(MULTIPASS_SIZE)) {
+	  jacobian_forward_kernel(gradient_multipass_b);
+	}
+	else {
+	  jacobian_forward_kernel_extra(gradient_multipass_b, n_block);
+	}
+	// Each element is found in the pass of its column's colour
+	for (uIndex i = 0; i < m; i++) {
+	  const Real* dep = gradient_multipass_b
+	    + dependent_index_[i]*MULTIPASS_SIZE;
+	  for (uIndex k = jac.row_start[i]; k < jac.row_start[i+1]; k++) {
+	    uIndex c = column_colour[jac.column[k]];
+	    if (c >= first && c < first+n_block) {
+	      jac.value[k] = dep[c-first];
+	    }
+	  }
+	}
+      }
+      else {
+	for (uIndex i = 0; i < m; i++) {
+	  if (row_colour[i] >= first && row_colour[i] < first+n_block) {
+	    gradient_multipass_b[dependent_index_[i]*MULTIPASS_SIZE
+				 +row_colour[i]-first] = 1.0;
+	  }
+	}
+	adjoint_vector_kernel<MULTIPASS_SIZE>(gradient_multipass_b,
+					      0, n_statements_);
+	for (uIndex i = 0; i < m; i++) {
+	  uIndex c = row_colour[i];
+	  if (c >= first && c < first+n_block) {
+	    for (uIndex k = jac.row_start[i]; k < jac.row_start[i+1]; k++) {
+	      jac.value[k] = gradient_multipass_b
+		[independent_index_[jac.column[k]]*MULTIPASS_SIZE+c-first];
+	    }
+	  }
+	}
+      }
+    }
+
+    free_aligned(gradient_multipass_b);
+  }
   
 } // End namespace adept
 
@@ -2378,6 +4073,8 @@ namespace adept {
 #endif
     s << "  Jacobians processed in blocks of size " 
       << ADEPT_MULTIPASS_SIZE << "\n";
+    s << "  Operation stack multipliers stored in "
+      << sizeof(Multiplier) << " bytes\n";
     return s.str();
   }
 
@@ -6,7 +6,23 @@
 #include <memory>
 #include <iostream>
 #include <numeric>
-#include <random>
+#include <cstdlib>
+#include <string>
+#include <tuple>
+#include <type_traits>
+
+#include "mc/Random.h"
+#include "mc/DigitalSequence.h"
+#include "mc/Statistics.h"
+#include "mc/ThreadPool.h"
+#include "mc/VectorMath.h"
+
+// Position of the last lookup in a curve, owned by the caller. Queries with nondecreasing x then find
+// their interval in O(1) instead of by binary search.
+struct CurveCursor {
+    size_t index;
+    CurveCursor() : index(0) {}
+};
 
 class Curve1D {
 public:
@@ -14,12 +30,101 @@ public:
 
     // Virtual method that must be implemented by derived classes
     virtual double operator()(double x) const = 0;  
+
+    // Virtual method evaluating with a lookup cursor; curves that cannot use it ignore it
+    virtual double operator()(double x, CurveCursor& cursor) const {
+        return (*this)(x);
+    }
+
+    // Virtual methods returning the integral of the curve, and of its square, over [x0, x1]. The defaults
+    // use composite Simpson's rule on subintervals of at most 1/1024; curves with closed forms override them.
+    virtual double integral(double x0, double x1) const {
+        return simpson(x0, x1, false);
+    }
+
+    virtual double integralOfSquare(double x0, double x1) const {
+        return simpson(x0, x1, true);
+    }
+
+private:
+    double simpson(double x0, double x1, bool square) const {
+        const int panels = std::max(1, static_cast<int>(std::ceil(std::fabs(x1 - x0) * 512.0)));
+        const double h = (x1 - x0) / (2 * panels);
+        CurveCursor cursor;
+        double sum = 0.0;
+        for (int j = 0; j <= 2 * panels; ++j) {
+            const double f = (*this)(j == 2 * panels ? x1 : x0 + j * h, cursor);
+            const double weight = (j == 0 || j == 2 * panels) ? 1.0 : (j % 2 == 1 ? 4.0 : 2.0);
+            sum += weight * (square ? f * f : f);
+        }
+        return sum * h / 3.0;
+    }
 };
 
 class LinearInterpolation : public Curve1D {
 private:
     std::vector<double> x_vals;
     std::vector<double> y_vals;
+    bool uniform;  // Whether x_vals is equally spaced, so that the interval of x can be computed directly
+    double inv_spacing;
+
+    // Index idx with x_vals[idx] < x <= x_vals[idx + 1], i.e. the one std::lower_bound gives, for
+    // x_vals.front() < x <= x_vals.back(). Walks a few intervals from the guess, then falls back to a
+    // binary search, so the guess only affects the speed and never the result.
+    size_t locate(double x, size_t guess) const {
+        const size_t last = x_vals.size() - 2;
+        if (guess > last) guess = last;
+        for (int steps = 0; steps < 4; ++steps) {
+            if (!(x_vals[guess] < x)) --guess;
+            else if (x_vals[guess + 1] < x) ++guess;
+            else return guess;
+        }
+        return std::distance(x_vals.begin(), std::lower_bound(x_vals.begin(), x_vals.end(), x)) - 1;
+    }
+
+    size_t uniformGuess(double x) const {
+        return static_cast<size_t>((x - x_vals.front()) * inv_spacing);
+    }
+
+    void checkRange(double x) const {
+        if (x_vals.empty()) {
+            throw std::runtime_error("Interpolation vectors are empty.");
+        }
+        if (x < x_vals.front() || x > x_vals.back()) {
+            throw std::out_of_range("X value out of interpolation range.");
+        }
+    }
+
+    double interpolate(double x, size_t idx) const {
+        size_t idx_next = idx + 1;
+
+        // Linear interpolation formula
+        double t = (x - x_vals[idx]) / (x_vals[idx_next] - x_vals[idx]);
+        return y_vals[idx] + t * (y_vals[idx_next] - y_vals[idx]);
+    }
+
+    // Exact integral over [x0, x1] of the curve or of its square, summed over the linear pieces: a piece
+    // from (u, f_u) to (v, f_v) contributes (v - u)(f_u + f_v)/2, or (v - u)(f_u^2 + f_u f_v + f_v^2)/3
+    double integrate(double x0, double x1, bool square) const {
+        checkRange(x0);
+        checkRange(x1);
+        if (x1 < x0) return -integrate(x1, x0, square);
+        if (x1 == x0) return 0.0;
+
+        size_t idx = x0 == x_vals.front() ? 0 : locate(x0, uniform ? uniformGuess(x0) : 0);
+        double u = x0, fu = interpolate(x0, idx);
+        double sum = 0.0;
+        for (;;) {
+            const bool last = x1 <= x_vals[idx + 1];
+            const double v = last ? x1 : x_vals[idx + 1];
+            const double fv = last ? interpolate(x1, idx) : y_vals[idx + 1];
+            sum += square ? (v - u) * (fu * fu + fu * fv + fv * fv) / 3.0 : (v - u) * (fu + fv) * 0.5;
+            if (last) return sum;
+            u = v;
+            fu = fv;
+            ++idx;
+        }
+    }
 
 public:
     LinearInterpolation(const std::vector<double>& x, const std::vector<double>& y) {
@@ -28,28 +133,41 @@ public:
         }
         x_vals = x;
         y_vals = y;
+
+        // Detect an equally spaced grid, such as the weekly time points
+        uniform = x_vals.size() > 2 && x_vals.back() > x_vals.front();
+        if (uniform) {
+            const double spacing = (x_vals.back() - x_vals.front()) / (x_vals.size() - 1);
+            inv_spacing = 1.0 / spacing;
+            for (size_t i = 0; i < x_vals.size() && uniform; ++i) {
+                uniform = std::fabs(x_vals[i] - (x_vals.front() + i * spacing)) <= 1e-9 * spacing;
+            }
+        }
     }
 
     virtual double operator()(double x) const {
-        if (x_vals.empty()) {
-            throw std::runtime_error("Interpolation vectors are empty.");
-        }
-        if (x < x_vals.front() || x > x_vals.back()) {
-            throw std::out_of_range("X value out of interpolation range.");
-        }
+        checkRange(x);
+        if (x == x_vals.front()) return y_vals.front();
+        if (uniform) return interpolate(x, locate(x, uniformGuess(x)));
 
         // Lower bound finds the first element which does not compare less than x
         auto low = std::lower_bound(x_vals.begin(), x_vals.end(), x);
-        if (low != x_vals.begin()) {
-            // Find indices of the two points forming the interpolation interval
-            size_t idx = std::distance(x_vals.begin(), low) - 1;
-            size_t idx_next = idx + 1;
+        return interpolate(x, std::distance(x_vals.begin(), low) - 1);
+    }
 
-            // Linear interpolation formula
-            double t = (x - x_vals[idx]) / (x_vals[idx_next] - x_vals[idx]);
-            return y_vals[idx] + t * (y_vals[idx_next] - y_vals[idx]);
-        }
-        return y_vals.front();
+    virtual double operator()(double x, CurveCursor& cursor) const {
+        checkRange(x);
+        if (x == x_vals.front()) return y_vals.front();
+        cursor.index = locate(x, uniform ? uniformGuess(x) : cursor.index);
+        return interpolate(x, cursor.index);
+    }
+
+    virtual double integral(double x0, double x1) const {
+        return integrate(x0, x1, false);
+    }
+
+    virtual double integralOfSquare(double x0, double x1) const {
+        return integrate(x0, x1, true);
     }
 };
 
@@ -65,23 +183,122 @@ public:
     // Pure virtual method to get the current state of the model
     virtual const std::vector<double>& getState() const = 0;
 
+    // Batched counterparts of reset() and evolve() for n_paths paths held in structure-of-arrays
+    // layout: state[i * n_paths + p] is dimension i of path p, and normals are laid out the same way.
+    // The model keeps a single clock, so all paths of a batch are evolved in lockstep.
+    virtual void resetBatch(double* state, int n_paths) = 0;
+    virtual void evolveBatch(double dt, const double* normals, double* state, int n_paths) = 0;
+
     virtual int dims() const = 0; // Pure virtual method to get the dimension of the model
 
     virtual void reset() {} // Virtual method to reset the model to its initial state
+
+    // Virtual method announcing the step sizes of the simulation up front, so that the model can precompute
+    // per-step quantities; steps taken afterwards may still deviate from this grid
+    virtual void setTimeGrid(const std::vector<double>& step_sizes) {}
+
+    // Pure virtual method returning an independent copy, so that worker threads can evolve their own paths
+    virtual std::unique_ptr<Model> clone() const = 0;
 };
 
 class LogNormalProcess : public Model {
+public:
+    // How the coefficients of a step are obtained from the curves
+    enum class StepScheme {
+        Exact,    // Drift int r - 0.5 int vol^2 and variance int vol^2 over the step: exact for steps of any length
+        EndPoint  // r and vol sampled at the end of the step and held constant over it, as in adept-code
+    };
+
 private:
+    StepScheme scheme;
     std::vector<std::shared_ptr<Curve1D>> r_curves;  // Vector of shared pointers for interest rate curves
     std::vector<std::shared_ptr<Curve1D>> vol_curves;  // Vector of shared pointers for volatility curves
     std::vector<double> state;  // Current state of the model, one for each dimension
     const std::vector<double> initial_values;  // Initial values for each dimension
     double current_time;  // Current time of the process
+    std::vector<double> exponents;  // Scratch space for evolveBatch
+
+    // Drift and diffusion scale of every step of the time grid, with the dimension varying fastest.
+    // Immutable once built, so clones share it.
+    struct StepTable {
+        std::vector<double> step_sizes;
+        std::vector<double> start_times;  // Time at the start of each step, accumulated as evolve() does
+        std::vector<double> drift;
+        std::vector<double> vol_sqrt_dt;
+    };
+    std::vector<double> time_grid;  // Step sizes given to setTimeGrid
+    std::shared_ptr<const StepTable> step_table;  // Built lazily from time_grid; dropped when a curve is swapped
+    size_t step_index;  // Number of steps taken since the last reset
+    std::vector<double> step_drift, step_vol_sqrt_dt;  // Coefficients of steps that are not on the grid
+    std::vector<CurveCursor> r_cursors, vol_cursors;  // Lookup positions in the curves, rewound on reset
+
+    // Coefficients of the step over [t0, t0 + dt] under the current scheme
+    void computeCoefficients(size_t i, double t0, double dt, CurveCursor& r_cursor, CurveCursor& vol_cursor,
+                             double& drift, double& vol_sqrt_dt) const {
+        const double t1 = t0 + dt;
+        if (scheme == StepScheme::Exact) {
+            const double variance = vol_curves[i]->integralOfSquare(t0, t1);
+            drift = r_curves[i]->integral(t0, t1) - 0.5 * variance;
+            vol_sqrt_dt = std::sqrt(variance);
+        }
+        else {
+            double r_t = (*r_curves[i])(t1, r_cursor);
+            double vol_t = (*vol_curves[i])(t1, vol_cursor);
+            drift = (r_t - 0.5 * vol_t * vol_t) * dt;
+            vol_sqrt_dt = vol_t * std::sqrt(dt);
+        }
+    }
+
+    void buildStepTable() {
+        std::shared_ptr<StepTable> table = std::make_shared<StepTable>();
+        const size_t n = r_curves.size();
+        table->step_sizes = time_grid;
+        table->start_times.resize(time_grid.size());
+        table->drift.resize(time_grid.size() * n);
+        table->vol_sqrt_dt.resize(time_grid.size() * n);
+
+        // Accumulate the time exactly as evolve() does, so that the cached coefficients are identical
+        std::vector<CurveCursor> r_pos(n), vol_pos(n);
+        double t = 0.0;
+        for (size_t k = 0; k < time_grid.size(); ++k) {
+            const double dt = time_grid[k];
+            table->start_times[k] = t;
+            for (size_t i = 0; i < n; ++i) {
+                computeCoefficients(i, t, dt, r_pos[i], vol_pos[i], table->drift[k * n + i], table->vol_sqrt_dt[k * n + i]);
+            }
+            t += dt;
+        }
+        step_table = table;
+    }
+
+    // Points drift and vol_sqrt_dt at the coefficients of the step of size dt starting at t0: a row of the
+    // step table if the step is the next one on the time grid, starting where that grid step starts,
+    // otherwise values computed from the curves. After an off-grid step the start times no longer match,
+    // so later steps of the same size are not mistaken for grid steps.
+    void stepCoefficients(double t0, double dt, const double*& drift, const double*& vol_sqrt_dt) {
+        if (!step_table && !time_grid.empty()) {
+            buildStepTable();
+        }
+        if (step_table && step_index < step_table->step_sizes.size() && dt == step_table->step_sizes[step_index] &&
+            t0 == step_table->start_times[step_index]) {
+            drift = &step_table->drift[step_index * r_curves.size()];
+            vol_sqrt_dt = &step_table->vol_sqrt_dt[step_index * r_curves.size()];
+            return;
+        }
+        step_drift.resize(r_curves.size());
+        step_vol_sqrt_dt.resize(r_curves.size());
+        for (size_t i = 0; i < r_curves.size(); ++i) {
+            computeCoefficients(i, t0, dt, r_cursors[i], vol_cursors[i], step_drift[i], step_vol_sqrt_dt[i]);
+        }
+        drift = step_drift.data();
+        vol_sqrt_dt = step_vol_sqrt_dt.data();
+    }
 
 public:
     // Constructor takes vectors of curves and initial values for multi-dimensional support
     LogNormalProcess(const std::vector<std::shared_ptr<Curve1D>>& r, const std::vector<std::shared_ptr<Curve1D>>& vol, const std::vector<double>& _initial_values)
-        : r_curves(r), vol_curves(vol), initial_values(_initial_values), state(_initial_values), current_time(0.0) {
+        : scheme(StepScheme::Exact), r_curves(r), vol_curves(vol), initial_values(_initial_values), state(_initial_values), current_time(0.0), step_index(0),
+          r_cursors(r.size()), vol_cursors(vol.size()) {
         if (r_curves.size() != vol_curves.size() || r_curves.size() != initial_values.size()) {
             throw std::invalid_argument("All vectors must have the same size.");
         }
@@ -100,6 +317,32 @@ public:
     void reset() override {
         state = initial_values;  // Reset state to initial values
         current_time = 0.0;  // Reset time
+        step_index = 0;
+        r_cursors.assign(r_cursors.size(), CurveCursor());
+        vol_cursors.assign(vol_cursors.size(), CurveCursor());
+    }
+
+    void setTimeGrid(const std::vector<double>& step_sizes) override {
+        time_grid = step_sizes;
+        step_table.reset();
+    }
+
+    void setStepScheme(StepScheme _scheme) {
+        scheme = _scheme;
+        step_table.reset();
+    }
+
+    // Swapping a curve invalidates the step table, which is rebuilt on the next step
+    void setRateCurve(size_t i, const std::shared_ptr<Curve1D>& curve) {
+        if (!curve) throw std::invalid_argument("Interest rate curves cannot be null.");
+        r_curves.at(i) = curve;
+        step_table.reset();
+    }
+
+    void setVolCurve(size_t i, const std::shared_ptr<Curve1D>& curve) {
+        if (!curve) throw std::invalid_argument("Volatility curves cannot be null.");
+        vol_curves.at(i) = curve;
+        step_table.reset();
     }
 
     void evolve(double dt, const std::vector<double>& normals) override {
@@ -107,15 +350,15 @@ public:
             throw std::invalid_argument("Normal vector size must match the number of dimensions.");
         }
 
+        const double* drift;
+        const double* vol_sqrt_dt;
+        stepCoefficients(current_time, dt, drift, vol_sqrt_dt);
         current_time += dt;
+        ++step_index;
 
         for (size_t i = 0; i < state.size(); ++i) {
-            double r_t = (*r_curves[i])(current_time);  // Interest rate for the current dimension
-            double vol_t = (*vol_curves[i])(current_time);  // Volatility for the current dimension
-
-            double drift = (r_t - 0.5 * vol_t * vol_t) * dt;
-            double diffusion = vol_t * std::sqrt(dt) * normals[i];
-            double S_t_plus_dt = state[i] * std::exp(drift + diffusion);
+            double diffusion = vol_sqrt_dt[i] * normals[i];
+            double S_t_plus_dt = state[i] * std::exp(drift[i] + diffusion);
 
             state[i] = S_t_plus_dt;  // Update state for this dimension
         }
@@ -124,6 +367,47 @@ public:
     const std::vector<double>& getState() const override {
         return state;
     }
+
+    void resetBatch(double* batch_state, int n_paths) override {
+        for (size_t i = 0; i < initial_values.size(); ++i) {
+            std::fill(batch_state + i * n_paths, batch_state + (i + 1) * n_paths, initial_values[i]);
+        }
+        current_time = 0.0;
+        step_index = 0;
+        r_cursors.assign(r_cursors.size(), CurveCursor());
+        vol_cursors.assign(vol_cursors.size(), CurveCursor());
+    }
+
+    // The step coefficients are looked up once per step for the whole batch, and the exponentials are
+    // computed with the vectorized kernel, which agrees with std::exp to within 1 ulp
+    void evolveBatch(double dt, const double* normals, double* batch_state, int n_paths) override {
+        const double* drift;
+        const double* vol_sqrt_dt;
+        stepCoefficients(current_time, dt, drift, vol_sqrt_dt);
+        current_time += dt;
+        ++step_index;
+        exponents.resize(n_paths);
+        double* x = exponents.data();
+
+        for (size_t i = 0; i < initial_values.size(); ++i) {
+            const double drift_i = drift[i];
+            const double vol_sqrt_dt_i = vol_sqrt_dt[i];
+            const double* z = normals + i * n_paths;
+            double* S = batch_state + i * n_paths;
+
+            for (int p = 0; p < n_paths; ++p) {
+                x[p] = drift_i + vol_sqrt_dt_i * z[p];
+            }
+            vectorExp(x, x, n_paths);
+            for (int p = 0; p < n_paths; ++p) {
+                S[p] *= x[p];
+            }
+        }
+    }
+
+    std::unique_ptr<Model> clone() const override {
+        return std::unique_ptr<Model>(new LogNormalProcess(*this));  // Curves are immutable and stay shared
+    }
 };
 
 // write trade base class with evolve(t, state) and payoff() methods, write implementation of this base class AsianOption with start time and end time
@@ -140,31 +424,78 @@ public:
     virtual double payoff() const = 0;
 
     virtual void reset() {}  // Virtual method to reset the trade to its initial state
+
+    // Virtual method returning the sorted dates at which the trade needs the model state, given the
+    // monitoring grid of the simulation. The engine only stops on the union of the dates of all trades
+    // and calls evolve() on each of them, so trades must ignore dates they did not ask for. By default
+    // the trade observes every grid date.
+    virtual std::vector<double> observationDates(const std::vector<double>& grid) {
+        return grid;
+    }
+
+    // Pure virtual method returning an independent copy, so that worker threads can evolve their own paths
+    virtual std::unique_ptr<Trade> clone() const = 0;
 };
 
-class AsianOption : public Trade {
+class AsianOption final : public Trade {
 private:
     const int asset_id;                    // ID of the underlying asset
     const double strike;                   // Strike price of the option
     const double start_time, end_time;     // Start and end times for averaging
+    std::shared_ptr<const std::vector<double>> fixings;  // Averaging dates, if known; shared by copies
+    size_t next_fixing;              // Index of the next fixing to record
     double sum_prices;               // Sum of prices for averaging
     int count;                       // Count of prices added
 
 public:
+    // Averages over every monitoring date in [start, end]
     AsianOption(int asset_id, double strike, double start, double end)
         : asset_id(asset_id), strike(strike), start_time(start), end_time(end)
     {
         reset();
     }
 
+    // Averages over the given fixing dates, e.g. monthly
+    AsianOption(int asset_id, double strike, const std::vector<double>& fixing_dates)
+        : asset_id(asset_id), strike(strike),
+          start_time(fixing_dates.empty() ? 0.0 : fixing_dates.front()),
+          end_time(fixing_dates.empty() ? 0.0 : fixing_dates.back())
+    {
+        std::vector<double> dates(fixing_dates);
+        std::sort(dates.begin(), dates.end());
+        dates.erase(std::unique(dates.begin(), dates.end()), dates.end());
+        fixings = std::make_shared<const std::vector<double>>(dates);
+        reset();
+    }
+
     void reset() override {
+        next_fixing = 0;
         sum_prices = 0.0;
         count = 0;
     }
 
-    // Record the price only if it's within the averaging period
+    // A window option fixes on the grid dates inside its averaging period
+    std::vector<double> observationDates(const std::vector<double>& grid) override {
+        if (!fixings || fixings->empty()) {
+            std::vector<double> dates;
+            for (double t : grid) {
+                if (t >= start_time && t <= end_time) dates.push_back(t);
+            }
+            fixings = std::make_shared<const std::vector<double>>(dates);
+        }
+        return *fixings;
+    }
+
+    // Record the price only on a fixing date, or, if the dates were never resolved, within the averaging period
     void evolve(double t, const std::vector<double>& state) override {
-        if (t >= start_time && t <= end_time) {
+        if (fixings) {
+            if (next_fixing < fixings->size() && t == (*fixings)[next_fixing]) {
+                sum_prices += state[asset_id];
+                count++;
+                next_fixing++;
+            }
+        }
+        else if (t >= start_time && t <= end_time) {
             double price = state[asset_id];
             sum_prices += price;
             count++;
@@ -177,16 +508,510 @@ public:
         double average_price = sum_prices / count;
         return std::max(average_price - strike, 0.0);  // Payoff for a call option
     }
+
+    std::unique_ptr<Trade> clone() const override {
+        return std::unique_ptr<Trade>(new AsianOption(*this));
+    }
+};
+
+// Book of trades dispatched through the virtual Trade interface. Copies clone the trades, so every
+// copy can be evolved along its own path.
+class TradeList {
+private:
+    std::vector<std::unique_ptr<Trade>> trades;
+
+public:
+    explicit TradeList(const std::vector<std::shared_ptr<Trade>>& book) {
+        for (auto& trade : book) {
+            if (!trade) throw std::invalid_argument("Trades cannot be null.");
+            trades.push_back(trade->clone());
+        }
+    }
+
+    TradeList(const TradeList& other) {
+        for (auto& trade : other.trades) trades.push_back(trade->clone());
+    }
+
+    size_t size() const {
+        return trades.size();
+    }
+
+    void reset() {
+        for (auto& trade : trades) trade->reset();
+    }
+
+    void evolve(double t, const std::vector<double>& state) {
+        for (auto& trade : trades) trade->evolve(t, state);
+    }
+
+    // Appends the observation dates of every trade
+    void observationDates(const std::vector<double>& grid, std::vector<double>& dates) {
+        for (auto& trade : trades) {
+            std::vector<double> trade_dates = trade->observationDates(grid);
+            dates.insert(dates.end(), trade_dates.begin(), trade_dates.end());
+        }
+    }
+
+    // Writes the payoff of every trade, in the order given
+    void payoffs(double* out) const {
+        for (size_t k = 0; k < trades.size(); ++k) out[k] = trades[k]->payoff();
+    }
+};
+
+namespace detail {
+
+// Position of T in the type list Ts
+template <typename T, typename... Ts> struct TypeIndex;
+template <typename T, typename... Ts> struct TypeIndex<T, T, Ts...> {
+    static const size_t value = 0;
+};
+template <typename T, typename U, typename... Ts> struct TypeIndex<T, U, Ts...> {
+    static const size_t value = 1 + TypeIndex<T, Ts...>::value;
+};
+
+} // namespace detail
+
+// Book of trades whose types are fixed at compile time. The trades of each type are stored by value
+// in their own contiguous vector and called through their concrete type, so there are no virtual
+// calls and the compiler can inline the trade logic into the loop over trades. Offers the same
+// reset/evolve/payoff operations as Trade, applied to every trade in the book; trades are ordered
+// by type, in the order of TradeTypes, then in the order they were added.
+template <typename... TradeTypes>
+class Portfolio {
+private:
+    typedef std::tuple<std::vector<TradeTypes>...> Storage;
+    Storage trades;
+
+    static const size_t num_types = sizeof...(TradeTypes);
+
+    template <size_t I>
+    using TradeType = typename std::tuple_element<I, Storage>::type::value_type;
+
+    template <size_t I>
+    typename std::enable_if<I == num_types, size_t>::type countFrom() const {
+        return 0;
+    }
+
+    template <size_t I>
+    typename std::enable_if<(I < num_types), size_t>::type countFrom() const {
+        return std::get<I>(trades).size() + countFrom<I + 1>();
+    }
+
+    template <size_t I>
+    typename std::enable_if<I == num_types>::type resetFrom() {}
+
+    template <size_t I>
+    typename std::enable_if<(I < num_types)>::type resetFrom() {
+        typedef TradeType<I> T;
+        for (auto& trade : std::get<I>(trades)) trade.T::reset();
+        resetFrom<I + 1>();
+    }
+
+    template <size_t I>
+    typename std::enable_if<I == num_types>::type evolveFrom(double t, const std::vector<double>& state) {}
+
+    template <size_t I>
+    typename std::enable_if<(I < num_types)>::type evolveFrom(double t, const std::vector<double>& state) {
+        typedef TradeType<I> T;
+        for (auto& trade : std::get<I>(trades)) trade.T::evolve(t, state);
+        evolveFrom<I + 1>(t, state);
+    }
+
+    template <size_t I>
+    typename std::enable_if<I == num_types>::type datesFrom(const std::vector<double>& grid, std::vector<double>& dates) {}
+
+    template <size_t I>
+    typename std::enable_if<(I < num_types)>::type datesFrom(const std::vector<double>& grid, std::vector<double>& dates) {
+        typedef TradeType<I> T;
+        for (auto& trade : std::get<I>(trades)) {
+            std::vector<double> trade_dates = trade.T::observationDates(grid);
+            dates.insert(dates.end(), trade_dates.begin(), trade_dates.end());
+        }
+        datesFrom<I + 1>(grid, dates);
+    }
+
+    template <size_t I>
+    typename std::enable_if<I == num_types>::type payoffsFrom(double* out) const {}
+
+    template <size_t I>
+    typename std::enable_if<(I < num_types)>::type payoffsFrom(double* out) const {
+        typedef TradeType<I> T;
+        for (auto& trade : std::get<I>(trades)) *out++ = trade.T::payoff();
+        payoffsFrom<I + 1>(out);
+    }
+
+public:
+    template <typename T>
+    void add(const T& trade) {
+        std::get<detail::TypeIndex<T, TradeTypes...>::value>(trades).push_back(trade);
+    }
+
+    // The trades of type T, in the order they were added
+    template <typename T>
+    const std::vector<T>& get() const {
+        return std::get<detail::TypeIndex<T, TradeTypes...>::value>(trades);
+    }
+
+    size_t size() const {
+        return countFrom<0>();
+    }
+
+    void reset() {
+        resetFrom<0>();
+    }
+
+    void evolve(double t, const std::vector<double>& state) {
+        evolveFrom<0>(t, state);
+    }
+
+    // Appends the observation dates of every trade
+    void observationDates(const std::vector<double>& grid, std::vector<double>& dates) {
+        datesFrom<0>(grid, dates);
+    }
+
+    // Writes the payoff of every trade, in portfolio order
+    void payoffs(double* out) const {
+        payoffsFrom<0>(out);
+    }
+
+    // Total payoff of the book
+    double payoff() const {
+        std::vector<double> values(size());
+        payoffs(values.data());
+        return std::accumulate(values.begin(), values.end(), 0.0);
+    }
+};
+
+// Supplier of the standard normals that drive the paths, one batch at a time. The engine calls
+// setup() once per pricing, on a prototype that is then cloned for every worker thread, and
+// startBatch() before evolving the paths of a batch; fillStep() then returns the normals of each
+// step in the layout of Model::evolveBatch(). The normals of a path must depend only on its index,
+// not on how the paths are batched or on which thread runs them.
+class NormalSource {
+public:
+    virtual ~NormalSource() {}  // Virtual destructor for safe polymorphic use
+
+    // Pure virtual method announcing the model dimension and the step sizes of the simulation
+    virtual void setup(int dims, const std::vector<double>& step_sizes) = 0;
+
+    // Pure virtual method preparing the normals of paths [first_path, first_path + n_paths)
+    virtual void startBatch(std::uint64_t first_path, int n_paths) = 0;
+
+    // Pure virtual method writing the normals of one step of the current batch, dimension-major
+    virtual void fillStep(int step, double* normals) = 0;
+
+    // Pure virtual method returning an independent copy for a worker thread
+    virtual std::unique_ptr<NormalSource> clone() const = 0;
+};
+
+// Pseudo-random normals from the counter-based generator, drawn step by step
+class PseudoRandomNormals : public NormalSource {
+private:
+    const NormalGenerator rng;
+    int dims;
+    std::uint64_t first_path;
+    int n_paths;
+
+public:
+    explicit PseudoRandomNormals(std::uint64_t seed = 17) : rng(seed), dims(0), first_path(0), n_paths(0) {}
+
+    void setup(int _dims, const std::vector<double>& step_sizes) override {
+        dims = _dims;
+    }
+
+    void startBatch(std::uint64_t _first_path, int _n_paths) override {
+        first_path = _first_path;
+        n_paths = _n_paths;
+    }
+
+    void fillStep(int step, double* normals) override {
+        rng.fillBatch(first_path, n_paths, step, dims, normals);
+    }
+
+    std::unique_ptr<NormalSource> clone() const override {
+        return std::unique_ptr<NormalSource>(new PseudoRandomNormals(*this));
+    }
+};
+
+// Quasi-random normals: point number `path` of a digital sequence of dimension dims * num_steps is
+// mapped to normals and turned into a path by a Brownian bridge per model dimension. Coordinate
+// k * dims + i feeds bridge normal k of dimension i, so the first, best distributed coordinates fix
+// the terminal values and the coarse shape of every dimension. The whole batch is built in
+// startBatch(), which needs dims * num_steps * n_paths doubles. With scrambling on, every seed gives
+// an independent randomized QMC estimate, so the error can be measured over a handful of seeds.
+class QuasiBridgeNormals : public NormalSource {
+private:
+    const bool scramble;
+    const std::uint64_t seed;
+    int dims, num_steps, n_paths;
+    std::shared_ptr<const DigitalSequence> prototype;  // Sequence at point 0, shared by the clones
+    std::shared_ptr<const BrownianBridge> bridge;
+    std::unique_ptr<DigitalSequence> sequence;
+    std::vector<double> point, uniforms, normals;  // Scratch point, and the batch in bridge and in time order
+
+public:
+    explicit QuasiBridgeNormals(bool scramble = false, std::uint64_t seed = 17)
+        : scramble(scramble), seed(seed), dims(0), num_steps(0), n_paths(0) {}
+
+    QuasiBridgeNormals(const QuasiBridgeNormals& other)
+        : scramble(other.scramble), seed(other.seed), dims(other.dims), num_steps(other.num_steps), n_paths(0),
+          prototype(other.prototype), bridge(other.bridge) {}
+
+    void setup(int _dims, const std::vector<double>& step_sizes) override {
+        dims = _dims;
+        num_steps = static_cast<int>(step_sizes.size());
+        prototype = std::make_shared<DigitalSequence>(dims * num_steps, scramble, seed);
+        bridge = std::make_shared<BrownianBridge>(step_sizes);
+        sequence.reset();
+    }
+
+    void startBatch(std::uint64_t first_path, int _n_paths) override {
+        if (!prototype) throw std::logic_error("QuasiBridgeNormals used before setup().");
+        if (!sequence) sequence.reset(new DigitalSequence(*prototype));
+        n_paths = _n_paths;
+        const int point_dims = dims * num_steps;
+        point.resize(point_dims);
+        uniforms.resize(static_cast<size_t>(point_dims) * n_paths);
+        normals.resize(uniforms.size());
+
+        // Points are generated one at a time and scattered so that coordinate c of path p is at c * n_paths + p
+        if (sequence->index() != first_path) sequence->skipTo(first_path);
+        for (int p = 0; p < n_paths; ++p) {
+            sequence->next(point.data());
+            for (int c = 0; c < point_dims; ++c) uniforms[static_cast<size_t>(c) * n_paths + p] = point[c];
+        }
+        NormalGenerator::toNormals(uniforms.data(), static_cast<int>(uniforms.size()));
+
+        // Bridge normal k of dimension i is coordinate k * dims + i, and the increment of step k goes to
+        // row k * dims + i, which makes each step a contiguous dimension-major block
+        const int stride = dims * n_paths;
+        for (int i = 0; i < dims; ++i) {
+            bridge->transform(uniforms.data() + i * n_paths, stride, normals.data() + i * n_paths, stride, n_paths);
+        }
+    }
+
+    void fillStep(int step, double* out) override {
+        const double* block = normals.data() + static_cast<size_t>(step) * dims * n_paths;
+        std::copy(block, block + dims * n_paths, out);
+    }
+
+    std::unique_ptr<NormalSource> clone() const override {
+        return std::unique_ptr<NormalSource>(new QuasiBridgeNormals(*this));
+    }
 };
 
-int main() {
+// Monte Carlo pricer running the paths on a thread pool. The paths are split
+// into fixed-size batches that are evolved together through the model's
+// structure-of-arrays interface; every worker owns a private clone of the
+// model and one copy of the book per path slot. Books are either a list of
+// virtual trades or a statically dispatched Portfolio. The normals come from a
+// NormalSource that addresses them by path index (by default the
+// counter-based generator), and the per-batch payoff sums are merged in
+// batch order, so the prices are bit-identical whatever the thread count.
+
+class MonteCarloEngine {
+private:
+    // Per-thread scratch data, reused for every batch the thread runs
+    template <typename Book>
+    struct Workspace {
+        std::unique_ptr<Model> model;
+        std::vector<Book> books;                   // One copy of the book per path slot
+        std::vector<double> payoffs;               // Payoffs of one book
+        std::vector<double> state;                 // Batch state, dimension-major
+        std::vector<double> normals;               // Batch normals, dimension-major
+        std::vector<double> path_state;            // State of a single path, as seen by the trades
+        std::unique_ptr<NormalSource> normal_source;
+    };
+
+    ThreadPool pool;
+    const int batch_size;     // Number of paths per batch
+    std::shared_ptr<const NormalSource> normal_source;  // Prototype of the workers' normal sources
+
+public:
+    MonteCarloEngine(int num_threads = 0, int batch_size = 256, unsigned int seed = 17)
+        : pool(num_threads), batch_size(batch_size), normal_source(std::make_shared<PseudoRandomNormals>(seed)) {
+        if (batch_size <= 0) {
+            throw std::invalid_argument("Batch size must be positive.");
+        }
+    }
+
+    int numThreads() const {
+        return pool.size();
+    }
+
+    // Replaces the pseudo-random normals, e.g. with QuasiBridgeNormals
+    void setNormalSource(const std::shared_ptr<const NormalSource>& source) {
+        if (!source) throw std::invalid_argument("Normal source cannot be null.");
+        normal_source = source;
+    }
+
+    // Returns the Monte Carlo price of every trade, in the order given
+    std::vector<double> price(const Model& model, const std::vector<std::shared_ptr<Trade>>& trades,
+                              int num_paths, int num_steps, double dt) {
+        return simulate(model, TradeList(trades), 0.0, num_paths, num_paths, num_steps, dt, false).prices;
+    }
+
+    // Returns the Monte Carlo price of every trade of the portfolio, in portfolio order; the trades are
+    // called without virtual dispatch
+    template <typename... TradeTypes>
+    std::vector<double> price(const Model& model, const Portfolio<TradeTypes...>& portfolio,
+                              int num_paths, int num_steps, double dt) {
+        return simulate(model, portfolio, 0.0, num_paths, num_paths, num_steps, dt, false).prices;
+    }
+
+    // Prices, standard errors and payoff statistics of an adaptive simulation
+    struct PricingResult {
+        std::vector<double> prices;
+        std::vector<double> standard_errors;
+        RunningStatistics statistics;  // Mean, variance and, if requested, covariance of the trades' payoffs
+        int num_paths;                 // Number of paths simulated
+        bool converged;                // Whether every standard error reached the tolerance
+    };
+
+    // Simulates rounds of paths until the standard error of every trade is at most tolerance, or
+    // max_paths paths have been run. The first round has min_paths paths; each further round is sized
+    // from the observed variances, at most quadrupling the path count. Rounds are whole numbers of
+    // batches and the stopping decision depends only on the merged statistics, so the result is
+    // independent of the number of threads. The standard errors assume independent paths, which does
+    // not hold for quasi-random points. The payoff covariance costs O(trades^2) per path and is only
+    // accumulated on request.
+    PricingResult priceToTolerance(const Model& model, const std::vector<std::shared_ptr<Trade>>& trades, double tolerance,
+                                   int max_paths, int num_steps, double dt, int min_paths = 1024, bool covariance = false) {
+        return simulate(model, TradeList(trades), tolerance, min_paths, max_paths, num_steps, dt, covariance);
+    }
+
+    template <typename... TradeTypes>
+    PricingResult priceToTolerance(const Model& model, const Portfolio<TradeTypes...>& portfolio, double tolerance,
+                                   int max_paths, int num_steps, double dt, int min_paths = 1024, bool covariance = false) {
+        return simulate(model, portfolio, tolerance, min_paths, max_paths, num_steps, dt, covariance);
+    }
+
+private:
+    // Simulation loop shared by all book types. Book must be copyable, with size(), reset(),
+    // evolve(t, state), observationDates(grid, dates) and payoffs(out) applying to all of its trades.
+    //
+    // The monitoring grid is t_k = k dt for k = 1..num_steps, but the paths only stop on the union of the
+    // trades' observation dates: the model jumps straight from one event date to the next, with normals
+    // indexed by event number, and the trades see the state at each event date.
+    template <typename Book>
+    PricingResult simulate(const Model& model, const Book& book, double tolerance, int min_paths, int max_paths,
+                           int num_steps, double dt, bool covariance) {
+        if (min_paths <= 0 || max_paths <= 0 || num_steps <= 0) {
+            throw std::invalid_argument("Number of paths and steps must be positive.");
+        }
+        const size_t num_trades = book.size();
+        const int dims = model.dims();
+
+        // Union of the observation dates
+        std::vector<double> grid(num_steps);
+        for (int k = 0; k < num_steps; ++k) grid[k] = (k + 1) * dt;
+        Book prototype_book(book);
+        std::vector<double> schedule;
+        prototype_book.observationDates(grid, schedule);
+        std::sort(schedule.begin(), schedule.end());
+        schedule.erase(std::unique(schedule.begin(), schedule.end()), schedule.end());
+        if (!schedule.empty() && schedule.front() <= 0.0) {
+            throw std::invalid_argument("Observation dates must be positive.");
+        }
+        const int num_events = static_cast<int>(schedule.size());
+        std::vector<double> step_sizes(num_events);
+        for (int j = 0; j < num_events; ++j) step_sizes[j] = schedule[j] - (j == 0 ? 0.0 : schedule[j - 1]);
+
+        // The workers' models are cloned from one that knows the time grid, so they share its step table
+        std::unique_ptr<Model> prototype = model.clone();
+        prototype->setTimeGrid(step_sizes);
+        std::unique_ptr<NormalSource> source = normal_source->clone();
+        if (num_events > 0) source->setup(dims, step_sizes);
+
+        std::vector<Workspace<Book>> workspaces(pool.size());
+        for (auto& ws : workspaces) {
+            ws.model = prototype->clone();
+            ws.books.reserve(batch_size);
+            for (int p = 0; p < batch_size; ++p) ws.books.push_back(prototype_book);
+            ws.payoffs.resize(num_trades);
+            ws.state.resize(dims * batch_size);
+            ws.normals.resize(dims * batch_size);
+            ws.path_state.resize(dims);
+            ws.normal_source = source->clone();
+        }
+
+        PricingResult result;
+        result.statistics = RunningStatistics(num_trades, covariance);
+        result.num_paths = 0;
+        // Rounds end on batch boundaries, except at max_paths
+        int target = std::min(static_cast<int>((static_cast<long long>(min_paths) + batch_size - 1) / batch_size * batch_size), max_paths);
+
+        for (;;) {
+            // Payoff statistics of each batch of the round, merged in batch order
+            const int first_batch = result.num_paths / batch_size;
+            const int num_batches = (target - result.num_paths + batch_size - 1) / batch_size;
+            std::vector<RunningStatistics> batch_stats(num_batches, RunningStatistics(num_trades, covariance));
+            const int round_end = target;
+
+            pool.parallelFor(num_batches, [&](int task, int worker) {
+                Workspace<Book>& ws = workspaces[worker];
+                RunningStatistics& stats = batch_stats[task];
+
+                const int first_path = (first_batch + task) * batch_size;
+                const int n = std::min(round_end - first_path, batch_size);
+
+                ws.model->resetBatch(ws.state.data(), n);
+                for (int p = 0; p < n; ++p) ws.books[p].reset();
+                if (num_events > 0) ws.normal_source->startBatch(first_path, n);
+
+                for (int event = 0; event < num_events; ++event) {
+                    ws.normal_source->fillStep(event, ws.normals.data());
+                    ws.model->evolveBatch(step_sizes[event], ws.normals.data(), ws.state.data(), n);
+
+                    for (int p = 0; p < n; ++p) {
+                        for (int i = 0; i < dims; ++i) ws.path_state[i] = ws.state[i * n + p];
+                        ws.books[p].evolve(schedule[event], ws.path_state);
+                    }
+                }
+
+                for (int p = 0; p < n; ++p) {
+                    ws.books[p].payoffs(ws.payoffs.data());
+                    stats.add(ws.payoffs.data());
+                }
+            });
+
+            for (auto& stats : batch_stats) result.statistics.merge(stats);
+            result.num_paths = target;
+
+            // Paths needed for the worst trade at the observed variance
+            double needed = 0.0;
+            for (size_t k = 0; k < num_trades; ++k) {
+                const double se = result.statistics.standardError(k);
+                if (se > tolerance) needed = std::max(needed, target * (se / tolerance) * (se / tolerance));
+            }
+            result.converged = needed == 0.0;
+            if (result.converged || target >= max_paths) break;
+
+            // Grow to the estimate plus 5%, in whole batches, by at most 4x per round
+            const double next = std::min(1.05 * needed, 4.0 * target);
+            const double batches = std::max(std::ceil(next / batch_size), target / batch_size + 1.0);
+            target = static_cast<int>(std::min(static_cast<double>(max_paths), batches * batch_size));
+        }
+
+        result.prices.resize(num_trades);
+        result.standard_errors.resize(num_trades);
+        for (size_t k = 0; k < num_trades; ++k) {
+            result.prices[k] = result.statistics.mean(k);
+            result.standard_errors[k] = result.statistics.standardError(k);
+        }
+        return result;
+    }
+};
+
+int main(int argc, char* argv[]) {
     // Define constants for the simulation
-    const int num_paths = 10000;
+    const double target_error = 0.05;  // Standard error to reach on every price
+    const int max_paths = 1000000;  // Path cap of the adaptive simulation
+    const int quasi_paths = 10000;  // Fixed path count with quasi-random points, whose error the path variance does not measure
     const int num_days = 252;  // Assume 252 trading days in a year
     const double dt = 1.0 / num_days;  // Time step for each day
-    // Random number generator setup
-    std::mt19937 rng(std::random_device{}());
-    std::normal_distribution<double> dist(0.0, 1.0);
+    const int num_threads = argc > 1 ? std::atoi(argv[1]) : 0;  // Default to one thread per core
+    const bool use_quasi = argc > 2 && std::string(argv[2]) == "quasi";  // Scrambled quasi-random points with a Brownian bridge
 
     // Define time points and corresponding rates and volatilities (weekly for a year)
     std::vector<double> time_points;
@@ -220,40 +1045,31 @@ int main() {
     LogNormalProcess model(r_curves, vol_curves, initial_values);
 
     // Define two Asian options
-    AsianOption option1(0, 100.0, 0.0, 1.0);  // Asian option on the first asset
-    AsianOption option2(1, 100.0, 0.25, 0.75);  // Asian option on the second asset
+    Portfolio<AsianOption> trades;
+    trades.add(AsianOption(0, 100.0, 0.0, 1.0));   // Asian option on the first asset
+    trades.add(AsianOption(1, 100.0, 0.25, 0.75));  // Asian option on the second asset
 
     // Running the Monte Carlo simulation
-    double total_payoff1 = 0.0;
-    double total_payoff2 = 0.0;
-
-    for (int i = 0; i < num_paths; ++i) {
-        model.reset();  // Reset the model to initial values
-        option1.reset();
-        option2.reset();
+    MonteCarloEngine engine(num_threads);
+    if (use_quasi) engine.setNormalSource(std::make_shared<QuasiBridgeNormals>(true));
+    if (use_quasi) {
+        std::vector<double> prices = engine.price(model, trades, quasi_paths, num_days, dt);
 
-        for (int day = 0; day < num_days; ++day) {
-            double current_time = day * dt;
-            std::vector<double> normals = {dist(rng), dist(rng)};
-            model.evolve(dt, normals);
-            const std::vector<double>& state = model.getState();
+        // Output the results
+        std::cout << "Price of Asian Option 1: " << prices[0] << std::endl;
+        std::cout << "Price of Asian Option 2: " << prices[1] << std::endl;
+    }
+    else {
+        MonteCarloEngine::PricingResult result = engine.priceToTolerance(model, trades, target_error, max_paths, num_days, dt);
 
-            option1.evolve(current_time, state);
-            option2.evolve(current_time, state);
+        // Output the results
+        for (size_t k = 0; k < result.prices.size(); ++k) {
+            std::cout << "Price of Asian Option " << k + 1 << ": " << result.prices[k]
+                      << " (standard error " << result.standard_errors[k] << ")" << std::endl;
         }
-
-        total_payoff1 += option1.payoff();
-        total_payoff2 += option2.payoff();
+        std::cout << "Paths: " << result.num_paths << (result.converged ? "" : " (path cap reached)") << std::endl;
     }
 
-    // Calculate the average payoff for each option
-    double price1 = total_payoff1 / num_paths;
-    double price2 = total_payoff2 / num_paths;
-
-    // Output the results
-    std::cout << "Price of Asian Option 1: " << price1 << std::endl;
-    std::cout << "Price of Asian Option 2: " << price2 << std::endl;
-
 
     // We want to see dprice[i]/drates[j] and dprice[i]/dvols[j]
     // 
@@ -266,4 +1082,3 @@ int main() {
 
     return 0;
 }
-
@@ -0,0 +1,303 @@
+#ifndef MC_DIGITAL_SEQUENCE_H
+#define MC_DIGITAL_SEQUENCE_H
+
+#include <cmath>
+#include <cstdint>
+#include <istream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "JoeKuoDirections.h"
+
+// Base-2 digital sequence generated by Sobol's recurrence, with Gray-code
+// stepping and optional scrambling, plus the Brownian-bridge construction
+// that assigns its best coordinates to the coarse structure of a path.
+//
+// Dimension 0 is the van der Corput sequence. The other dimensions take their
+// primitive polynomials and initial direction numbers from Joe and Kuo's
+// new-joe-kuo-6.21201 (mc/JoeKuoDirections.h), which were chosen for the
+// uniformity of the two-dimensional projections, so the built-in sequence is
+// Sobol's sequence up to joe_kuo::max_dims dimensions. Beyond that, read the
+// full file, or another table in its format, with the istream constructor.
+//
+// Without scrambling the sequence starts at point 1, since point 0 is the
+// origin and would put every coordinate of the first path in the far tail.
+
+class DigitalSequence {
+public:
+    static const int bits = 32;  // Points are 32-bit fractions, so up to 2^32 of them
+
+    // Initial direction numbers of one dimension: degree s and coefficients a of its primitive polynomial
+    // x^s + a_1 x^(s-1) + ... + a_(s-1) x + 1 (a_1 is the most significant bit of a), and m_1..m_s
+    struct Initialization {
+        int degree;
+        std::uint32_t coefficients;
+        std::vector<std::uint32_t> m;
+    };
+
+    // Joe and Kuo's direction numbers, for up to joe_kuo::max_dims dimensions. With scramble set, the
+    // direction numbers get a random left matrix scramble and the points a random digital shift, both
+    // drawn from seed (Matousek, 1998).
+    explicit DigitalSequence(int dims, bool scramble = false, std::uint64_t seed = 0) {
+        if (dims <= 0) throw std::invalid_argument("Sequence dimension must be positive.");
+        if (dims > joe_kuo::max_dims) {
+            throw std::invalid_argument("Too many dimensions for the built-in Sobol direction numbers: "
+                                        "read them from a file instead.");
+        }
+        std::vector<Initialization> init(dims - 1);
+        const std::uint32_t* row = joe_kuo::initial_numbers;
+        for (auto& dim : init) {
+            dim.degree = static_cast<int>(*row++);
+            dim.coefficients = *row++;
+            dim.m.assign(row, row + dim.degree);
+            row += dim.degree;
+        }
+        initialize(dims, init, scramble, seed);
+    }
+
+    // Direction numbers read from a file in the format of Joe and Kuo: a header line, then one line
+    // "d s a m_1 ... m_s" per dimension d = 2, 3, ...
+    DigitalSequence(int dims, std::istream& direction_numbers, bool scramble = false, std::uint64_t seed = 0) {
+        if (dims <= 0) throw std::invalid_argument("Sequence dimension must be positive.");
+        std::vector<Initialization> init;
+        std::string line;
+        std::getline(direction_numbers, line);  // Header
+        while (static_cast<int>(init.size()) < dims - 1 && std::getline(direction_numbers, line)) {
+            std::istringstream fields(line);
+            int d;
+            Initialization dim;
+            if (!(fields >> d >> dim.degree >> dim.coefficients)) continue;
+            dim.m.resize(dim.degree);
+            for (auto& m : dim.m) fields >> m;
+            if (!fields || dim.degree <= 0 || dim.degree >= bits) {
+                throw std::invalid_argument("Malformed Sobol direction number line: " + line);
+            }
+            init.push_back(dim);
+        }
+        if (static_cast<int>(init.size()) < dims - 1) {
+            throw std::invalid_argument("Not enough Sobol direction numbers for the requested dimension.");
+        }
+        initialize(dims, init, scramble, seed);
+    }
+
+    int dims() const {
+        return n_dims;
+    }
+
+    // Index of the point returned by the next call to next()
+    std::uint64_t index() const {
+        return point_index - first_point;
+    }
+
+    // Jump to point n in O(dims * bits), using the Gray code of n
+    void skipTo(std::uint64_t n) {
+        n += first_point;
+        if (n >= (std::uint64_t(1) << bits)) throw std::out_of_range("Sequence index out of range.");
+        const std::uint64_t gray = n ^ (n >> 1);
+        for (int d = 0; d < n_dims; ++d) {
+            std::uint32_t x = shift[d];
+            for (int k = 0; k < bits; ++k) {
+                if ((gray >> k) & 1) x ^= directions[d * bits + k];
+            }
+            state[d] = x;
+        }
+        point_index = n;
+    }
+
+    // Writes the current point as uniforms in (0, 1) and advances to the next one; consecutive points
+    // differ in one Gray-code bit, so each step costs one XOR per dimension
+    void next(double* u) {
+        for (int d = 0; d < n_dims; ++d) {
+            u[d] = (state[d] + 0.5) * (1.0 / 4294967296.0);  // Offset by half a unit to avoid 0
+        }
+        const std::uint64_t n = ++point_index;
+        if (n >= (std::uint64_t(1) << bits)) throw std::out_of_range("Sequence exhausted.");
+        int c = 0;
+        while (((n >> c) & 1) == 0) ++c;
+        const std::uint32_t* v = &directions[c];
+        for (int d = 0; d < n_dims; ++d) {
+            state[d] ^= v[d * bits];
+        }
+    }
+
+private:
+    int n_dims;
+    std::vector<std::uint32_t> directions;  // v_k of dimension d at [d * bits + k - 1], most significant bit first
+    std::vector<std::uint32_t> shift;       // Digital shift of each dimension (zero unless scrambled)
+    std::vector<std::uint32_t> state;       // Current point, as 32-bit fractions
+    std::uint64_t point_index;              // Index in the underlying sequence, which skips the origin unless scrambled
+    std::uint64_t first_point;
+
+    static std::uint64_t splitMix(std::uint64_t& x) {
+        std::uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    void initialize(int dims, const std::vector<Initialization>& init, bool scramble, std::uint64_t seed) {
+        n_dims = dims;
+        directions.assign(dims * bits, 0);
+        for (int k = 0; k < bits; ++k) {
+            directions[k] = 1u << (bits - 1 - k);
+        }
+        for (int d = 1; d < dims; ++d) {
+            const Initialization& dim = init[d - 1];
+            const int s = dim.degree;
+            std::vector<std::uint32_t> m(bits + 1);
+            for (int k = 1; k <= s && k <= bits; ++k) {
+                if (dim.m[k - 1] % 2 == 0 || dim.m[k - 1] >= (std::uint64_t(1) << k)) {
+                    throw std::invalid_argument("Initial direction numbers must be odd and below 2^k.");
+                }
+                m[k] = dim.m[k - 1];
+            }
+            // m_k = 2 a_1 m_(k-1) ^ 4 a_2 m_(k-2) ^ ... ^ 2^s m_(k-s) ^ m_(k-s)
+            for (int k = s + 1; k <= bits; ++k) {
+                std::uint32_t value = m[k - s] ^ (m[k - s] << s);
+                for (int j = 1; j < s; ++j) {
+                    if ((dim.coefficients >> (s - 1 - j)) & 1) value ^= m[k - j] << j;
+                }
+                m[k] = value;
+            }
+            for (int k = 1; k <= bits; ++k) {
+                directions[d * bits + k - 1] = m[k] << (bits - k);
+            }
+        }
+
+        shift.assign(dims, 0);
+        if (scramble) {
+            std::uint64_t stream = seed;
+            for (int d = 0; d < dims; ++d) {
+                // Random unit lower-triangular matrix L acting on the binary digits, most significant first:
+                // digit j of L v is the parity of the digits i <= j of v selected by row j
+                std::uint32_t rows[bits];
+                for (int j = 0; j < bits; ++j) {
+                    const std::uint32_t below = j == 0 ? 0 : static_cast<std::uint32_t>(splitMix(stream)) & ~((1u << (bits - j)) - 1);
+                    rows[j] = below | (1u << (bits - 1 - j));
+                }
+                for (int k = 0; k < bits; ++k) {
+                    const std::uint32_t v = directions[d * bits + k];
+                    std::uint32_t scrambled = 0;
+                    for (int j = 0; j < bits; ++j) {
+                        std::uint32_t parity = v & rows[j];
+                        parity ^= parity >> 16;
+                        parity ^= parity >> 8;
+                        parity ^= parity >> 4;
+                        parity ^= parity >> 2;
+                        parity ^= parity >> 1;
+                        scrambled |= (parity & 1) << (bits - 1 - j);
+                    }
+                    directions[d * bits + k] = scrambled;
+                }
+                shift[d] = static_cast<std::uint32_t>(splitMix(stream));
+            }
+        }
+        first_point = scramble ? 0 : 1;
+        state.assign(dims, 0);
+        skipTo(0);
+    }
+};
+
+// Brownian-bridge construction of a Wiener path on the time grid
+// t_1 < ... < t_n (t_0 = 0). The first input normal sets W(t_n), the next
+// ones fill in the midpoints of ever finer intervals, so the leading
+// coordinates of a low-discrepancy point determine the large-scale shape of
+// the path. The output is returned as standardized increments
+// (W(t_k) - W(t_(k-1))) / sqrt(t_k - t_(k-1)), i.e. as independent normals
+// in time order, ready to be fed to a model step by step.
+class BrownianBridge {
+public:
+    explicit BrownianBridge(const std::vector<double>& step_sizes)
+        : n(static_cast<int>(step_sizes.size())), times(n), sqrt_dt(n),
+          bridge_index(n), left_index(n), right_index(n), left_weight(n), right_weight(n), std_dev(n) {
+        if (n == 0) throw std::invalid_argument("Brownian bridge needs at least one step.");
+        double t = 0.0;
+        for (int k = 0; k < n; ++k) {
+            if (!(step_sizes[k] > 0.0)) throw std::invalid_argument("Brownian bridge step sizes must be positive.");
+            t += step_sizes[k];
+            times[k] = t;
+            sqrt_dt[k] = std::sqrt(step_sizes[k]);
+        }
+
+        // Construction order of Glasserman (2004), as in QuantLib: fill the midpoint of each
+        // unfilled gap in turn, sweeping left to right
+        std::vector<int> filled(n, 0);
+        filled[n - 1] = 1;
+        bridge_index[0] = n - 1;
+        std_dev[0] = std::sqrt(times[n - 1]);
+        left_weight[0] = right_weight[0] = 0.0;
+        for (int j = 0, i = 1; i < n; ++i) {
+            while (filled[j]) ++j;  // First unfilled point
+            int k = j;
+            while (!filled[k]) ++k;  // Next filled point to its right
+            const int l = j + ((k - 1 - j) >> 1);
+            filled[l] = i;
+            bridge_index[i] = l;
+            left_index[i] = j;
+            right_index[i] = k;
+            const double t_left = j == 0 ? 0.0 : times[j - 1];
+            left_weight[i] = (times[k] - times[l]) / (times[k] - t_left);
+            right_weight[i] = (times[l] - t_left) / (times[k] - t_left);
+            std_dev[i] = std::sqrt((times[l] - t_left) * (times[k] - times[l]) / (times[k] - t_left));
+            j = k + 1;
+            if (j >= n) j = 0;
+        }
+    }
+
+    int size() const {
+        return n;
+    }
+
+    // Transforms n_paths paths at once: normal k of path p is z[k * z_stride + p] and standardized
+    // increment k of path p is written to out[k * out_stride + p]. The loops run across paths.
+    void transform(const double* z, int z_stride, double* out, int out_stride, int n_paths) const {
+        double* w = out + static_cast<size_t>(n - 1) * out_stride;
+        for (int p = 0; p < n_paths; ++p) {
+            w[p] = std_dev[0] * z[p];
+        }
+        for (int i = 1; i < n; ++i) {
+            const double* zi = z + static_cast<size_t>(i) * z_stride;
+            const double* right = out + static_cast<size_t>(right_index[i]) * out_stride;
+            double* wl = out + static_cast<size_t>(bridge_index[i]) * out_stride;
+            const double rw = right_weight[i], sd = std_dev[i];
+            if (left_index[i] != 0) {
+                const double* left = out + static_cast<size_t>(left_index[i] - 1) * out_stride;
+                const double lw = left_weight[i];
+                for (int p = 0; p < n_paths; ++p) {
+                    wl[p] = lw * left[p] + rw * right[p] + sd * zi[p];
+                }
+            }
+            else {
+                for (int p = 0; p < n_paths; ++p) {
+                    wl[p] = rw * right[p] + sd * zi[p];
+                }
+            }
+        }
+        // Turn the path into standardized increments, last step first
+        for (int k = n - 1; k >= 0; --k) {
+            double* wk = out + static_cast<size_t>(k) * out_stride;
+            const double scale = 1.0 / sqrt_dt[k];
+            if (k > 0) {
+                const double* wprev = wk - out_stride;
+                for (int p = 0; p < n_paths; ++p) {
+                    wk[p] = (wk[p] - wprev[p]) * scale;
+                }
+            }
+            else {
+                for (int p = 0; p < n_paths; ++p) {
+                    wk[p] *= scale;
+                }
+            }
+        }
+    }
+
+private:
+    int n;
+    std::vector<double> times, sqrt_dt;
+    std::vector<int> bridge_index, left_index, right_index;
+    std::vector<double> left_weight, right_weight, std_dev;
+};
+
+#endif
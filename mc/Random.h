@@ -0,0 +1,172 @@
+#ifndef MC_RANDOM_H
+#define MC_RANDOM_H
+
+#include <cmath>
+#include <cstdint>
+
+// Counter-based random numbers for Monte Carlo simulation. Every normal draw
+// is a pure function of (seed, path, step, dimension), so any draw can be
+// generated in O(1) without touching the others: parallel workers need no
+// stream splitting and results do not depend on how paths are batched.
+//
+// Uniforms come from the Philox4x32-10 generator of Salmon et al. (2011),
+// "Parallel random numbers: as easy as 1, 2, 3", and are turned into normals
+// with the inverse normal CDF of Wichura (1988), algorithm AS241, accurate to
+// about 1e-16. The bulk fill functions run the generator and the central
+// branch of the inverse CDF in branch-free loops over the buffer, which the
+// compiler vectorizes (4 lanes with AVX2); only the ~15% of draws in the
+// tails go through a scalar fix-up.
+
+namespace detail {
+
+// One Philox4x32-10 block: encrypts the 128-bit counter (c0, c1, c2, c3)
+// with the 64-bit key (k0, k1) in place
+inline void philox4x32(std::uint32_t& c0, std::uint32_t& c1, std::uint32_t& c2, std::uint32_t& c3,
+                       std::uint32_t k0, std::uint32_t k1) {
+    const std::uint32_t M0 = 0xD2511F53u, M1 = 0xCD9E8D57u;
+    const std::uint32_t W0 = 0x9E3779B9u, W1 = 0xBB67AE85u;
+    for (int round = 0; round < 10; ++round) {
+        const std::uint64_t p0 = static_cast<std::uint64_t>(M0) * c0;
+        const std::uint64_t p1 = static_cast<std::uint64_t>(M1) * c2;
+        const std::uint32_t hi0 = static_cast<std::uint32_t>(p0 >> 32), lo0 = static_cast<std::uint32_t>(p0);
+        const std::uint32_t hi1 = static_cast<std::uint32_t>(p1 >> 32), lo1 = static_cast<std::uint32_t>(p1);
+        c0 = hi1 ^ c1 ^ k0;
+        c1 = lo1;
+        c2 = hi0 ^ c3 ^ k1;
+        c3 = lo0;
+        k0 += W0;
+        k1 += W1;
+    }
+}
+
+// Uniform in the open interval (0, 1) from the top 53 bits of (hi, lo)
+inline double toUniform(std::uint32_t hi, std::uint32_t lo) {
+    const std::uint64_t bits = ((static_cast<std::uint64_t>(hi) << 32) | lo) >> 11;
+    return (static_cast<double>(bits) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+// Central region of AS241, valid for |u - 0.5| <= 0.425
+inline double inverseNormalCentral(double u) {
+    const double q = u - 0.5;
+    const double r = 0.180625 - q * q;
+    return q * (((((((r * 2509.0809287301226727 + 33430.575583588128105) * r + 67265.770927008700853) * r
+                    + 45921.953931549871457) * r + 13731.693765509461125) * r + 1971.5909503065514427) * r
+                 + 133.14166789178437745) * r + 3.387132872796366608)
+        / (((((((r * 5226.495278852545925 + 28729.085735721942674) * r + 39307.89580009271061) * r
+               + 21213.794301586595867) * r + 5394.1960214247511077) * r + 687.1870074920579083) * r
+            + 42.313330701600911252) * r + 1.0);
+}
+
+// Tail regions of AS241, for |u - 0.5| > 0.425
+inline double inverseNormalTail(double u) {
+    const double q = u - 0.5;
+    double r = q < 0.0 ? u : 1.0 - u;
+    r = std::sqrt(-std::log(r));
+    double x;
+    if (r <= 5.0) {
+        r -= 1.6;
+        x = (((((((r * 7.7454501427834140764e-4 + 0.0227238449892691845833) * r + 0.24178072517745061177) * r
+                 + 1.27045825245236838258) * r + 3.64784832476320460504) * r + 5.7694972214606914055) * r
+              + 4.6303378461565452959) * r + 1.42343711074968357734)
+            / (((((((r * 1.05075007164441684324e-9 + 5.475938084995344946e-4) * r + 0.0151986665636164571966) * r
+                   + 0.14810397642748007459) * r + 0.68976733498510000455) * r + 1.6763848301838038494) * r
+                + 2.05319162663775882187) * r + 1.0);
+    }
+    else {
+        r -= 5.0;
+        x = (((((((r * 2.01033439929228813265e-7 + 2.71155556874348757815e-5) * r + 0.0012426609473880784386) * r
+                 + 0.026532189526576123093) * r + 0.29656057182850489123) * r + 1.7848265399172913358) * r
+              + 5.4637849111641143699) * r + 6.6579046435011037772)
+            / (((((((r * 2.04426310338993978564e-15 + 1.4215117583164458887e-7) * r + 1.8463183175100546818e-5) * r
+                   + 7.868691311456132591e-4) * r + 0.0148753612908506148525) * r + 0.13692988092273580531) * r
+                + 0.59983220655588793769) * r + 1.0);
+    }
+    return q < 0.0 ? -x : x;
+}
+
+} // namespace detail
+
+// Inverse of the standard normal cumulative distribution function, for u in (0, 1)
+inline double inverseNormalCdf(double u) {
+    return std::fabs(u - 0.5) <= 0.425 ? detail::inverseNormalCentral(u) : detail::inverseNormalTail(u);
+}
+
+// Standard normal draws addressed by (path, step, dimension). One Philox
+// block yields the normals of two consecutive dimensions: the counter is
+// (dimension / 2, step, path low word, path high word) and the key is the
+// seed. The generator holds no mutable state, so one instance can be shared
+// by any number of threads.
+class NormalGenerator {
+private:
+    std::uint32_t key0, key1;
+
+public:
+    explicit NormalGenerator(std::uint64_t seed = 0)
+        : key0(static_cast<std::uint32_t>(seed)), key1(static_cast<std::uint32_t>(seed >> 32)) {}
+
+    // A single draw
+    double operator()(std::uint64_t path, std::uint32_t step, std::uint32_t dim) const {
+        std::uint32_t c0 = dim / 2, c1 = step;
+        std::uint32_t c2 = static_cast<std::uint32_t>(path), c3 = static_cast<std::uint32_t>(path >> 32);
+        detail::philox4x32(c0, c1, c2, c3, key0, key1);
+        return dim % 2 == 0 ? inverseNormalCdf(detail::toUniform(c0, c1))
+                            : inverseNormalCdf(detail::toUniform(c2, c3));
+    }
+
+    // Normals of dimensions [0, dims) of one path at one step
+    void fill(std::uint64_t path, std::uint32_t step, int dims, double* out) const {
+        fillBatch(path, 1, step, dims, out);
+    }
+
+    // Normals of dimensions [0, dims) of paths [first_path, first_path + n_paths) at one step, in
+    // structure-of-arrays layout: out[i * n_paths + p] is dimension i of path first_path + p
+    void fillBatch(std::uint64_t first_path, int n_paths, std::uint32_t step, int dims, double* out) const {
+        const std::uint32_t k0 = key0, k1 = key1;
+        for (int i = 0; i < dims; i += 2) {
+            // The first half of each block feeds the even dimension and the second half the odd one
+            double* even = out + static_cast<size_t>(i) * n_paths;
+            double* odd = even + n_paths;
+            const std::uint32_t pair = i / 2;
+            if (i + 1 < dims) {
+                for (int p = 0; p < n_paths; ++p) {
+                    const std::uint64_t path = first_path + p;
+                    std::uint32_t c0 = pair, c1 = step;
+                    std::uint32_t c2 = static_cast<std::uint32_t>(path), c3 = static_cast<std::uint32_t>(path >> 32);
+                    detail::philox4x32(c0, c1, c2, c3, k0, k1);
+                    even[p] = detail::toUniform(c0, c1);
+                    odd[p] = detail::toUniform(c2, c3);
+                }
+            }
+            else {
+                for (int p = 0; p < n_paths; ++p) {
+                    const std::uint64_t path = first_path + p;
+                    std::uint32_t c0 = pair, c1 = step;
+                    std::uint32_t c2 = static_cast<std::uint32_t>(path), c3 = static_cast<std::uint32_t>(path >> 32);
+                    detail::philox4x32(c0, c1, c2, c3, k0, k1);
+                    even[p] = detail::toUniform(c0, c1);
+                }
+            }
+        }
+        toNormals(out, dims * n_paths);
+    }
+
+    // Maps uniforms in (0, 1) to normals in place. Works through the array in chunks: the central branch
+    // is evaluated for every element in a vectorizable loop, then the tails are fixed up.
+    static void toNormals(double* x, int n) {
+        const int chunk = 256;
+        double u[chunk];
+        for (int start = 0; start < n; start += chunk) {
+            const int m = n - start < chunk ? n - start : chunk;
+            double* y = x + start;
+            for (int j = 0; j < m; ++j) {
+                u[j] = y[j];
+                y[j] = detail::inverseNormalCentral(u[j]);
+            }
+            for (int j = 0; j < m; ++j) {
+                if (std::fabs(u[j] - 0.5) > 0.425) y[j] = detail::inverseNormalTail(u[j]);
+            }
+        }
+    }
+};
+
+#endif
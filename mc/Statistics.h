@@ -0,0 +1,121 @@
+#ifndef MC_STATISTICS_H
+#define MC_STATISTICS_H
+
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+// Streaming mean, variance and (optionally) covariance of vector-valued
+// samples, updated one sample at a time with Welford's algorithm so that no
+// samples are stored and no precision is lost to large sums of squares.
+// Accumulators of disjoint sample sets can be merged (Chan, Golub and
+// LeVeque, 1979); merging per-batch accumulators in a fixed order makes the
+// result independent of how the batches were scheduled.
+class RunningStatistics {
+private:
+    size_t n_dims;
+    bool with_covariance;
+    double n;                  // Number of samples, as a double for the update formulas
+    std::vector<double> means;
+    std::vector<double> m2;    // Sums of squared deviations: the diagonal, or the full matrix with covariance
+    std::vector<double> delta; // Scratch for add()
+
+    size_t at(size_t i, size_t j) const {
+        return with_covariance ? i * n_dims + j : i;
+    }
+
+public:
+    explicit RunningStatistics(size_t dims = 0, bool covariance = false)
+        : n_dims(dims), with_covariance(covariance), n(0.0), means(dims, 0.0),
+          m2(covariance ? dims * dims : dims, 0.0), delta(dims) {}
+
+    size_t dims() const {
+        return n_dims;
+    }
+
+    size_t count() const {
+        return static_cast<size_t>(n);
+    }
+
+    // Adds one sample of dims() values
+    void add(const double* x) {
+        n += 1.0;
+        const double inv_n = 1.0 / n;
+        for (size_t i = 0; i < n_dims; ++i) {
+            delta[i] = x[i] - means[i];
+            means[i] += delta[i] * inv_n;
+        }
+        if (with_covariance) {
+            // M2_ij += (x_i - old mean_i)(x_j - new mean_j)
+            for (size_t i = 0; i < n_dims; ++i) {
+                for (size_t j = 0; j < n_dims; ++j) {
+                    m2[i * n_dims + j] += delta[i] * (x[j] - means[j]);
+                }
+            }
+        }
+        else {
+            for (size_t i = 0; i < n_dims; ++i) {
+                m2[i] += delta[i] * (x[i] - means[i]);
+            }
+        }
+    }
+
+    void add(const std::vector<double>& x) {
+        if (x.size() != n_dims) throw std::invalid_argument("Sample size must match the number of dimensions.");
+        add(x.data());
+    }
+
+    // Folds in the samples of another accumulator of the same shape
+    void merge(const RunningStatistics& other) {
+        if (other.n_dims != n_dims || other.with_covariance != with_covariance) {
+            throw std::invalid_argument("Cannot merge statistics of different shapes.");
+        }
+        if (other.n == 0.0) return;
+        if (n == 0.0) {
+            *this = other;
+            return;
+        }
+        const double total = n + other.n;
+        const double weight = n * other.n / total;
+        for (size_t i = 0; i < n_dims; ++i) {
+            delta[i] = other.means[i] - means[i];
+        }
+        for (size_t i = 0; i < n_dims; ++i) {
+            if (with_covariance) {
+                for (size_t j = 0; j < n_dims; ++j) {
+                    m2[i * n_dims + j] += other.m2[i * n_dims + j] + delta[i] * delta[j] * weight;
+                }
+            }
+            else {
+                m2[i] += other.m2[i] + delta[i] * delta[i] * weight;
+            }
+        }
+        for (size_t i = 0; i < n_dims; ++i) {
+            means[i] += delta[i] * other.n / total;
+        }
+        n = total;
+    }
+
+    double mean(size_t i) const {
+        return means[i];
+    }
+
+    // Unbiased sample variance; zero with fewer than two samples
+    double variance(size_t i) const {
+        return n > 1.0 ? m2[at(i, i)] / (n - 1.0) : 0.0;
+    }
+
+    // Standard error of the mean, assuming independent samples
+    double standardError(size_t i) const {
+        return n > 0.0 ? std::sqrt(variance(i) / n) : 0.0;
+    }
+
+    // Unbiased sample covariance; only available when constructed with covariance
+    double covariance(size_t i, size_t j) const {
+        if (!with_covariance) throw std::logic_error("Covariance was not accumulated.");
+        return n > 1.0 ? m2[i * n_dims + j] / (n - 1.0) : 0.0;
+    }
+};
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef MC_THREAD_POOL_H
+#define MC_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads. parallelFor() hands the task indices
+// [0, num_tasks) out to the workers on a first-come basis and blocks until
+// all of them have run. The calling thread takes part in the work as worker
+// 0, so a pool of size 1 runs everything inline without any threads.
+class ThreadPool {
+public:
+    typedef std::function<void(int task, int worker)> Task;
+
+    // num_threads <= 0 means one thread per hardware core
+    explicit ThreadPool(int num_threads = 0)
+        : job(nullptr), num_tasks(0), next_task(0), busy_workers(0), generation(0), stop(false) {
+        if (num_threads <= 0) {
+            num_threads = static_cast<int>(std::thread::hardware_concurrency());
+            if (num_threads <= 0) num_threads = 1;
+        }
+        for (int worker = 1; worker < num_threads; ++worker) {
+            workers.emplace_back(&ThreadPool::workerLoop, this, worker);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto& thread : workers) {
+            thread.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Number of workers, including the calling thread
+    int size() const {
+        return static_cast<int>(workers.size()) + 1;
+    }
+
+    // Run fn(task, worker) for every task in [0, num_tasks). The worker
+    // index is in [0, size()) and identifies the thread the task runs on,
+    // so it can be used to index per-thread scratch data. The first
+    // exception thrown by a task is rethrown here once all workers are idle.
+    void parallelFor(int n, const Task& fn) {
+        if (n <= 0) return;
+        if (workers.empty()) {
+            for (int task = 0; task < n; ++task) fn(task, 0);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            num_tasks = n;
+            next_task = 0;
+            error = nullptr;
+            busy_workers = static_cast<int>(workers.size());
+            ++generation;
+        }
+        wake.notify_all();
+        runTasks(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return busy_workers == 0; });
+        job = nullptr;
+        if (error) {
+            std::exception_ptr e = error;
+            error = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+private:
+    void workerLoop(int worker) {
+        unsigned long seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this, seen] { return stop || generation != seen; });
+                if (stop) return;
+                seen = generation;
+            }
+            runTasks(worker);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--busy_workers == 0) done.notify_one();
+            }
+        }
+    }
+
+    void runTasks(int worker) {
+        for (;;) {
+            int task = next_task.fetch_add(1);
+            if (task >= num_tasks) break;
+            try {
+                (*job)(task, worker);
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) error = std::current_exception();
+                next_task = num_tasks;  // Skip the remaining tasks
+            }
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;   // Signals workers that a job is ready
+    std::condition_variable done;   // Signals the caller that workers are idle
+    const Task* job;                // Job currently being run
+    int num_tasks;                  // Number of tasks in the current job
+    std::atomic<int> next_task;     // Next task index to hand out
+    int busy_workers;               // Workers still running the current job
+    unsigned long generation;       // Incremented for every new job
+    bool stop;                      // Set by the destructor
+    std::exception_ptr error;       // First exception thrown by a task
+};
+
+#endif